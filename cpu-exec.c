@@ -498,6 +498,9 @@ int cpu_exec(CPUState *cpu)
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
+#if defined(CONFIG_LLVM)
+                llvm_handle_request(cpu->env_ptr);
+#endif
                 tb_lock();
                 tb = tb_find_fast(cpu);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
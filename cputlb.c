@@ -47,8 +47,36 @@
 /* statistics */
 int tlb_flush_count;
 
+/* Adjust the number of TLB entries in use of an MMU mode. This is done only
+ * when all entries of the mode are flushed, so that a valid entry is always
+ * reached with the mask it was filled with. The TLB grows if most entries
+ * were refilled since the last flush and shrinks if few of them were. */
+static inline void tlb_resize(CPUArchState *env, int mmu_idx)
+{
+#if defined(ENABLE_TLB_RESIZE)
+    size_t n = tlb_n_entries(env, mmu_idx);
+    size_t refill = env->tlb_refill[mmu_idx];
+
+    env->tlb_refill[mmu_idx] = 0;
+    if (n < (1 << CPU_TLB_DYN_MIN_BITS)) {
+        n = 1 << MIN(CPU_TLB_DYN_DEFAULT_BITS, CPU_TLB_BITS);
+    } else if (refill > n / 4 * 3 && n < CPU_TLB_SIZE) {
+        n <<= 1;
+    } else if (refill < n / 8 && n > (1 << CPU_TLB_DYN_MIN_BITS)) {
+        n >>= 1;
+    }
+    env->tlb_mask[mmu_idx] = (uintptr_t)(n - 1) << CPU_TLB_ENTRY_BITS;
+#endif
+}
+
 static inline void tlb_reset(CPUArchState *env)
 {
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_resize(env, mmu_idx);
+    }
+
 #if defined(ENABLE_TLBVERSION)
     tlbaddr_t version = env->tlb_version >> TLB_VERSION_SHIFT;
     if (++version == TLB_VERSION_SIZE) {
@@ -58,7 +86,11 @@ static inline void tlb_reset(CPUArchState *env)
     }
     env->tlb_version = version << TLB_VERSION_SHIFT;
 #else
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
+    /* Only the entries in use need to be invalidated. */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        memset(env->tlb_table[mmu_idx], -1,
+               tlb_n_entries(env, mmu_idx) * sizeof(CPUTLBEntry));
+    }
     memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
 #endif
 }
@@ -120,7 +152,9 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
         printf(" %d", mmu_idx);
 #endif
 
-        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+        tlb_resize(env, mmu_idx);
+        memset(env->tlb_table[mmu_idx], -1,
+               tlb_n_entries(env, mmu_idx) * sizeof(CPUTLBEntry));
         memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
     }
 
@@ -178,9 +212,10 @@ static int tlb_flush_large_page(CPUState *cpu, target_ulong addr)
 
     for (i = 0; i < num_base_pages; i++) {
         flush_addr = addr + i * TARGET_PAGE_SIZE;
-        j = (flush_addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            j = tlb_index(env, mmu_idx, flush_addr);
             tlb_flush_entry(env, &env->tlb_table[mmu_idx][j], flush_addr);
+        }
 
         /* check whether there are entries that need to be flushed in the vtlb */
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -230,8 +265,8 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     cpu->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        i = tlb_index(env, mmu_idx, addr);
         tlb_flush_entry(env, &env->tlb_table[mmu_idx][i], addr);
     }
 
@@ -274,7 +309,6 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
     cpu->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
 
     for (;;) {
         int mmu_idx = va_arg(argp, int);
@@ -287,6 +321,7 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
         printf(" %d", mmu_idx);
 #endif
 
+        i = tlb_index(env, mmu_idx, addr);
         tlb_flush_entry(env, &env->tlb_table[mmu_idx][i], addr);
 
         /* check whether there are vltb entries that need to be flushed */
@@ -357,7 +392,7 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         unsigned int i;
 
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
+        for (i = 0; i < tlb_n_entries(env, mmu_idx); i++) {
             tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                   start1, length);
         }
@@ -386,8 +421,8 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        i = tlb_index(env, mmu_idx, vaddr);
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr, tlb_version(env));
     }
 
@@ -474,8 +509,11 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
+#if defined(ENABLE_TLB_RESIZE)
+    env->tlb_refill[mmu_idx]++;
+#endif
 
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
@@ -543,11 +581,12 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     MemoryRegion *mr;
     CPUState *cpu = ENV_GET_CPU(env1);
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1, true);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  page_val(addr, env1))) {
         cpu_ldub_code(env1, addr);
+        page_index = tlb_index(env1, mmu_idx, addr);
     }
     pd = env1->iotlb[mmu_idx][page_index].addr & ~TARGET_PAGE_MASK;
     mr = iotlb_to_region(cpu, pd);
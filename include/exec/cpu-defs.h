@@ -133,7 +133,17 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+#if defined(ENABLE_TLB_RESIZE)
+#define CPU_COMMON_TLB_RESIZE \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    uint32_t tlb_refill[NB_MMU_MODES];                                  \
+
+#else
+#define CPU_COMMON_TLB_RESIZE
+#endif
+
 #define CPU_COMMON_TLB \
+    CPU_COMMON_TLB_RESIZE                                               \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
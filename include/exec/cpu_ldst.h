@@ -403,7 +403,7 @@ static inline void *tlb_vaddr_to_host(CPUArchState *env, target_ulong addr,
 #if defined(CONFIG_USER_ONLY)
     return g2h(vaddr);
 #else
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     CPUTLBEntry *tlbentry = &env->tlb_table[mmu_idx][index];
     tlbaddr_t tlb_addr;
     uintptr_t haddr;
@@ -94,8 +94,8 @@ glue(glue(glue(cpu_ld, USUFFIX), MEMSUFFIX), _ra)(CPUArchState *env,
 #endif
 
     addr = ptr;
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = CPU_MMU_INDEX;
+    page_index = tlb_index(env, mmu_idx, addr);
     if (unlikely(env->tlb_table[mmu_idx][page_index].ADDR_READ !=
                  page_val(addr, env))) {
         oi = make_memop_idx((TCGMemOp)SHIFT, mmu_idx);
@@ -131,8 +131,8 @@ glue(glue(glue(cpu_lds, SUFFIX), MEMSUFFIX), _ra)(CPUArchState *env,
 #endif
 
     addr = ptr;
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = CPU_MMU_INDEX;
+    page_index = tlb_index(env, mmu_idx, addr);
     if (unlikely(env->tlb_table[mmu_idx][page_index].ADDR_READ !=
                  page_val(addr, env))) {
         oi = make_memop_idx((TCGMemOp)SHIFT, mmu_idx);
@@ -167,8 +167,8 @@ glue(glue(glue(cpu_st, SUFFIX), MEMSUFFIX), _ra)(CPUArchState *env,
     TCGMemOpIdx oi;
 
     addr = ptr;
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = CPU_MMU_INDEX;
+    page_index = tlb_index(env, mmu_idx, addr);
     if (unlikely(env->tlb_table[mmu_idx][page_index].addr_write !=
                  page_val(addr, env))) {
         oi = make_memop_idx((TCGMemOp)SHIFT, mmu_idx);
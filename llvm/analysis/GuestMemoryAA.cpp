@@ -0,0 +1,144 @@
+/*
+ *  (C) 2016 by Computer System Laboratory, IIS, Academia Sinica, Taiwan.
+ *      See COPYRIGHT in top-level directory.
+ */
+
+#include "llvm-debug.h"
+#include "llvm-target.h"
+#include "llvm-opc.h"
+#include "llvm-pass.h"
+
+#if !defined(LLVM_V35) && !defined(LLVM_V38)
+#include "llvm/Analysis/AliasAnalysis.h"
+
+
+/*
+ * GuestMemoryAA answers alias queries between the two address spaces of a
+ * translated region: the CPU states, which are addressed through the `CPU'
+ * base register, and the guest memory, which is addressed through the guest
+ * base register in user mode or through the host address of a TLB hit in
+ * system mode. BasicAA cannot tell them apart because the guest memory is
+ * reached with inttoptr, so every guest store clobbers all cached states.
+ * Queries that cannot be classified are passed down to the next AA.
+ */
+class GuestMemoryAAResult : public AAResultBase<GuestMemoryAAResult> {
+    friend AAResultBase<GuestMemoryAAResult>;
+
+    enum {
+        LOC_UNKNOWN = 0,
+        LOC_STATE,      /* CPU state */
+        LOC_GUEST,      /* Guest memory */
+    };
+
+    IRFactory *IF;
+
+    /* Return true if the integer V may be computed from the CPU base. */
+    bool mayDeriveFromCPU(Value *V, Instruction *CPU, unsigned Depth) {
+        if (isa<Constant>(V) || isa<LoadInst>(V))
+            return false;
+        if (Depth == 0)
+            return true;
+
+        if (PtrToIntInst *PTI = dyn_cast<PtrToIntInst>(V)) {
+            Value *Obj = PTI->getPointerOperand()->stripPointerCasts();
+            return Obj != IF->getGuestBase();
+        }
+        if (isa<BinaryOperator>(V) || isa<ZExtInst>(V) ||
+            isa<SExtInst>(V) || isa<TruncInst>(V)) {
+            User *U = cast<User>(V);
+            for (auto &Op : U->operands())
+                if (mayDeriveFromCPU(Op, CPU, Depth - 1))
+                    return true;
+            return false;
+        }
+        return true;
+    }
+
+    /* Return true if the pointer is used by an access tagged as guest memory. */
+    bool isTaggedGuestMemory(Value *Ptr) {
+        for (auto U : Ptr->users()) {
+            Instruction *I = dyn_cast<Instruction>(U);
+            if (I && getPointerOperand(I) == Ptr && MDFactory::isGuestMemory(I))
+                return true;
+        }
+        return false;
+    }
+
+    /* Classify the memory location. `HasOff' is set if the location is at a
+     * constant offset `Off' from the CPU base. The offset can be negative
+     * because CPUState precedes CPUArchState. */
+    unsigned classify(const MemoryLocation &Loc, intptr_t &Off, bool &HasOff) {
+        Value *Ptr = const_cast<Value *>(Loc.Ptr);
+        HasOff = false;
+        Instruction *I = dyn_cast<Instruction>(Ptr);
+        if (!I)
+            return LOC_UNKNOWN;
+
+        Function &F = *I->getParent()->getParent();
+        Instruction *CPU = IF->getDefaultCPU(F);
+        if (!CPU)
+            return LOC_UNKNOWN;
+
+        const DataLayout *DL = &F.getParent()->getDataLayout();
+        Off = 0;
+        if (getBaseWithConstantOffset(DL, Ptr, Off) == CPU) {
+            HasOff = true;
+            return LOC_STATE;
+        }
+
+        Value *Obj = GetUnderlyingObject(Ptr, *DL, 0);
+        if (Obj == CPU)
+            return LOC_STATE;
+
+        /* The tag of the access is exact, so trust it before the address
+         * heuristic, which gives up on any address it cannot trace. */
+        if (Obj == IF->getGuestBase() || isTaggedGuestMemory(Ptr))
+            return LOC_GUEST;
+        if (IntToPtrInst *ITP = dyn_cast<IntToPtrInst>(Obj)) {
+            if (mayDeriveFromCPU(ITP->getOperand(0), CPU, 6))
+                return LOC_UNKNOWN;
+            return LOC_GUEST;
+        }
+        return LOC_UNKNOWN;
+    }
+
+public:
+    explicit GuestMemoryAAResult(IRFactory *IF) : AAResultBase(), IF(IF) {}
+
+    AliasResult alias(const MemoryLocation &LocA, const MemoryLocation &LocB) {
+        intptr_t OffA, OffB;
+        bool HasOffA, HasOffB;
+        unsigned A = classify(LocA, OffA, HasOffA);
+        unsigned B = classify(LocB, OffB, HasOffB);
+
+        if ((A == LOC_STATE && B == LOC_GUEST) ||
+            (A == LOC_GUEST && B == LOC_STATE))
+            return NoAlias;
+
+        /* Two accesses to the CPU state at constant offsets are disjoint if
+         * their ranges do not overlap. */
+        if (A == LOC_STATE && B == LOC_STATE && HasOffA && HasOffB &&
+            LocA.Size != MemoryLocation::UnknownSize &&
+            LocB.Size != MemoryLocation::UnknownSize) {
+            if (OffA + (intptr_t)LocA.Size <= OffB ||
+                OffB + (intptr_t)LocB.Size <= OffA)
+                return NoAlias;
+        }
+
+        return AAResultBase::alias(LocA, LocB);
+    }
+};
+
+ImmutablePass *llvm::createGuestMemoryAAWrapperPass(IRFactory *IF)
+{
+    auto Result = std::make_shared<GuestMemoryAAResult>(IF);
+    return createExternalAAWrapperPass(
+        [Result](Pass &P, Function &F, AAResults &AAR) {
+            AAR.addAAResult(*Result);
+        });
+}
+#endif
+
+/*
+ * vim: ts=8 sts=4 sw=4 expandtab
+ */
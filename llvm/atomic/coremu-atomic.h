@@ -53,15 +53,16 @@ do {                                                                        \
     CPUState *cpu = ENV_GET_CPU(__env1);                                    \
     int __mmu_idx, __index;                                                 \
     uintptr_t __retaddr;                                                    \
-    __index = (v_addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);            \
     /* get the CPL, hence determine the MMU mode */                         \
     __mmu_idx = cpu_mmu_index(__env1, false);                               \
+    __index = tlb_index(__env1, __mmu_idx, v_addr);                         \
     /* We use this function in the implementation of atomic instructions */ \
     /* and we are going to modify these memory. So we use addr_write. */    \
     if (unlikely(__env1->tlb_table[__mmu_idx][__index].addr_write           \
                 != ((v_addr & TARGET_PAGE_MASK) | tlb_version(__env1)))) {  \
         __retaddr = GETPC();                                                \
         tlb_fill(cpu, v_addr, 1, __mmu_idx, __retaddr);                     \
+        __index = tlb_index(__env1, __mmu_idx, v_addr);                     \
     }                                                                       \
     q_addr = v_addr + __env1->tlb_table[__mmu_idx][__index].addend;         \
 } while(0)
@@ -28,6 +28,10 @@ void helper_export_hqemu(CPUArchState *env)
     helper_lookup_ibtc(env);
     helper_lookup_cpbl(env);
     helper_validate_cpbl(env, 0, 0);
+    helper_region_exit(env, NULL);
+    helper_profile_target(env, NULL);
+    helper_profile_helper(env, NULL, NULL);
+    helper_check_guest_range(env, 0, 0, 0);
 
 #if defined(CONFIG_SOFTMMU) && defined(CONFIG_LLVM)
     target_ulong ptr = 0;
@@ -50,6 +54,7 @@ void helper_export_hqemu(CPUArchState *env)
     llvm_be_stw_mmu(env, ptr, 0, 0);
     llvm_be_stl_mmu(env, ptr, 0, 0);
     llvm_be_stq_mmu(env, ptr, 0, 0);
+    llvm_probe_write_mmu(env, ptr, 0);
 #endif
 }
 
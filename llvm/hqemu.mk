@@ -54,8 +54,12 @@ obj-y += $(PASS)/ProfileExec.o        \
          $(PASS)/FastMathPass.o       \
          $(PASS)/StateMappingPass.o   \
          $(PASS)/RedundantStateElimination.o   \
-         $(PASS)/SimplifyPointer.o
-obj-y += $(ANALYSIS)/InnerLoopAnalysis.o
+         $(PASS)/SimplifyPointer.o    \
+         $(PASS)/CombineVectorOps.o   \
+         $(PASS)/LoopVectorizeHint.o  \
+         $(PASS)/LazyConditionCode.o
+obj-y += $(ANALYSIS)/InnerLoopAnalysis.o \
+         $(ANALYSIS)/GuestMemoryAA.o
 
 # HPM
 obj-y += $(HPM)/pmu.o \
@@ -17,13 +17,22 @@
 #define ENABLE_PASSES
 #define ENABLE_MCJIT
 //#define ENABLE_HPM_THREAD
-//#define ENABLE_TLBVERSION
 //#define ENALBE_CPU_PROFILE
 //#define USE_TRACETREE_ONLY
 
+/* TLB versioning and TLB resizing are supported by the x86-64 and AArch64
+ * host backends. A TLB flush only bumps env->tlb_version instead of clearing
+ * the whole table, and the number of entries in use of each MMU mode is
+ * adjusted at flush time according to its refill count. */
+#if defined(HOST_X86_64) || defined(HOST_AARCH64)
+#  define ENABLE_TLBVERSION
+#  define ENABLE_TLB_RESIZE
+#endif
+
+
+#define ENABLE_TCG_VECTOR
 
 #if defined(CONFIG_USER_ONLY)
-#  define ENABLE_TCG_VECTOR
 #  define GUEST_BASE guest_base
 #else
 #  define GUEST_BASE (0UL)
@@ -68,6 +77,20 @@ typedef unsigned long tlbaddr_t;
 typedef target_ulong tlbaddr_t;
 #endif
 
+/* The TLB of each MMU mode uses the first tlb_n_entries() entries of
+ * tlb_table. env->tlb_mask[] holds (n_entries - 1) << CPU_TLB_ENTRY_BITS,
+ * which is also what the host backends load to index the table. */
+#if defined(ENABLE_TLB_RESIZE)
+#  define CPU_TLB_DYN_MIN_BITS    6
+#  define CPU_TLB_DYN_DEFAULT_BITS 8
+#  define tlb_n_entries(__env, __mmu_idx) \
+    (((__env)->tlb_mask[__mmu_idx] >> CPU_TLB_ENTRY_BITS) + 1)
+#else
+#  define tlb_n_entries(__env, __mmu_idx)  CPU_TLB_SIZE
+#endif
+#define tlb_index(__env, __mmu_idx, __addr) \
+    (((__addr) >> TARGET_PAGE_BITS) & (tlb_n_entries(__env, __mmu_idx) - 1))
+
 
 typedef int BlockID;
 typedef int TraceID;
@@ -75,15 +98,27 @@ typedef int TraceID;
 #define BUILD_TCG   ((uint16_t)1 << 0)
 #define BUILD_LLVM  ((uint16_t)1 << 1)
 
-#define CPU_OPTIMIZATION_COMMON \
-    unsigned long sp;           \
-    void *opt_link;             \
-    uint16_t build_mode;        \
-    int start_trace_prediction; \
-    int fallthrough;            \
-    uintptr_t image_base;       \
-    uint32_t restore_val;       \
-    uint64_t num_trace_exits;   \
+/* Shadow return stack of guest calls. */
+#define SHADOW_STACK_SIZE   16
+#define SHADOW_STACK_MASK   (SHADOW_STACK_SIZE - 1)
+
+#define CPU_OPTIMIZATION_COMMON                \
+    unsigned long sp;                          \
+    void *opt_link;                            \
+    void *ibtc_table;                          \
+    uintptr_t ibtc_mask;                       \
+    uint64_t ibtc_hit;                         \
+    uint32_t shadow_top;                       \
+    target_ulong shadow_pc[SHADOW_STACK_SIZE]; \
+    void *shadow_slot[SHADOW_STACK_SIZE];      \
+    void *shadow_fill;                         \
+    target_ulong shadow_fill_pc;               \
+    uint16_t build_mode;                       \
+    int start_trace_prediction;                \
+    int fallthrough;                           \
+    uintptr_t image_base;                      \
+    uint32_t restore_val;                      \
+    uint64_t num_trace_exits;                  \
 
 
 #define TB_OPTIMIZATION_COMMON                                     \
@@ -92,13 +127,24 @@ typedef int TraceID;
     int mode;               /* current state */                    \
     void *opt_ptr;          /* pointer to the optimized code */    \
     uint32_t exec_count;    /* trace profile execution count */    \
+    uint32_t hot_threshold; /* trace profile threshold */          \
+    uint32_t penalty;       /* count of useless traces */          \
     uint16_t patch_jmp;     /* offset of trace trampoline */       \
     uint16_t patch_next;    /* offset of trace prediction stub */  \
     target_ulong jmp_pc[2]; /* pc of the succeeding blocks */      \
+    target_ulong ret_pc;    /* return pc of the call ending it */  \
+    int branch_kind;        /* call or return ending the block */  \
     void *image;                                                   \
     void *state;                                                   \
-    void *chain;
+    void *chain;                                                   \
+    void *target;
+
 
+enum {
+    BRANCH_NONE = 0,
+    BRANCH_CALL,
+    BRANCH_RET,
+};
 
 enum {
     BLOCK_NONE = 0,
@@ -132,6 +178,7 @@ enum {
     A_None   = ((uint32_t)0),
     A_SetCC  = ((uint32_t)1 << 0),
     A_NoSIMDization = ((uint32_t)1 << 1),
+    A_NoStateMap = ((uint32_t)1 << 2),
 };
 
 #endif
@@ -6,5 +6,9 @@ DEF_HELPER_2(NET_profile, void, env, int)
 DEF_HELPER_2(NET_predict, void, env, int)
 DEF_HELPER_2(verify_tb, void, env, int)
 DEF_HELPER_3(profile_exec, void, env, ptr, int)
+DEF_HELPER_2(region_exit, void, env, ptr)
+DEF_HELPER_2(profile_target, void, env, ptr)
+DEF_HELPER_3(profile_helper, void, env, ptr, ptr)
+DEF_HELPER_4(check_guest_range, i32, env, i64, i64, i32)
 DEF_HELPER_1(timestamp_begin, void, i64)
 DEF_HELPER_1(timestamp_end, void, i64)
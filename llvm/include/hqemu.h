@@ -36,6 +36,7 @@ int lpt_reset(CPUArchState *env);
 int lpt_add_page(CPUArchState *env, target_ulong addr, target_ulong size);
 int lpt_search_page(CPUArchState *env, target_ulong addr, target_ulong *addrp, target_ulong *sizep);
 int lpt_flush_page(CPUArchState *env, target_ulong addr, target_ulong *addrp, target_ulong *sizep);
+int lpt_get_stats(CPUArchState *env, uint64_t *total, uint64_t *miss, unsigned *num_pages);
 
 
 /* Tracer */
@@ -51,6 +52,7 @@ int llvm_check_cache(void);
 int llvm_tb_flush(void);
 int llvm_tb_remove(TranslationBlock *tb);
 void llvm_handle_chaining(uintptr_t next_tb, TranslationBlock *tb);
+void llvm_handle_request(CPUArchState *env);
 int llvm_locate_trace(uintptr_t searched_pc);
 TranslationBlock *llvm_find_pc(CPUState *cpu, uintptr_t searched_pc);
 int llvm_restore_state(CPUState *cpu, TranslationBlock *tb, uintptr_t searched_pc);
@@ -16,13 +16,14 @@
 struct LoopMetadata {
     LoopMetadata()
         : Address(-1), Length(-1), VS(-1), VF(-1), Distance(INT_MIN), Start(-1),
-          End(-1), Stride(-1) {}
+          End(-1), Stride(-1), TripCount(0) {}
     target_ulong Address;
     uint32_t Length;
     uint32_t VS, VF;
     int Distance;
     int Start, End;
     int Stride;
+    uint64_t TripCount;
 };
 
 /*
@@ -42,6 +43,8 @@ public:
     LoopList Loops;
     LoopMetadata *getLoopAnnotation(target_ulong addr);
     bool hasLoopAnnotation(target_ulong addr);
+    void addLoopAnnotation(LoopMetadata *LoopMD);
+    int WriteXML(const char *name);
 };
 
 #endif
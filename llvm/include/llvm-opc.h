@@ -139,6 +139,7 @@ class TraceBuilder {
     OptimizationInfo *Opt;
     GraphNode *CurrNode;   /* The current CFG node to process */
     NodeBuildMap Nodes;
+    std::map<BasicBlock*, GraphNode*> BlockNodes;  /* Reverse map of Nodes */
     BranchList Branches;
     NodeVec NodeQueue;     /* CFG nodes to be translated */
     NodeSet NodeVisisted;
@@ -200,6 +201,7 @@ public:
         if (Nodes.find(gpc) == Nodes.end())
             hqemu_error("internal error.\n");
         Nodes[gpc].second = BB;
+        BlockNodes[BB] = Nodes[gpc].first;
     }
     void setBranch(BranchInst *BI, GraphNode *Node) {
         Branches.push_back(std::make_pair(BI, Node));
@@ -210,6 +212,10 @@ public:
     GraphNode *getNode(target_ulong gpc) {
         return Nodes.find(gpc) == Nodes.end() ? nullptr : Nodes[gpc].first;
     }
+    GraphNode *getNode(BasicBlock *BB) {
+        auto I = BlockNodes.find(BB);
+        return I == BlockNodes.end() ? nullptr : I->second;
+    }
     BasicBlock *getBasicBlock(GraphNode *Node) {
         target_ulong gpc = getGuestPC(Node);
         if (Nodes.find(gpc) == Nodes.end())
@@ -335,12 +341,14 @@ class IRFactory {
 
     StatePtrMap StatePtr;
     IVec InlineCalls;    /* Helpers to be inlined */
+    IVec ProfileCalls;   /* Helper profile calls to be bound to the trace */
     std::map<std::string, BasicBlock*> CommonBB;
     IVec IndirectBrs;
     IVec toErase;
     BBVec toSink;
     std::set<Function *> ClonedFuncs;
     bool runPasses;
+    bool VolatileGuestMemory;  /* Guest memory accesses are volatile */
 
     void CreateJIT();
     void DeleteJIT();
@@ -365,6 +373,8 @@ class IRFactory {
     /* Load/Store data from/to the guest memory. */
     Value *QEMULoad(Value *AddrL, Value *AddrH, TCGMemOpIdx oi);
     void QEMUStore(Value *Data, Value *AddrL, Value *AddrH, TCGMemOpIdx oi);
+    Value *QEMULoadVector(Value *Addr, VectorType *VectorTy, TCGArg MemArg);
+    void QEMUStoreVector(Value *Data, Value *Addr, TCGArg MemArg);
 
     Value *ConvertCPUType(Function *F, int Idx, Instruction *InsertPos);
     Value *ConvertCPUType(Function *F, int Idx, BasicBlock *InsertPos);
@@ -377,6 +387,10 @@ class IRFactory {
     }
 
     Value *ConcatTLBVersion(Value *GVA);
+    Value *LoadTLBMask(int mem_index, IntegerType *Ty);
+    Value *LookupTLB(Value *AddrL, Value *AddrH, int mem_index, int s_bits,
+                     bool IsWrite, BasicBlock *tlb_hit, BasicBlock *tlb_miss,
+                     BasicBlock *tlb_exit, Value *&GuestPC);
 
     /* Return the LLVM instruction that stores PC. For the guest's register
      * size larger than the host, replace the multiple store-PC instructions
@@ -402,12 +416,36 @@ class IRFactory {
 
     /* Link basic blocks of indirect branch. */
     void TraceLinkIndirectJump(GraphNode *NextNode, StoreInst *SI);
+    void TraceLinkIndirectExit(target_ulong pc, StoreInst *SI);
+
+    /* Inline the profiled targets of indirect branch. */
+    void TraceLinkProfiledTarget(GraphNode *CurrNode, StoreInst *SI);
+    void InsertProfileTarget(GraphNode *CurrNode);
+
+    /* Profile the helper calls that are not inlined. */
+    bool isHotHelper(HelperInfo *Helper, const std::string &FName);
+    void InsertProfileHelper(const std::string &FName);
 
     void InsertTimestampBegin(void);
     void InsertTimestampEnd(void);
 
     /* Insert code for IBTC hash table lookup. */
-    void InsertLookupIBTC(GraphNode *CurrNode);
+    void InsertLookupIBTC(GraphNode *CurrNode, Value *NextPC = nullptr);
+    BasicBlock *getLookupIBTCBlock();
+
+    /* Insert the inlined IBTC probe and fall back to MissBB on a miss. */
+    void InsertProbeIBTC(GraphNode *CurrNode, Value *NextPC, BasicBlock *MissBB);
+    void InsertJumpToBlock(GraphNode *CurrNode, Value *NextTB, Value *Cond,
+                           BasicBlock *MissBB, bool Timestamp,
+                           bool CountHit = false);
+
+    /* Insert code for the shadow return stack. */
+    void getShadowEntry(Value *Top, Value *&PCPtr, Value *&SlotPtr);
+    void InsertPushReturn(TranslationBlock *TB);
+    void InsertPopReturn(Value *&RetPC, Value *&RetSlot);
+    void InsertResetReturn();
+    void InsertProbeReturn(GraphNode *CurrNode, Value *NextPC, Value *RetPC,
+                           Value *RetSlot);
 
     /* Insert code for CPBL hash table lookup. */
     void InsertLookupCPBL(GraphNode *CurrNode);
@@ -433,11 +471,17 @@ class IRFactory {
 
     void Optimize(std::vector<uint16_t>&);
 
+    /* Determine if guest states are promoted for this region. */
+    bool isStateMappingEnabled();
+
     /* Legalize LLVM IR after running the pre-defined passes. */
     void PostProcess();
 
     void FinalizeObject();
 
+    /* Abort the compilation if the request is cancelled. */
+    bool isCancelled();
+
     void InitializeLLVMPasses(legacy::FunctionPassManager *FPM);
 
     void InitializeLLVMPasses(llvm::legacy::PassManager* MPM);
@@ -183,6 +183,9 @@ FunctionPass *createCombineGuestMemory(IRFactory *IF);
 FunctionPass *createCombineCasts(IRFactory *IF);
 FunctionPass *createCombineZExtTrunc();
 FunctionPass *createSimplifyPointer(IRFactory *IF);
+FunctionPass *createCombineVectorOps(IRFactory *IF);
+FunctionPass *createLoopVectorizeHint(IRFactory *IF);
+FunctionPass *createLazyConditionCode(IRFactory *IF);
 
 void initializeReplaceIntrinsicPass(llvm::PassRegistry&);
 void initializeFastMathPassPass(llvm::PassRegistry&);
@@ -193,8 +196,12 @@ void initializeCombineGuestMemoryPass(llvm::PassRegistry&);
 void initializeCombineCastsPass(llvm::PassRegistry&);
 void initializeCombineZExtTruncPass(llvm::PassRegistry&);
 void initializeSimplifyPointerPass(llvm::PassRegistry&);
+void initializeCombineVectorOpsPass(llvm::PassRegistry&);
+void initializeLoopVectorizeHintPass(llvm::PassRegistry&);
+void initializeLazyConditionCodePass(llvm::PassRegistry&);
 
 /* Analysis */
+ImmutablePass *createGuestMemoryAAWrapperPass(IRFactory *IF);
 void initializeInnerLoopAnalysisWrapperPassPass(llvm::PassRegistry&);
 }
 
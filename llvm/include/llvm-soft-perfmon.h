@@ -18,9 +18,10 @@
 #define SPM_HPM       ((uint64_t)1 << 4)
 #define SPM_EXIT      ((uint64_t)1 << 5)
 #define SPM_HOTSPOT   ((uint64_t)1 << 6)
+#define SPM_REGION    ((uint64_t)1 << 7)
 #define SPM_ALL       SPM_BASIC | SPM_TRACE | SPM_CACHE | SPM_PASS | SPM_HPM | \
-                      SPM_EXIT | SPM_HOTSPOT
-#define SPM_NUM       9
+                      SPM_EXIT | SPM_HOTSPOT | SPM_REGION
+#define SPM_NUM       10
 
 
 /*
@@ -36,13 +37,16 @@ public:
     uint64_t NumLoads;     /* Number of memory loads */
     uint64_t NumStores;    /* Number of memory stores */
     uint64_t NumTraceExits;    /* Count of trace exits */
+    uint64_t NumLPTFlush;      /* Large page flush checks */
+    uint64_t NumLPTFalseFlush; /* Large page flush checks with no page */
     uint64_t SampleTime;   /* Process time of the sampling handler. */
     unsigned CoverSet;
     std::vector<std::vector<uint64_t> *> SampleListVec;
 
     SoftwarePerfmon()
         : Mode(SPM_NONE), NumInsns(0), NumBranches(0), NumLoads(0), NumStores(0),
-          NumTraceExits(0), SampleTime(0), CoverSet(90) {}
+          NumTraceExits(0), NumLPTFlush(0), NumLPTFalseFlush(0), SampleTime(0),
+          CoverSet(90) {}
     SoftwarePerfmon(std::string &ProfileLevel) : SoftwarePerfmon() {
         ParseProfileMode(ProfileLevel);
     }
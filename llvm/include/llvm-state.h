@@ -10,6 +10,8 @@
 #ifndef __LLVM_STATE_H
 #define __LLVM_STATE_H
 
+#include "utils.h"
+
 #define COPY_STATE(_dst, _src, _e) do { _dst->_e = _src->_e; } while(0)
 
 /*
@@ -76,13 +78,13 @@ static inline void tcg_save_state(CPUArchState *env, TranslationBlock *tb)
 {
 #if defined(TARGET_I386) || defined(TARGET_X86_64)
     CPUState *cpu = ENV_GET_CPU(env);
-    struct i386_env *s = new struct i386_env;
+    struct i386_env *s = TBArena.create<struct i386_env>();
     COPY_STATE(s, cpu, singlestep_enabled);
     COPY_STATE(s, env, hflags);
     COPY_STATE(s, env, eflags);
 #elif defined(TARGET_ARM)
     CPUState *cpu = ENV_GET_CPU(env);
-    struct arm_env *s = new struct arm_env;
+    struct arm_env *s = TBArena.create<struct arm_env>();
     COPY_STATE(s, cpu, singlestep_enabled);
     COPY_STATE(s, env, cp15.c15_cpar);
     COPY_STATE(s, env, cp15.scr_el3);
@@ -92,7 +94,7 @@ static inline void tcg_save_state(CPUArchState *env, TranslationBlock *tb)
     COPY_STATE(s, env, aarch64);
 #elif defined(TARGET_PPC) || defined(TARGET_PPC64)
     CPUState *cpu = ENV_GET_CPU(env);
-    struct ppc_env *s = new struct ppc_env;
+    struct ppc_env *s = TBArena.create<struct ppc_env>();
     COPY_STATE(s, cpu, singlestep_enabled);
     COPY_STATE(s, env, msr);
     COPY_STATE(s, env, mmu_idx);
@@ -102,20 +104,20 @@ static inline void tcg_save_state(CPUArchState *env, TranslationBlock *tb)
     COPY_STATE(s, env, hflags);
 #elif defined(TARGET_SH4)
     CPUState *cpu = ENV_GET_CPU(env);
-    struct sh4_env *s = new struct sh4_env;
+    struct sh4_env *s = TBArena.create<struct sh4_env>();
     COPY_STATE(s, cpu, singlestep_enabled);
     COPY_STATE(s, env, sr);
     COPY_STATE(s, env, fpscr);
     COPY_STATE(s, env, features);
 #elif defined(TARGET_M68K)
     CPUState *cpu = ENV_GET_CPU(env);
-    struct m68k_env *s = new struct m68k_env;
+    struct m68k_env *s = TBArena.create<struct m68k_env>();
     COPY_STATE(s, cpu, singlestep_enabled);
     COPY_STATE(s, env, sr);
     COPY_STATE(s, env, fpcr);
 #elif defined(TARGET_MIPS)
     CPUState *cpu = ENV_GET_CPU(env);
-    struct mips_env *s = new struct mips_env;
+    struct mips_env *s = TBArena.create<struct mips_env>();
     COPY_STATE(s, cpu, singlestep_enabled);
     COPY_STATE(s, env, btarget);
 #else
@@ -178,12 +180,6 @@ static inline void tcg_copy_state(CPUArchState *env, TranslationBlock *tb)
 #endif
 }
 
-static inline void delete_state(TranslationBlock *tb)
-{
-    delete (cpustate *)tb->state;
-    tb->state = nullptr;
-}
-
 #undef COPY_STATE
 #endif  /* __LLVM_STATE_H */
 
@@ -107,6 +107,7 @@ Value *StripPointerWithConstantOffset(const DataLayout *DL, Value *Ptr,
                                       APInt &Offset, Value *GuestBase);
 Value *getBaseWithConstantOffset(const DataLayout *DL, Value *Ptr, intptr_t &Offset);
 void ProcessErase(IVec &toErase);
+bool hasHostFeature(const char *Name);
 
 #endif
 
@@ -7,6 +7,7 @@
 #define __LLVM_TRANSLATOR_H
 
 #include <map>
+#include <deque>
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/Analysis/CodeMetrics.h"
 #include "llvm-types.h"
@@ -81,7 +82,6 @@ struct HelperInfo {
  * the JIT listener.
  */
 class NotifyInfo {
-#define MAX_CHAINSLOT   256
 public:
     struct SlotInfo {
         size_t Key;
@@ -96,12 +96,7 @@ public:
         uintptr_t Addr;
     };
 
-    NotifyInfo() : Func(nullptr) {
-        ChainSlot = new SlotInfo[MAX_CHAINSLOT];
-    }
-    ~NotifyInfo() {
-        delete ChainSlot;
-    }
+    NotifyInfo() : Func(nullptr) {}
 
     Function *Func;        /* LLVM Function of this translation unit */
     TCGOp *Op;
@@ -109,7 +104,7 @@ public:
     uint16_t NumInsts;
     RestoreVec Restore;
     unsigned NumChainSlot;
-    SlotInfo *ChainSlot;
+    std::deque<SlotInfo> ChainSlot;  /* Elements are never moved when grown */
 
     uint32_t Size;         /* Size of the translated host code */
     uint8_t *Code;         /* Start PC of the translated host code */
@@ -120,16 +115,15 @@ public:
         Patches.clear();
         NumInsts = 0;
         NumChainSlot = 0;
+        ChainSlot.clear();
     }
     unsigned setChainSlot(size_t Key) {
-        if (NumChainSlot >= MAX_CHAINSLOT)
-            hqemu_error("run out of chain slot.\n");
-        unsigned Curr = NumChainSlot;
-        ChainSlot[NumChainSlot++].Key = Key;
-        return Curr;
+        SlotInfo Slot = { Key, 0 };
+        ChainSlot.push_back(Slot);
+        return NumChainSlot++;
     }
     uintptr_t getChainSlotAddr(unsigned Idx) {
-        if (NumChainSlot >= MAX_CHAINSLOT)
+        if (Idx >= NumChainSlot)
             hqemu_error("invalid chain slot index.\n");
         return (uintptr_t)&ChainSlot[Idx].Addr;
     }
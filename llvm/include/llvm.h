@@ -36,6 +36,132 @@ class TranslatedCode;
 
 typedef std::unique_ptr<OptimizationInfo> OptRequest;
 
+/*
+ * CodeIndex is a read-only snapshot of the translated traces sorted in code
+ * cache address order. It is published with RCU so that a host pc can be
+ * mapped to its trace without taking llvm_global_lock.
+ */
+struct CodeIndex {
+    struct rcu_head rcu;  /* Must be the first member */
+    std::vector<std::pair<uintptr_t, TranslatedCode *> > Entries;
+};
+
+
+/*
+ * ChainSlotTable keeps the address of the stubs for trace-to-block linking.
+ * Slots are allocated in fixed-size chunks that are never moved, so that the
+ * dispatcher can resolve a slot without locking while new slots are appended.
+ */
+class ChainSlotTable {
+#define CHAIN_CHUNK_BITS    12
+#define CHAIN_CHUNK_SIZE    (1 << CHAIN_CHUNK_BITS)
+#define CHAIN_MAX_CHUNKS    4096
+    uintptr_t *Chunks[CHAIN_MAX_CHUNKS];
+    size_t Size;  /* Number of allocated slots */
+
+public:
+    ChainSlotTable() : Chunks(), Size(0) {}
+    ~ChainSlotTable() {
+        for (unsigned i = 0; i < CHAIN_MAX_CHUNKS && Chunks[i]; ++i)
+            delete [] Chunks[i];
+    }
+
+    /* Allocate a new slot. The caller holds llvm_global_lock. */
+    size_t allocate() {
+        size_t Key = Size;
+        size_t Idx = Key >> CHAIN_CHUNK_BITS;
+        if (Idx >= CHAIN_MAX_CHUNKS)
+            hqemu_error("run out of chain slot.\n");
+        if (!Chunks[Idx]) {
+            uintptr_t *Chunk = new uintptr_t[CHAIN_CHUNK_SIZE]();
+            atomic_rcu_set(&Chunks[Idx], Chunk);
+        }
+        Size = Key + 1;
+        return Key;
+    }
+
+    /* Publish the patch address of a slot. */
+    void set(size_t Key, uintptr_t Addr) {
+        atomic_rcu_set(&Chunks[Key >> CHAIN_CHUNK_BITS][Key & (CHAIN_CHUNK_SIZE - 1)],
+                       Addr);
+    }
+
+    /* Get the address of a slot. The address does not change. */
+    uintptr_t *getAddr(size_t Key) {
+        return &Chunks[Key >> CHAIN_CHUNK_BITS][Key & (CHAIN_CHUNK_SIZE - 1)];
+    }
+
+    /* Get the patch address of a slot. This is lock-free. */
+    uintptr_t get(size_t Key) {
+        size_t Idx = Key >> CHAIN_CHUNK_BITS;
+        if (Idx >= CHAIN_MAX_CHUNKS)
+            return 0;
+        uintptr_t *Chunk = atomic_rcu_read(&Chunks[Idx]);
+        if (!Chunk)
+            return 0;
+        return atomic_rcu_read(&Chunk[Key & (CHAIN_CHUNK_SIZE - 1)]);
+    }
+
+    /* Reset all slots. The chunks are kept for reuse. This is only called
+     * when the code cache is flushed. */
+    void clear() {
+        for (unsigned i = 0; i < CHAIN_MAX_CHUNKS && Chunks[i]; ++i)
+            std::fill(Chunks[i], Chunks[i] + CHAIN_CHUNK_SIZE, 0);
+        Size = 0;
+    }
+};
+
+/*
+ * HelperProfile counts the executions of the helper calls that are not inlined
+ * in the traces, keyed by the guest block and the helper. The counters outlive
+ * the code cache flushes, so a trace rebuilt from the same blocks can inline
+ * the hot helpers.
+ */
+class HelperProfile {
+    typedef std::pair<target_ulong, std::string> Key;
+
+    hqemu::Mutex Lock;
+    std::map<Key, uint64_t *> Counters;
+    std::map<Key, unsigned> Rounds;    /* Traces the call is profiled in */
+    std::set<target_ulong> Rebuilt;    /* Entry pc of the rebuilt traces */
+
+public:
+    ~HelperProfile() {
+        for (auto &C : Counters)
+            delete C.second;
+    }
+
+    /* Get the counter of the helper called in the block at pc, creating it
+     * if it does not exist. The address of a counter does not change. Each
+     * call counts one more trace the helper call is profiled in. */
+    uint64_t *getCounter(target_ulong pc, const std::string &Name) {
+        hqemu::MutexGuard locked(Lock);
+        uint64_t *&Counter = Counters[Key(pc, Name)];
+        if (!Counter)
+            Counter = new uint64_t(0);
+        Rounds[Key(pc, Name)]++;
+        return Counter;
+    }
+    /* Return true if the call has been profiled in Limit traces already. */
+    bool isCold(target_ulong pc, const std::string &Name, unsigned Limit) {
+        hqemu::MutexGuard locked(Lock);
+        auto I = Rounds.find(Key(pc, Name));
+        return I != Rounds.end() && I->second >= Limit;
+    }
+    void setRebuilt(target_ulong pc) {
+        hqemu::MutexGuard locked(Lock);
+        Rebuilt.insert(pc);
+    }
+    bool isRebuilt(target_ulong pc) {
+        hqemu::MutexGuard locked(Lock);
+        return Rebuilt.count(pc) != 0;
+    }
+    uint64_t getCount(target_ulong pc, const std::string &Name) {
+        hqemu::MutexGuard locked(Lock);
+        auto I = Counters.find(Key(pc, Name));
+        return I == Counters.end() ? 0 : *I->second;
+    }
+};
 
 /*
  * LLVMEnv is the top level container of whole LLVM translation environment
@@ -47,7 +173,7 @@ class LLVMEnv {
 public:
     typedef std::vector<TranslatedCode *> TransCodeList;
     typedef std::map<uintptr_t, TranslatedCode *> TransCodeMap;
-    typedef std::vector<uintptr_t> ChainSlot;
+    typedef ChainSlotTable ChainSlot;
     typedef std::pair<size_t, uintptr_t> SlotInfo;
 
 private:
@@ -58,8 +184,13 @@ private:
     std::vector<CPUState *> ThreadEnv;
 
     TransCodeList TransCode;  /* Translated traces. */
-    TransCodeMap SortedCode;  /* Sorted traces in code cache address order. */
+    TransCodeMap SortedCode;  /* Sorted traces in code cache address order,
+                                 including the inactive ones until flush. */
+    CodeIndex *SortedIndex;   /* RCU-published snapshot of SortedCode */
+    unsigned NumIndexPending; /* Traces not yet published to SortedIndex */
     ChainSlot ChainPoint;     /* Address of stubs for trace-to-block linking */
+    ChainSlot ReturnSlot;     /* Blocks of the return pc of guest calls */
+    HelperProfile HelperProf; /* Execution counts of the helper calls */
 
     bool UseThreading; /* Whether multithreaded translators are used or not. */
     unsigned NumFlush;
@@ -106,7 +237,21 @@ public:
     TransCodeMap &getSortedCode()               { return SortedCode;     }
     ChainSlot &getChainPoint()                  { return ChainPoint;     }
     TraceID insertTransCode(TranslatedCode *TC);
+    void retireTransCode(TranslationBlock *EntryTB);
+
+    /* Rebuild and publish SortedIndex. The caller holds llvm_global_lock. */
+    void publishCodeIndex();
+    unsigned getNumIndexPending() { return NumIndexPending; }
+
+    /* Find the trace containing the host pc without locking. Retired and
+     * invalidated traces are found until the next flush, since a vCPU may
+     * still be running them. The caller must be in an RCU read-side critical
+     * section. */
+    TranslatedCode *lookupCode(uintptr_t pc);
     SlotInfo getChainSlot();
+    uintptr_t *allocReturnSlot();
+    ChainSlot &getReturnSlot()                  { return ReturnSlot;     }
+    HelperProfile &getHelperProfile()           { return HelperProf;     }
 
     bool isThreading()     { return UseThreading;      }
     void incNumFlush()     { NumFlush++;               }
@@ -120,11 +265,27 @@ public:
     static uint8_t *TraceCache;
     static size_t TraceCacheSize;
     static bool RunWithVTune;
+    static bool RegionReform;  /* Re-form traces with dominating side exits */
+    static bool KeepTraceInfo; /* Keep TraceInfo of the committed traces */
+    static bool ProfileLoop;   /* Profile trace loops for the annotation dump */
+    static bool ProfileHelper; /* Profile helper calls to inline hot helpers */
+    static uint64_t HotHelperCount; /* Executions of a hot helper call */
+    static unsigned ColdHelperLimit; /* Traces a helper call is profiled in
+                                        before it is left cold */
+    static unsigned IBInline;  /* Number of profiled indirect branch targets
+                                  to inline at a trace exit */
+    static bool AsyncBlock;    /* Compile blocks with the translator threads */
 
     static void CreateLLVMEnv();
     static void DeleteLLVMEnv();
     static int OptimizeBlock(CPUArchState *env, OptRequest Request);
     static int OptimizeTrace(CPUArchState *env, OptRequest Request);
+    static int ExtendTrace(CPUArchState *env, TranslationBlock *HeadTB,
+                           TBVec &TBs);
+    static unsigned getProfileThreshold(TranslationBlock *tb);
+    static void AdaptThreshold();
+    static void PenalizeHead(TranslationBlock *tb);
+    static void ProfileEdge(TranslationBlock *Pred, TranslationBlock *Succ);
     static void setTransMode(int Mode) { TransMode = Mode; }
     static int isTraceMode() {
         return (TransMode == TRANS_MODE_HYBRIDS ||
@@ -132,9 +293,20 @@ public:
     }
 };
 
+/*
+ * QueueManager holds the optimization requests for the translator threads.
+ * It also tracks the requests that are queued or being compiled so that the
+ * requests containing an invalidated block can be cancelled early.
+ */
 class QueueManager {
     std::vector<Queue *> ActiveQueue;
     Queue *CurrentQueue;
+    unsigned NumPending;  /* Number of requests waiting in the queues */
+    hqemu::Mutex Lock;
+    /* Queued or in-compilation requests, indexed by their member blocks */
+    std::unordered_map<TranslationBlock *, std::vector<OptimizationInfo *> > Inflight;
+
+    void Track(OptimizationInfo *Opt);
 
 public:
     QueueManager();
@@ -142,25 +314,34 @@ public:
     void Enqueue(OptimizationInfo *Opt);
     void *Dequeue();
     void Flush();
+    void Cancel(TranslationBlock *tb);
+    void Retire(OptimizationInfo *Opt);
+    unsigned getNumPending() { return NumPending; }
 };
 
 /*
  * OptimizationInfo is the description to an optimization request. It consists
- * of the optimization mode and the control-flow-graph of the trace.
+ * of the optimization mode and the control-flow-graph of the trace. The CFG is
+ * allocated from the arena of the request and is released in one shot when
+ * the request is committed or aborted.
  */
+#define OPT_ARENA_CHUNK_SIZE  (16 * 1024)
+
 class OptimizationInfo {
 public:
-    typedef std::set<TranslationBlock *> TraceNode;
-    typedef std::map<TranslationBlock *, TraceNode> TraceEdge;
+    typedef FlatSet<TranslationBlock *> TraceNode;
+    typedef FlatMap<TranslationBlock *, TraceNode> TraceEdge;
 
-    ~OptimizationInfo() {
-        if (CFG)
-            GraphNode::DeleteCFG(CFG);
-    }
+    ~OptimizationInfo();
 
     void ComposeCFG();
     GraphNode *getCFG()    { return CFG;      }
     bool isTrace()         { return !isBlock; }
+    bool isCancelled()     { return Cancelled; }
+    void Cancel()          { Cancelled = true; }
+    void setTracked()      { Tracked = true;  }
+    bool contains(TranslationBlock *tb) { return Members.count(tb); }
+    TraceNode &getMembers() { return Members; }
 
     static OptRequest CreateRequest(TranslationBlock *tb) {
         return OptRequest(new OptimizationInfo(tb));
@@ -178,15 +359,22 @@ private:
     bool isUserTrace;  /* Trace of all user-mode blocks */
     bool isBlock;      /* Trace of a single block */
     GraphNode *CFG;    /* CFG of the trace */
+    Arena Pool;        /* Memory of the CFG */
+    TraceNode Members; /* Blocks in the CFG */
+    volatile bool Cancelled; /* A member block is invalidated */
+    bool Tracked;      /* Tracked by the queue manager */
 
     OptimizationInfo(TranslationBlock *tb)
-        : isUserTrace(true), isBlock(true) {
+        : isUserTrace(true), isBlock(true), Pool(OPT_ARENA_CHUNK_SIZE),
+          Cancelled(false), Tracked(false) {
         Trace.push_back(tb);
         LoopHeadIdx = -1;
-        CFG = new GraphNode(tb);
+        CFG = Pool.create<GraphNode>(tb);
+        Members.insert(tb);
     }
     OptimizationInfo(TBVec &trace, int idx)
-        : isUserTrace(true), isBlock(false), CFG(nullptr) {
+        : isUserTrace(true), isBlock(false), CFG(nullptr),
+          Pool(OPT_ARENA_CHUNK_SIZE), Cancelled(false), Tracked(false) {
         if (trace.empty())
             hqemu_error("trace length cannot be zero.\n");
         Trace = trace;
@@ -194,6 +382,8 @@ private:
     }
     OptimizationInfo(TranslationBlock *HeadTB, TraceEdge &Edges);
 
+    void BuildCFG(TranslationBlock *HeadTB, TraceEdge &Edges);
+
     void SearchCycle(TraceNode &SearchNodes, TraceNode &Nodes,
                      TraceEdge &Edges, TBVec &Visited, int Depth);
     void ExpandTrace(TranslationBlock *HeadTB, TraceEdge &Edges);
@@ -201,6 +391,13 @@ private:
 
 class TraceInfo {
 public:
+    /* Index to the execution counters of each thread. */
+    enum {
+        IDX_LOOP = 0,
+        IDX_EXIT,
+        IDX_INBR,
+    };
+
     TBVec TBs;
     unsigned NumLoop;
     unsigned NumExit;
@@ -208,10 +405,16 @@ public:
     uint64_t **ExecCount;
     uint64_t TransTime;
     uint32_t Attribute;
+    int Reform;        /* Set once the trace is submitted for re-formation */
+    int Rebuild;       /* Set once the trace is submitted for rebuilding */
+    std::vector<target_ulong> LoopHeads; /* Guest pc of the loop headers */
+    int LoopStride;    /* Access stride (in elements) derived from the guest
+                          addresses of the vectorized loop, -1 if unknown */
 
     TraceInfo(NodeVec &Nodes, uint32_t Attr = A_None)
         : NumLoop(0), NumExit(0), NumIndirectBr(0), ExecCount(nullptr),
-          TransTime(0), Attribute(Attr)
+          TransTime(0), Attribute(Attr), Reform(0), Rebuild(0),
+          LoopStride(-1)
     {
         if (Nodes.empty())
             hqemu_error("number of nodes cannot be zero.\n");
@@ -242,20 +445,95 @@ struct ChainInfo {
     void insertDepTrace(BlockID id) {
         DepTraces.push_back(id);
     }
+    /* ChainInfo is allocated from TBArena; free() only releases the
+     * memory owned by the containers. */
     static ChainInfo *get(TranslationBlock *tb) {
         if (!tb->chain)
-            tb->chain = (ChainInfo *)new ChainInfo;
+            tb->chain = TBArena.create<ChainInfo>();
         return (ChainInfo *)tb->chain;
     }
     static void free(TranslationBlock *tb) {
-        delete (ChainInfo *)tb->chain;
+        if (tb->chain)
+            ((ChainInfo *)tb->chain)->~ChainInfo();
         tb->chain = nullptr;
     }
 };
 
+/*
+ * TargetProfile is the value profile of the indirect branch ending a block.
+ * Only the most frequent target blocks are kept: when the profile is full, the
+ * least frequent target is replaced by the new one. The profile is updated
+ * without locking, so the counts are approximate. It is allocated from
+ * TBArena and released at code cache flush.
+ */
+#define IB_PROFILE_SIZE  4
+#define IB_INLINE_RATIO  10  /* Percentage of executions to inline a target */
+
+class TargetProfile {
+    struct Target {
+        TranslationBlock *TB;
+        uint64_t Count;
+    };
+    Target Targets[IB_PROFILE_SIZE];
+    uint64_t Total;
+
+public:
+    TargetProfile() : Total(0) {
+        for (int i = 0; i < IB_PROFILE_SIZE; ++i) {
+            Targets[i].TB = nullptr;
+            Targets[i].Count = 0;
+        }
+    }
+
+    void insert(TranslationBlock *tb) {
+        int Min = 0;
+        Total++;
+        for (int i = 0; i < IB_PROFILE_SIZE; ++i) {
+            if (Targets[i].TB == tb) {
+                Targets[i].Count++;
+                return;
+            }
+            if (Targets[i].Count < Targets[Min].Count)
+                Min = i;
+        }
+        Targets[Min].TB = tb;
+        Targets[Min].Count++;
+    }
+
+    /* Get at most N targets that take at least Ratio percent of the profiled
+     * executions, the hottest one first. */
+    void getHotTargets(TBVec &TBs, unsigned N, unsigned Ratio) {
+        Target Sorted[IB_PROFILE_SIZE];
+        std::copy(Targets, Targets + IB_PROFILE_SIZE, Sorted);
+        std::sort(Sorted, Sorted + IB_PROFILE_SIZE,
+                  [](const Target &A, const Target &B) {
+                      return A.Count > B.Count;
+                  });
+
+        uint64_t Cutoff = Total * Ratio;
+        for (int i = 0; i < IB_PROFILE_SIZE && TBs.size() < N; ++i) {
+            if (!Sorted[i].TB || Sorted[i].Count * 100 < Cutoff)
+                break;
+            TBs.push_back(Sorted[i].TB);
+        }
+    }
+
+    /* Get the profile of tb, creating it if it does not exist. */
+    static TargetProfile *get(TranslationBlock *tb) {
+        if (!tb->target) {
+            TargetProfile *Profile = TBArena.create<TargetProfile>();
+            Atomic<void *>::testandset(&tb->target, nullptr, Profile);
+        }
+        return (TargetProfile *)tb->target;
+    }
+    static TargetProfile *lookup(TranslationBlock *tb) {
+        return (TargetProfile *)tb->target;
+    }
+};
+
 class TranslatedCode {
 public:
-    TranslatedCode() : Trace(nullptr), SampleCount(0) {}
+    TranslatedCode() : Trace(nullptr), SampleCount(0), CommitTime(0) {}
     ~TranslatedCode() {
         if (Trace)
             delete Trace;
@@ -268,6 +546,7 @@ public:
     RestoreVec Restore;
     TraceInfo *Trace;
     uint64_t SampleCount;
+    uint64_t CommitTime;       /* Time (in us) the code is committed */
 };
 
 
@@ -7,7 +7,8 @@
 #define __OPTIMIZATION_H
 
 #include <iostream>
-#include <list>
+#include <vector>
+#include <unordered_set>
 #include "qemu-types.h"
 
 
@@ -49,50 +50,194 @@ public:
 
 /*
  * Indirect Branch Target Cache (IBTC)
+ *
+ * IBTC is a set-associative cache with IBTC_WAYS entries per set. The entries
+ * of a set are kept in LRU order, so the first way always holds the most
+ * recently used target and is the only one probed by the inlined lookup in
+ * the trace code. When too many insertions evict a valid entry, the number
+ * of sets is doubled, up to four times the initial size, and it returns to
+ * the initial size when the code cache is flushed.
  */
-#define IBTC_CACHE_BITS     (16)
-#define IBTC_CACHE_SIZE     (1U << IBTC_CACHE_BITS)
-#define IBTC_CACHE_MASK     (IBTC_CACHE_SIZE - 1)
+#define IBTC_WAYS           4
+#define IBTC_CACHE_BITS     (14)    /* Initial number of sets in log2 */
+#define IBTC_MAX_BITS       (16)    /* Maximum number of sets in log2 */
+#define IBTC_RESIZE_WINDOW  4096    /* Insertions between two resizing checks */
+#define IBTC_RESIZE_RATIO   50      /* Percentage of evictions to resize */
 
 class IBTC {
-    typedef std::pair<target_ulong, TranslationBlock *> ibtc_t;
-    ibtc_t Cache[IBTC_CACHE_SIZE];
+public:
+    /* The layout is also known by the inlined probe in the trace code. */
+    struct ibtc_t {
+        target_ulong pc;
+        TranslationBlock *tb;
+    };
+    struct ibtc_set_t {
+        ibtc_t Way[IBTC_WAYS];  /* Way[0] is the most recently used one */
+    };
+
+private:
+    struct RetiredTable {
+        struct rcu_head rcu;  /* Must be the first member */
+        ibtc_set_t *Cache;
+    };
+    static void FreeTable(struct rcu_head *head) {
+        RetiredTable *Retired = (RetiredTable *)head;
+        delete [] Retired->Cache;
+        delete Retired;
+    }
+
+    ibtc_set_t *Cache;
+    uintptr_t Mask;         /* Number of sets - 1 */
+    unsigned Bits;          /* Number of sets in log2 */
+    CPUArchState *Env;      /* Env that the inlined probe reads the table from */
     bool NeedUpdate;
-    uint64_t Total;         /* Total access count */
+    uint64_t Total;         /* Lookups that reach helper_lookup_ibtc */
     uint64_t Miss;          /* Miss count */
+    uint64_t Evict;         /* Number of valid entries evicted */
+    unsigned NumResize;     /* Number of resizing */
+    unsigned WindowInsert;  /* Insertions in the current resizing window */
+    unsigned WindowEvict;   /* Evictions in the current resizing window */
+
+    void allocate(unsigned bits) {
+        Bits = bits;
+        Mask = (1UL << bits) - 1;
+        Cache = new ibtc_set_t[Mask + 1];
+        reset();
+        publish();
+    }
+    void publish() {
+        if (!Env)
+            return;
+        Env->ibtc_table = Cache;
+        Env->ibtc_mask = Mask;
+    }
+    /* Double the number of sets and move the valid entries. */
+    void grow() {
+        ibtc_set_t *Old = Cache;
+        uintptr_t OldMask = Mask;
+
+        allocate(Bits + 1);
+        for (uintptr_t i = 0; i <= OldMask; ++i) {
+            for (int j = IBTC_WAYS - 1; j >= 0; --j) {
+                ibtc_t &e = Old[i].Way[j];
+                if (e.pc != (target_ulong)-1)
+                    fill(e.pc, e.tb);
+            }
+        }
+        delete [] Old;
+        NumResize++;
+    }
+    /* Put an entry at the MRU position and return if a valid entry is evicted.
+     * The entry replaces the same pc, or the first invalid way, or the LRU
+     * one, in that order. */
+    bool fill(target_ulong pc, TranslationBlock *tb) {
+        ibtc_set_t &s = set(pc);
+        int i, Invalid = -1;
+        for (i = 0; i < IBTC_WAYS; ++i) {
+            if (s.Way[i].pc == pc)
+                break;
+            if (Invalid == -1 && s.Way[i].pc == (target_ulong)-1)
+                Invalid = i;
+        }
+        if (i == IBTC_WAYS)
+            i = (Invalid != -1) ? Invalid : IBTC_WAYS - 1;
+
+        bool Evicted = (s.Way[i].pc != pc && s.Way[i].pc != (target_ulong)-1);
+        for (; i > 0; --i)
+            s.Way[i] = s.Way[i - 1];
+        s.Way[0].pc = pc;
+        s.Way[0].tb = tb;
+        return Evicted;
+    }
 
 public:
-    IBTC() : NeedUpdate(false), Total(0), Miss(0) { reset(); }
-    ~IBTC() {}
+    IBTC() : Env(nullptr), NeedUpdate(false), Total(0), Miss(0), Evict(0),
+             NumResize(0), WindowInsert(0), WindowEvict(0) {
+        allocate(IBTC_CACHE_BITS);
+    }
+    ~IBTC() { delete [] Cache; }
 
-    inline ibtc_t &cache(target_ulong pc) {
-        return Cache[(pc >> 2) & IBTC_CACHE_MASK];
+    /* Let the inlined probe of env use this table. */
+    void bind(CPUArchState *env) {
+        Env = env;
+        Env->ibtc_hit = 0;
+        publish();
+    }
+    inline ibtc_set_t &set(target_ulong pc) {
+        return Cache[(pc >> 2) & Mask];
     }
     void reset() {
-        for (unsigned i = 0; i < IBTC_CACHE_SIZE; ++i)
-            Cache[i].first = (target_ulong)-1;
+        for (uintptr_t i = 0; i <= Mask; ++i) {
+            for (int j = 0; j < IBTC_WAYS; ++j) {
+                Cache[i].Way[j].pc = (target_ulong)-1;
+                Cache[i].Way[j].tb = nullptr;
+            }
+        }
+    }
+    /* Drop all entries and return to the initial number of sets. The flush
+     * may come from another vCPU, so the old table is freed after the RCU
+     * grace period of the execution loop that may still probe it. */
+    void flush() {
+        WindowInsert = WindowEvict = 0;
+        if (Bits == IBTC_CACHE_BITS) {
+            reset();
+            return;
+        }
+        RetiredTable *Retired = new RetiredTable;
+        Retired->Cache = Cache;
+        allocate(IBTC_CACHE_BITS);
+        call_rcu1(&Retired->rcu, FreeTable);
     }
     void remove(TranslationBlock *tb) {
-        ibtc_t &c = cache(tb->pc);
-        if (c.first == tb->pc)
-            c.first = (target_ulong)-1;
+        ibtc_set_t &s = set(tb->pc);
+        for (int i = 0; i < IBTC_WAYS; ++i) {
+            if (s.Way[i].pc == tb->pc && s.Way[i].tb == tb)
+                s.Way[i].pc = (target_ulong)-1;
+        }
     }
     void insert(target_ulong pc, TranslationBlock *tb) {
-        cache(pc) = std::make_pair(pc, tb);
+        if (fill(pc, tb)) {
+            Evict++;
+            WindowEvict++;
+        }
+        if (++WindowInsert < IBTC_RESIZE_WINDOW)
+            return;
+        if (Bits < IBTC_MAX_BITS &&
+            WindowEvict * 100 > WindowInsert * IBTC_RESIZE_RATIO)
+            grow();
+        WindowInsert = WindowEvict = 0;
     }
     TranslationBlock *get(target_ulong pc) {
-        ibtc_t &c = cache(pc);
-        return (c.first == pc) ? c.second : nullptr;
+        ibtc_set_t &s = set(pc);
+        for (int i = 0; i < IBTC_WAYS; ++i) {
+            if (s.Way[i].pc != pc)
+                continue;
+            /* Move the hit entry to the MRU position. */
+            ibtc_t e = s.Way[i];
+            for (; i > 0; --i)
+                s.Way[i] = s.Way[i - 1];
+            s.Way[0] = e;
+            return e.tb;
+        }
+        return nullptr;
     }
     void setUpdate()   { NeedUpdate = true;  }
     void resetUpdate() { NeedUpdate = false; }
     bool needUpdate()  { return NeedUpdate;  }
     inline void incTotal() { Total++; }
     inline void incMiss()  { Miss++;  }
+    /* Hits of the probe inlined in the trace code, which do not reach the
+     * helper. */
+    uint64_t getInlineHit() { return Env ? Env->ibtc_hit : 0; }
+    uint64_t getTotal()     { return Total + getInlineHit(); }
     void dump() {
-        double HitRate = (double)(Total - Miss) * 100 / Total;
-        std::cerr << "\nibtc.miss = " << Miss << "/" << Total <<
-                     "  (hit rate=" << HitRate << "%)\n";
+        uint64_t All = getTotal();
+        double HitRate = (double)(All - Miss) * 100 / All;
+        std::cerr << "\nibtc.miss = " << Miss << "/" << All <<
+                     "  (hit rate=" << HitRate << "%, inline hits=" <<
+                     getInlineHit() << ")\n" <<
+                     "ibtc.evict = " << Evict << "  (sets=" << Mask + 1 <<
+                     " ways=" << IBTC_WAYS << " resize=" << NumResize << ")\n";
     }
 };
 
@@ -130,23 +275,37 @@ public:
  * be found, this is a false alert and we can fall back to the default-size
  * page flushing. Otherwise, SoftTLB, IBTC/CPBL optimization, etc. are
  * partial or full cleanup due to the true large page flushing.
+ * The pages are grouped by size and indexed by their base address, so that a
+ * search takes one hash lookup per distinct page size.
  */
 #define MAX_NUM_LARGEPAGE   (1024)
 
 class LargePageTable {
-    typedef std::pair<target_ulong, target_ulong> PTE;
-    typedef std::list<PTE> PTEList;
-    PTEList Used;
-    PTEList Free;
+    /* Tracked pages of the same size, indexed by their base address. */
+    struct PageClass {
+        target_ulong Mask;
+        std::unordered_set<target_ulong> Base;
+    };
+    std::vector<PageClass> Classes;  /* Sorted by page size, largest first */
     CPUState *CS;
+    unsigned NumPage;
     uint64_t Total;
     uint64_t Miss;
 
+    PageClass &getClass(target_ulong mask) {
+        auto I = Classes.begin(), E = Classes.end();
+        for (; I != E && I->Mask >= mask; ++I) {
+            if (I->Mask == mask)
+                return *I;
+        }
+        I = Classes.insert(I, PageClass());
+        I->Mask = mask;
+        return *I;
+    }
+
 public:
-    LargePageTable(CPUState *cpu) : Total(0), Miss(0) {
+    LargePageTable(CPUState *cpu) : NumPage(0), Total(0), Miss(0) {
         CS = cpu;
-        Used.clear();
-        Free.resize(MAX_NUM_LARGEPAGE);
     }
     ~LargePageTable() {}
 
@@ -156,49 +315,52 @@ public:
     };
 
     void reset() {
-        Free.splice(Free.end(), Used);
-    }
-    void remove(PTEList::iterator I) {
-        Free.splice(Free.begin(), Used, I);
-    }
-    void allocate(PTE pte) {
-        /* If the free list is empty, we need to clear softtlb by calling
-         * tlb_flush() which will then invoke LTP::reset() to clear LPT. */
-        if (Free.empty())
-            tlb_flush(CS, 0);
-        Free.front() = pte;
-        Used.splice(Used.begin(), Free, Free.begin());
+        if (NumPage == 0)
+            return;
+        for (auto &C : Classes)
+            C.Base.clear();
+        NumPage = 0;
     }
     void insert(target_ulong addr, target_ulong size) {
-        for (PTEList::iterator I = Used.begin(), E = Used.end(); I != E; ++I) {
-            if (I->first == (addr & I->second)) {
-                Used.splice(Used.begin(), Used, I);
-                return;
-            }
-        }
         target_ulong mask = ~(size - 1);
-        allocate(PTE(addr & mask, mask));
+        if (getClass(mask).Base.count(addr & mask))
+            return;
+
+        /* If the table is full, we need to clear softtlb by calling
+         * tlb_flush() which will then invoke LTP::reset() to clear LPT. */
+        if (NumPage == MAX_NUM_LARGEPAGE)
+            tlb_flush(CS, 0);
+        getClass(mask).Base.insert(addr & mask);
+        NumPage++;
     }
     bool search(target_ulong addr, bool mode, target_ulong *addrp,
                 target_ulong *sizep) {
-        for (PTEList::iterator I = Used.begin(), E = Used.end(); I != E; ++I) {
-            if (I->first != (addr & I->second))
+        if (NumPage == 0)
+            return false;
+        for (auto &C : Classes) {
+            auto I = C.Base.find(addr & C.Mask);
+            if (I == C.Base.end())
                 continue;
-            *addrp = I->first;
-            *sizep = ~I->second + 1;
-            if (mode == FLUSH)
-                remove(I);
+            *addrp = *I;
+            *sizep = ~C.Mask + 1;
+            if (mode == FLUSH) {
+                C.Base.erase(I);
+                NumPage--;
+            }
             return true;
         }
         return false;
     }
     void incTotal() { Total++; }
     void incMiss()  { Miss++;  }
+    uint64_t getTotal() { return Total;   }
+    uint64_t getMiss()  { return Miss;    }
+    unsigned getNumPage() { return NumPage; }
     void dump() {
-        double Rate = (double)(Total - Miss) * 100 / Total;
-        std::cerr << "lpt.miss = " << Miss << "/" << Total << 
+        double Rate = Total ? (double)Miss * 100 / Total : 0;
+        std::cerr << "lpt.miss = " << Miss << "/" << Total <<
                      " (false flushing=" << Rate << "% #pages=" <<
-                     Used.size() << ")\n";
+                     NumPage << ")\n";
     }
 };
 
@@ -253,6 +415,13 @@ static inline BaseTracer *cpu_get_tracer(CPUArchState *env) {
     return ((CPUOptimization *)env->opt_link)->pt;
 }
 
+/* Empty the shadow return stack. The stack is only maintained by the trace
+ * code, so it is emptied whenever the block code takes over the execution. */
+static inline void shadow_stack_reset(CPUArchState *env) {
+    env->shadow_top = 0;
+    env->shadow_pc[0] = (target_ulong)-1;
+}
+
 #endif
 
 /*
@@ -14,6 +14,7 @@ extern "C" {
 #include "exec/cpu_ldst.h"
 #include "tcg/tcg.h"
 #include "qemu/atomic.h"
+#include "qemu/rcu.h"
 #include "hqemu.h"
 
 extern uint8_t *tb_ret_addr;
@@ -7,12 +7,22 @@
 #define __TRACE_H
 
 #include <vector>
+#include <deque>
 #include <iostream>
 #include "qemu-types.h"
 #include "optimization.h"
 #include "utils.h"
 
 
+class TraceInfo;
+
+/* A request on a committed trace raised in the code cache. */
+struct TraceRequest {
+    TraceInfo *Trace;
+    int Kind;
+    unsigned Epoch;   /* Number of code cache flushes when requested */
+};
+
 /* 
  * Base processor tracer
  */
@@ -20,6 +30,8 @@ class BaseTracer {
 public:
     CPUArchState *Env;
     void *Perf;
+    std::vector<TraceRequest> Requests; /* Requests to handle out of the
+                                           code cache */
 
     BaseTracer(CPUArchState *env) : Env(env), Perf(nullptr) {}
     virtual ~BaseTracer() {}
@@ -29,6 +41,9 @@ public:
     /* Create and return the tracer object based on LLVM_MODE. */
     static BaseTracer *CreateTracer(CPUArchState *env);
 
+    /* Create the tracer of the selected region formation strategy. */
+    static BaseTracer *CreateRegionTracer(CPUArchState *env, int Mode);
+
     /* Release the trace resources. */
     static void DeleteTracer(CPUArchState *env);
 };
@@ -47,6 +62,22 @@ public:
 };
 
 
+/*
+ * Region formation strategies. The strategy is selected at runtime with the
+ * option -region (see LLVMEnv::ParseCommandLineOptions).
+ */
+enum {
+    REGION_NET = 0,     /* Relaxed NET: any cyclic path ends a trace */
+    REGION_NET_STRICT,  /* Original NET: backward branches end a trace */
+    REGION_LEI,         /* Last-executed iteration with a history buffer */
+    REGION_TRACETREE,   /* Trace trees anchored at loop headers */
+    REGION_NUM,
+};
+
+extern int RegionFormation;
+extern const char *RegionName[REGION_NUM];
+
+
 /*
  * Trace with NET trace formation algorithm
  */
@@ -57,19 +88,71 @@ public:
 #  define NET_PREDICT_THRESHOLD 64
 #endif
 class NETTracer : public BaseTracer {
-    bool isTraceHead(uintptr_t next_tb, TranslationBlock *tb, bool NewTB);
+protected:
+    bool Relaxed;  /* Use the relaxed NET rule to find trace heads */
+
+    virtual bool isTraceHead(uintptr_t next_tb, TranslationBlock *tb, bool NewTB);
+
+    /* Submit the recorded blocks as a trace. */
+    void BuildTrace(int LoopHeadIdx);
 
 public:
     typedef std::vector<TranslationBlock *> TBVec;
     TBVec TBs;
 
-    NETTracer(CPUArchState *env, int Mode);
+    NETTracer(CPUArchState *env, int Mode, bool relaxed = true);
     ~NETTracer();
 
     void Reset() override;
     void Record(uintptr_t next_tb, TranslationBlock *tb) override;
-    inline void Profile(TranslationBlock *tb);
-    inline void Predict(TranslationBlock *tb);
+    virtual void Profile(TranslationBlock *tb);
+    virtual void Predict(TranslationBlock *tb);
+};
+
+
+/*
+ * Trace with LEI (last-executed iteration) trace formation algorithm
+ *  D. Hiniker, K. Hazelwood and M. D. Smith, "Improving Region Selection in
+ *  Dynamic Optimization Systems," in MICRO'05.
+ * Every block executed in the block code cache is appended to a history
+ * buffer. A block found in the buffer closes a cycle, and the blocks of the
+ * last iteration of a cycle seen ProfileThreshold times form the trace.
+ */
+class LEITracer : public NETTracer {
+    std::deque<TranslationBlock *> History;
+
+public:
+    LEITracer(CPUArchState *env, int Mode);
+
+    void Reset() override;
+    void Record(uintptr_t next_tb, TranslationBlock *tb) override;
+    void Profile(TranslationBlock *tb) override {}
+    void Predict(TranslationBlock *tb) override;
+};
+
+
+/*
+ * Trace with trace trees
+ *  A. Gal and M. Franz, "Incremental Dynamic Code Generation with Trace
+ *  Trees," Technical Report, UC Irvine, 2006.
+ * A tree is anchored at a loop header and its traces must return to the
+ * anchor. Paths recorded from side exits that return to the anchor of an
+ * existing tree are attached to the tree and the tree is recompiled as a
+ * whole. Nested loops form their own trees which are linked by chaining.
+ */
+class TraceTreeTracer : public NETTracer {
+    bool isTraceHead(uintptr_t next_tb, TranslationBlock *tb, bool NewTB) override;
+
+    /* Return the anchor of a tree that tb branches back to, if any. */
+    TranslationBlock *findAnchor(TranslationBlock *tb);
+
+public:
+    TraceTreeTracer(CPUArchState *env, int Mode);
+
+    void Predict(TranslationBlock *tb) override;
+
+    /* Drop all anchors. Called when the code cache is flushed. */
+    static void ResetAnchors();
 };
 
 /* Return the address of the patch point to the trace code. */
@@ -87,14 +170,6 @@ static inline NETTracer &getNETTracer(CPUArchState *env) {
     return *static_cast<NETTracer *>(cpu_get_tracer(env));
 }
 
-static inline void delete_image(TranslationBlock *tb)
-{
-#if defined(CONFIG_LLVM) && defined(CONFIG_SOFTMMU)
-    delete (char *)tb->image;
-    tb->image = nullptr;
-#endif
-}
-
 static inline bool update_tb_mode(TranslationBlock *tb, int from, int to) {
     if (tb->mode != from)
         return false;
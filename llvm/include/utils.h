@@ -8,11 +8,17 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <utility>
 #include <sstream>
 #include <iomanip>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <vector>
+#include <algorithm>
+#include <sys/time.h>
 #include "qemu-types.h"
 
 
@@ -63,6 +69,9 @@ public:
     static T inc_return(volatile T *p) {
         return __sync_fetch_and_add(p, 1) + 1;
     }
+    static T dec_return(volatile T *p) {
+        return __sync_fetch_and_sub(p, 1) - 1;
+    }
     static bool testandset(volatile T *p, T _old, T _new) {
         return __sync_bool_compare_and_swap(p, _old, _new);
     }
@@ -90,8 +99,162 @@ public:
 };
 
 
+/*
+ * Arena
+ *  A bump-pointer allocator for objects sharing the same lifetime. Memory is
+ *  carved from large chunks and is never returned individually; reset()
+ *  releases all objects in one shot. Destructors are not run by the arena.
+ *  An arena is not thread-safe; ArenaPool gives each thread its own.
+ */
+#define ARENA_CHUNK_SIZE  (256 * 1024)
+
+class Arena {
+    std::vector<char *> Chunks;
+    size_t ChunkSize;
+    uintptr_t Ptr;  /* Next free byte of the current chunk */
+    uintptr_t End;  /* End of the current chunk */
+
+public:
+    Arena(size_t Size = ARENA_CHUNK_SIZE) : ChunkSize(Size), Ptr(0), End(0) {}
+    ~Arena() { reset(); }
+
+    void *allocate(size_t Size, size_t Align = alignof(std::max_align_t)) {
+        uintptr_t P = (Ptr + Align - 1) & ~(uintptr_t)(Align - 1);
+        if (P + Size > End) {
+            /* Large objects get a chunk of their own. */
+            if (Size > ChunkSize / 4) {
+                Chunks.push_back(new char[Size + Align]);
+                P = (uintptr_t)Chunks.back();
+                return (void *)((P + Align - 1) & ~(uintptr_t)(Align - 1));
+            }
+            Chunks.push_back(new char[ChunkSize]);
+            Ptr = (uintptr_t)Chunks.back();
+            End = Ptr + ChunkSize;
+            P = (Ptr + Align - 1) & ~(uintptr_t)(Align - 1);
+        }
+        Ptr = P + Size;
+        return (void *)P;
+    }
+
+    template <typename T, typename... Args>
+    T *create(Args&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    void reset() {
+        for (auto Chunk : Chunks)
+            delete [] Chunk;
+        Chunks.clear();
+        Ptr = End = 0;
+    }
+};
+
+/*
+ * ArenaPool
+ *  A set of arenas, one per allocating thread, so that the vCPU and the
+ *  translator threads allocate without contending on a lock. The lock is
+ *  only taken when a thread allocates from the pool for the first time.
+ *  reset() releases the arenas of all threads together, and must not run
+ *  concurrently with allocations.
+ */
+class ArenaPool {
+    hqemu::Mutex Lock;
+    std::vector<Arena *> Arenas;  /* Arenas of all threads */
+
+    Arena *getLocalArena();
+
+public:
+    ArenaPool() {}
+    ~ArenaPool() {
+        for (auto A : Arenas)
+            delete A;
+    }
+
+    void *allocate(size_t Size, size_t Align = alignof(std::max_align_t)) {
+        return getLocalArena()->allocate(Size, Align);
+    }
+
+    template <typename T, typename... Args>
+    T *create(Args&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    void reset() {
+        hqemu::MutexGuard locked(Lock);
+        for (auto A : Arenas)
+            A->reset();
+    }
+};
+
+/* Side data of translation blocks (state, image, chaining and profile). They
+ * live until the code cache is flushed. */
+extern ArenaPool TBArena;
+
+
+/*
+ * FlatSet and FlatMap are small ordered containers kept in a sorted vector.
+ * They replace std::set and std::map for the short-lived CFGs built during
+ * region formation, which hold at most a few hundred nodes.
+ */
+template <typename T>
+class FlatSet {
+    std::vector<T> Data;
+
+public:
+    typedef typename std::vector<T>::iterator iterator;
+
+    iterator begin() { return Data.begin(); }
+    iterator end()   { return Data.end();   }
+    size_t size()    { return Data.size();  }
+    bool empty()     { return Data.empty(); }
+    void clear()     { Data.clear();        }
+
+    iterator find(const T &Key) {
+        auto I = std::lower_bound(Data.begin(), Data.end(), Key);
+        return (I != Data.end() && *I == Key) ? I : Data.end();
+    }
+    size_t count(const T &Key) { return find(Key) != end(); }
+    void insert(const T &Key) {
+        auto I = std::lower_bound(Data.begin(), Data.end(), Key);
+        if (I == Data.end() || *I != Key)
+            Data.insert(I, Key);
+    }
+};
+
+template <typename K, typename V>
+class FlatMap {
+    typedef std::pair<K, V> Entry;
+    std::vector<Entry> Data;
+
+    static bool less(const Entry &E, const K &Key) { return E.first < Key; }
+
+public:
+    typedef typename std::vector<Entry>::iterator iterator;
+
+    iterator begin() { return Data.begin(); }
+    iterator end()   { return Data.end();   }
+    size_t size()    { return Data.size();  }
+    bool empty()     { return Data.empty(); }
+    void clear()     { Data.clear();        }
+
+    iterator find(const K &Key) {
+        auto I = std::lower_bound(Data.begin(), Data.end(), Key, less);
+        return (I != Data.end() && I->first == Key) ? I : Data.end();
+    }
+    /* Note that inserting a new key invalidates the references to values. */
+    V &operator[](const K &Key) {
+        auto I = std::lower_bound(Data.begin(), Data.end(), Key, less);
+        if (I == Data.end() || I->first != Key)
+            I = Data.insert(I, Entry(Key, V()));
+        return I->second;
+    }
+};
+
+
 /*
  * GraphNode is used to describe the information of one node in a CFG.
+ * The nodes and their child arrays are allocated from the arena of the
+ * optimization request and are released with it.
  */
 class GraphNode;
 typedef std::vector<GraphNode *> NodeVec;
@@ -99,48 +262,100 @@ typedef std::set<GraphNode *> NodeSet;
 
 class GraphNode {
     TranslationBlock *TB;
-    NodeVec Children;
+    GraphNode **Children;
+    unsigned NumChildren;
 
 public:
-    GraphNode(TranslationBlock *tb) : TB(tb) {}
+    struct ChildRange {
+        GraphNode **Begin, **End;
+        GraphNode **begin() const { return Begin; }
+        GraphNode **end() const   { return End;   }
+        size_t size() const       { return End - Begin; }
+    };
+
+    GraphNode(TranslationBlock *tb)
+        : TB(tb), Children(nullptr), NumChildren(0) {}
 
     TranslationBlock *getTB()   { return TB;        }
     target_ulong getGuestPC()   { return TB->pc;    }
-    NodeVec &getChildren()      { return Children;  }
-    void insertChild(GraphNode *Node) {
-        Children.push_back(Node);
+    ChildRange getChildren() {
+        ChildRange R = { Children, Children + NumChildren };
+        return R;
+    }
+    void setChildren(GraphNode **Nodes, unsigned Num) {
+        Children = Nodes;
+        NumChildren = Num;
     }
-
-    static void DeleteCFG(GraphNode *Root);
 };
 
 /*
  * ControlFlowGraph is used to build the whole program control flow graph (CFG).
  * GlobalCFG uses this structure to maintain a whole program CFG connected by
- * direct branches.
+ * direct branches. The edges are hashed by the source block into shards and
+ * each shard has its own lock, so threads linking different blocks do not
+ * contend. An edge is stored once with a counter of how often it is seen.
  */
-class ControlFlowGraph {
-    hqemu::Mutex lock;
+#define CFG_NUM_SHARDS  64
 
+class ControlFlowGraph {
 public:
-    typedef std::vector<TranslationBlock *> TBVec;
-    typedef std::map<TranslationBlock*, TBVec> SuccMap;
-    SuccMap SuccCFG;
+    struct Edge {
+        TranslationBlock *TB;  /* Successor block */
+        uint32_t Count;        /* Number of times the edge is seen */
+        Edge(TranslationBlock *tb, uint32_t count) : TB(tb), Count(count) {}
+    };
+    typedef std::vector<Edge> EdgeVec;
+    typedef std::unordered_map<TranslationBlock*, EdgeVec> SuccMap;
 
+private:
+    struct Shard {
+        hqemu::Mutex lock;
+        SuccMap SuccCFG;
+    };
+    Shard Shards[CFG_NUM_SHARDS];
+
+    Shard &getShard(TranslationBlock *tb) {
+        return Shards[(uintptr_t)tb->id % CFG_NUM_SHARDS];
+    }
+
+public:
     ControlFlowGraph() {}
 
-    hqemu::Mutex &getLock() { return lock; }
-    TBVec &getSuccessor(TranslationBlock *tb) {
-        return SuccCFG[tb];
+    /* Copy the successors of tb to Succs, the most frequent one first. */
+    void getSuccessor(TranslationBlock *tb, EdgeVec &Succs) {
+        Shard &S = getShard(tb);
+        {
+            hqemu::MutexGuard locked(S.lock);
+            auto I = S.SuccCFG.find(tb);
+            if (I == S.SuccCFG.end()) {
+                Succs.clear();
+                return;
+            }
+            Succs = I->second;
+        }
+        std::sort(Succs.begin(), Succs.end(),
+                  [](const Edge &a, const Edge &b) { return a.Count > b.Count; });
     }
 
     void reset() {
-        hqemu::MutexGuard locked(lock);
-        SuccCFG.clear();
+        for (unsigned i = 0; i < CFG_NUM_SHARDS; ++i) {
+            hqemu::MutexGuard locked(Shards[i].lock);
+            Shards[i].SuccCFG.clear();
+        }
     }
+
+    /* Add the edge src->dst or increase its count if it exists. */
     void insertLink(TranslationBlock *src, TranslationBlock *dst) {
-        hqemu::MutexGuard locked(lock);
-        SuccCFG[src].push_back(dst);
+        Shard &S = getShard(src);
+        hqemu::MutexGuard locked(S.lock);
+        EdgeVec &Succs = S.SuccCFG[src];
+        for (auto &E : Succs) {
+            if (E.TB == dst) {
+                E.Count++;
+                return;
+            }
+        }
+        Succs.push_back(Edge(dst, 1));
     }
 };
 
@@ -248,6 +463,13 @@ static inline std::string toZextStr(T Num) {
     return ss.str();
 }
 
+/* Return the current time in microseconds. */
+static inline uint64_t getTimestamp() {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
 /* Misc utilities */
 pid_t gettid();
 void patch_jmp(volatile uintptr_t patch_addr, volatile uintptr_t addr);
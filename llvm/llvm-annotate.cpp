@@ -72,6 +72,8 @@ static LoopMetadata *ParseXMLLoop(XMLElement *LoopNode)
         else if (Name == "start")    LoopMD->Start = atoi(Val);
         else if (Name == "end")      LoopMD->End = atoi(Val);
         else if (Name == "stride")   LoopMD->Stride = atoi(Val);
+        else if (Name == "tripcount")
+            LoopMD->TripCount = strtoull(Val, nullptr, 10);
 next:
         Attr = Attr->NextSiblingElement();
     }
@@ -131,6 +133,75 @@ bool AnnotationFactory::hasLoopAnnotation(target_ulong addr)
     return Loops.count(addr) ? true : false;
 }
 
+/* Add a loop annotation. An existing annotation of the same address is
+ * kept and the new one is dropped. */
+void AnnotationFactory::addLoopAnnotation(LoopMetadata *LoopMD)
+{
+    hqemu::MutexGuard locked(Lock);
+
+    if (Loops.count(LoopMD->Address)) {
+        delete LoopMD;
+        return;
+    }
+    Loops[LoopMD->Address] = LoopMD;
+}
+
+static void WriteXMLAttr(XMLDocument &Doc, XMLElement *LoopNode,
+                         const char *Name, const std::string &Val)
+{
+    XMLElement *Attr = Doc.NewElement(Name);
+    Attr->InsertEndChild(Doc.NewText(Val.c_str()));
+    LoopNode->InsertEndChild(Attr);
+}
+
+/* Write all loop annotations in the format read by ParseXML. Fields which
+ * are not set are omitted. */
+int AnnotationFactory::WriteXML(const char *name)
+{
+    hqemu::MutexGuard locked(Lock);
+    XMLDocument Doc;
+    XMLElement *RootNode = Doc.NewElement("hqemu");
+    Doc.InsertEndChild(RootNode);
+
+    for (auto L : Loops) {
+        LoopMetadata *LoopMD = L.second;
+        XMLElement *LoopNode = Doc.NewElement("loop");
+        RootNode->InsertEndChild(LoopNode);
+
+        std::stringstream ss;
+        ss << "0x" << std::hex << LoopMD->Address;
+        WriteXMLAttr(Doc, LoopNode, "address", ss.str());
+        if (LoopMD->Length != (uint32_t)-1)
+            WriteXMLAttr(Doc, LoopNode, "length", std::to_string(LoopMD->Length));
+        if (LoopMD->VS != (uint32_t)-1)
+            WriteXMLAttr(Doc, LoopNode, "vs", std::to_string(LoopMD->VS));
+        if (LoopMD->VF != (uint32_t)-1)
+            WriteXMLAttr(Doc, LoopNode, "vf", std::to_string(LoopMD->VF));
+        if (LoopMD->Distance != INT_MIN) {
+            int Distance = LoopMD->Distance == INT_MAX ? 0 : LoopMD->Distance;
+            WriteXMLAttr(Doc, LoopNode, "distance", std::to_string(Distance));
+        }
+        if (LoopMD->Start != -1)
+            WriteXMLAttr(Doc, LoopNode, "start", std::to_string(LoopMD->Start));
+        if (LoopMD->End != -1)
+            WriteXMLAttr(Doc, LoopNode, "end", std::to_string(LoopMD->End));
+        if (LoopMD->Stride != -1)
+            WriteXMLAttr(Doc, LoopNode, "stride", std::to_string(LoopMD->Stride));
+        if (LoopMD->TripCount)
+            WriteXMLAttr(Doc, LoopNode, "tripcount",
+                         std::to_string(LoopMD->TripCount));
+    }
+
+    if (Doc.SaveFile(name) != 0) {
+        dbg() << DEBUG_ANNOTATE << "Cannot write annotation file " << name << "\n";
+        return 1;
+    }
+
+    dbg() << DEBUG_ANNOTATE << "Wrote " << Loops.size()
+          << " loop annotation(s) to " << name << "\n";
+    return 0;
+}
+
 /*
  * vim: ts=8 sts=4 sw=4 expandtab
  */
@@ -29,13 +29,13 @@ Value *IRFactory::QEMULoad(Value *AddrL, Value *AddrH, TCGMemOpIdx oi)
 
     if (GUEST_BASE == 0 || Segment != 0) {
         Base = ITP(Base, PtrTy);
-        LI = new LoadInst(Base, "", true, LastInst);
+        LI = new LoadInst(Base, "", VolatileGuestMemory, LastInst);
     } else {
         Base = ITP(Base, Int8PtrTy);
         Base = GetElementPtrInst::CreateInBounds(Base, GuestBaseReg.Base, "", LastInst);
         if (Base->getType() != PtrTy)
             Base = CAST(Base, PtrTy);
-        LI = new LoadInst(Base, "", true, LastInst);
+        LI = new LoadInst(Base, "", VolatileGuestMemory, LastInst);
     }
     MF->setGuestMemory(LI);
 
@@ -53,17 +53,69 @@ void IRFactory::QEMUStore(Value *Data, Value *AddrL, Value *AddrH, TCGMemOpIdx o
 
     if (GUEST_BASE == 0 || Segment != 0) {
         Base = ITP(Base, PtrTy);
-        SI = new StoreInst(Data, Base, true, LastInst);
+        SI = new StoreInst(Data, Base, VolatileGuestMemory, LastInst);
     } else {
         Base = ITP(Base, Int8PtrTy);
         Base = GetElementPtrInst::CreateInBounds(Base, GuestBaseReg.Base, "", LastInst);
         if (Base->getType() != PtrTy)
             Base = CAST(Base, PtrTy);
-        SI = new StoreInst(Data, Base, true, LastInst);
+        SI = new StoreInst(Data, Base, VolatileGuestMemory, LastInst);
     }
     MF->setGuestMemory(SI);
 }
 
+/*
+ * QEMULoadVector()
+ *  Load a 128-bit vector from the guest memory.
+ */
+Value *IRFactory::QEMULoadVector(Value *Addr, VectorType *VectorTy, TCGArg MemArg)
+{
+    unsigned Align = get_vec_align(MemArg);
+    PointerType *PtrTy = PointerType::get(VectorTy, Segment);
+    Value *Base = Addr;
+    LoadInst *LI;
+
+    if (GUEST_BASE == 0 || Segment != 0) {
+        Base = ITP(Base, PtrTy);
+        LI = new LoadInst(Base, "", VolatileGuestMemory, LastInst);
+    } else {
+        Base = ITP(Base, Int8PtrTy);
+        Base = GetElementPtrInst::CreateInBounds(Base, GuestBaseReg.Base, "", LastInst);
+        if (Base->getType() != PtrTy)
+            Base = CAST(Base, PtrTy);
+        LI = new LoadInst(Base, "", VolatileGuestMemory, LastInst);
+    }
+    LI->setAlignment(Align == VEC_UNALIGNED ? 4 : Align / 8);
+    MF->setGuestMemory(LI);
+
+    return LI;
+}
+
+/*
+ * QEMUStoreVector()
+ *  Store a 128-bit vector to the guest memory.
+ */
+void IRFactory::QEMUStoreVector(Value *Data, Value *Addr, TCGArg MemArg)
+{
+    unsigned Align = get_vec_align(MemArg);
+    PointerType *PtrTy = PointerType::get(Data->getType(), Segment);
+    Value *Base = Addr;
+    StoreInst *SI;
+
+    if (GUEST_BASE == 0 || Segment != 0) {
+        Base = ITP(Base, PtrTy);
+        SI = new StoreInst(Data, Base, VolatileGuestMemory, LastInst);
+    } else {
+        Base = ITP(Base, Int8PtrTy);
+        Base = GetElementPtrInst::CreateInBounds(Base, GuestBaseReg.Base, "", LastInst);
+        if (Base->getType() != PtrTy)
+            Base = CAST(Base, PtrTy);
+        SI = new StoreInst(Data, Base, VolatileGuestMemory, LastInst);
+    }
+    SI->setAlignment(Align == VEC_UNALIGNED ? 4 : Align / 8);
+    MF->setGuestMemory(SI);
+}
+
 #else /* !CONFIG_USER_ONLY */
 
 inline long getTLBOffset(int mem_index)
@@ -96,6 +148,35 @@ inline long getTLBOffset(int mem_index)
     return Offset;
 }
 
+#if defined(ENABLE_TLB_RESIZE)
+/*
+ * LoadTLBMask()
+ *  Load the current size mask of the TLB of the MMU mode. Like the TLB
+ *  version, it only changes inside helper calls (tlb_flush).
+ */
+Value *IRFactory::LoadTLBMask(int mem_index, IntegerType *Ty)
+{
+    if (mem_index < 0 || mem_index >= NB_MMU_MODES)
+        IRError("%s: internal error. mem_index=%d\n", __func__, mem_index);
+
+    size_t Offset = offsetof(CPUArchState, tlb_mask) +
+                    mem_index * sizeof(uintptr_t);
+    Value *TLBMask = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(Offset), "", LastInst);
+    TLBMask = new BitCastInst(TLBMask, IntPtrTy->getPointerTo(), "", LastInst);
+    TLBMask = new LoadInst(TLBMask, "tlb.mask", false, LastInst);
+    if (Ty != IntPtrTy)
+        TLBMask = TRUNC(TLBMask, Ty);
+    return TLBMask;
+}
+#endif
+
+/*
+ * ConcatTLBVersion()
+ *  Merge the current TLB version into the page address to compare. The
+ *  version only changes inside helper calls (tlb_flush), so the load is not
+ *  volatile and can be shared by the guest memory accesses of a region.
+ */
 Value *IRFactory::ConcatTLBVersion(Value *GVA)
 {
 #if defined(ENABLE_TLBVERSION_EXT)
@@ -105,24 +186,26 @@ Value *IRFactory::ConcatTLBVersion(Value *GVA)
     Value *TLBVersion = GetElementPtrInst::CreateInBounds(CPU,
             CONSTPtr(offsetof(CPUArchState, tlb_version)), "", LastInst);
     TLBVersion = new BitCastInst(TLBVersion, PtrTy, "", LastInst);
-    TLBVersion = new LoadInst(TLBVersion, "version", true, LastInst);
+    TLBVersion = new LoadInst(TLBVersion, "version", false, LastInst);
     return OR(GVA, TLBVersion);
 }
 
-Value *IRFactory::QEMULoad(Value *AddrL, Value *AddrH, TCGMemOpIdx oi)
+/*
+ * LookupTLB()
+ *  Emit the TLB lookup of a guest access of (1 << s_bits) bytes. The current
+ *  block branches to tlb_hit if the page is in the TLB and to tlb_miss
+ *  otherwise. The host address of the access is computed at the end of
+ *  tlb_hit, and GuestPC is set to the guest address for the miss helpers.
+ */
+Value *IRFactory::LookupTLB(Value *AddrL, Value *AddrH, int mem_index,
+                            int s_bits, bool IsWrite, BasicBlock *tlb_hit,
+                            BasicBlock *tlb_miss, BasicBlock *tlb_exit,
+                            Value *&GuestPC)
 {
-    TCGMemOp opc = get_memop(oi);
-    int mem_index = get_mmuidx(oi);
     IntegerType *AccessTy;
     PointerType *GuestPtrTy, *HostPtrTy;
-    int Size, s_bits = opc & MO_SIZE;
-
-    Size = 8 * 1 << s_bits; /* data size (bits) for this load */
-
-    const void *helper = llvm_ld_helpers[opc & (MO_BSWAP | MO_SIZE)];
-    Function *MissFunc = ResolveFunction(getMMUFName(helper));
-    if (!MissFunc)
-        IRError("%s: internal error.\n", __func__);
+    size_t Which = IsWrite ? offsetof(CPUTLBEntry, addr_write)
+                           : offsetof(CPUTLBEntry, addr_read);
 
     GuestPtrTy = (TARGET_LONG_BITS == 32) ? Int32PtrTy : Int64PtrTy;
     HostPtrTy = (TCG_TARGET_REG_BITS == 32) ? Int32PtrTy : Int64PtrTy;
@@ -131,18 +214,16 @@ Value *IRFactory::QEMULoad(Value *AddrL, Value *AddrH, TCGMemOpIdx oi)
     GuestPtrTy = Int64PtrTy;
 #endif
 
-    /* Create TLB basic blocks. */
-    BasicBlock *tlb_hit = BasicBlock::Create(*Context, "tlb_hit", Func);
-    BasicBlock *tlb_miss = BasicBlock::Create(*Context, "tlb_miss", Func);
-    BasicBlock *tlb_exit = BasicBlock::Create(*Context, "tlb_exit", Func);
-    toSink.push_back(tlb_miss);
-
     /* Load compared value in TLB. QEMU uses only addrlo to index the TLB entry. */
     Value *TLBEntry, *TLBValue, *CPUAddr;
     AccessTy = (TCG_TARGET_REG_BITS == 64 && TARGET_LONG_BITS == 64) ? Int64Ty : Int32Ty;
-    size_t Offset = getTLBOffset(mem_index) + offsetof(CPUTLBEntry, addr_read);
+    size_t Offset = getTLBOffset(mem_index) + Which;
     TLBEntry = LSHR(AddrL, ConstantInt::get(AccessTy, TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS));
+#if defined(ENABLE_TLB_RESIZE)
+    TLBEntry = AND(TLBEntry, LoadTLBMask(mem_index, AccessTy));
+#else
     TLBEntry = AND(TLBEntry, ConstantInt::get(AccessTy, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS));
+#endif
     TLBEntry = ADD(TLBEntry, ConstantInt::get(AccessTy, Offset));
 
     if (TLBEntry->getType() != IntPtrTy)
@@ -151,10 +232,12 @@ Value *IRFactory::QEMULoad(Value *AddrL, Value *AddrH, TCGMemOpIdx oi)
     CPUAddr = new PtrToIntInst(CPU, IntPtrTy, "", LastInst);
     TLBEntry = ADD(CPUAddr, TLBEntry);
     TLBValue = new IntToPtrInst(TLBEntry, GuestPtrTy, "", LastInst);
-    TLBValue = new LoadInst(TLBValue, "tlb.read", false, LastInst);
+    TLBValue = new LoadInst(TLBValue, IsWrite ? "tlb.write" : "tlb.read",
+                            false, LastInst);
 
     /* Compare GVA and TLB value. */
-    Value *GVA, *Cond, *GuestPC = AddrL;
+    Value *GVA, *Cond;
+    GuestPC = AddrL;
     AccessTy = (TARGET_LONG_BITS == 32) ? Int32Ty : Int64Ty;
     if (AddrH) { /* guest is 64-bit and host is 32-bit. */
         GuestPC = SHL(ZEXT64(AddrH), CONST64(32));
@@ -176,19 +259,45 @@ Value *IRFactory::QEMULoad(Value *AddrL, Value *AddrH, TCGMemOpIdx oi)
     LastInst->eraseFromParent();
 
     /* TLB hit. */
-    Value *PhyAddr, *Addend, *HitData, *Addr=AddrL;
+    Value *Addend, *Addr = AddrL;
 
     LastInst = BranchInst::Create(tlb_exit, tlb_hit);
     if (Addr->getType() != IntPtrTy)
         Addr = new ZExtInst(Addr, IntPtrTy, "", LastInst);
 
-    Offset = offsetof(CPUTLBEntry, addend) - offsetof(CPUTLBEntry, addr_read);
+    Offset = offsetof(CPUTLBEntry, addend) - Which;
     Addend = ADD(TLBEntry, ConstantInt::get(IntPtrTy, Offset));
     Addend = new IntToPtrInst(Addend, HostPtrTy, "", LastInst);
     Addend = new LoadInst(Addend, "tlb.addend", false, LastInst);
-    PhyAddr = ADD(Addr, Addend);
+    return ADD(Addr, Addend);
+}
+
+Value *IRFactory::QEMULoad(Value *AddrL, Value *AddrH, TCGMemOpIdx oi)
+{
+    TCGMemOp opc = get_memop(oi);
+    int mem_index = get_mmuidx(oi);
+    int Size, s_bits = opc & MO_SIZE;
+
+    Size = 8 * 1 << s_bits; /* data size (bits) for this load */
+
+    const void *helper = llvm_ld_helpers[opc & (MO_BSWAP | MO_SIZE)];
+    Function *MissFunc = ResolveFunction(getMMUFName(helper));
+    if (!MissFunc)
+        IRError("%s: internal error.\n", __func__);
+
+    /* Create TLB basic blocks. */
+    BasicBlock *tlb_hit = BasicBlock::Create(*Context, "tlb_hit", Func);
+    BasicBlock *tlb_miss = BasicBlock::Create(*Context, "tlb_miss", Func);
+    BasicBlock *tlb_exit = BasicBlock::Create(*Context, "tlb_exit", Func);
+    toSink.push_back(tlb_miss);
+
+    /* TLB hit. */
+    Value *PhyAddr, *HitData, *GuestPC;
+    PhyAddr = LookupTLB(AddrL, AddrH, mem_index, s_bits, false,
+                        tlb_hit, tlb_miss, tlb_exit, GuestPC);
     PhyAddr = ITP(PhyAddr, getPointerTy(Size));
-    HitData = new LoadInst(PhyAddr, "hit", true, LastInst);
+    HitData = new LoadInst(PhyAddr, "hit", VolatileGuestMemory, LastInst);
+    MF->setGuestMemory(cast<Instruction>(HitData));
 
     HitData = ConvertEndian(HitData, opc);
 
@@ -241,8 +350,6 @@ void IRFactory::QEMUStore(Value *Data, Value *AddrL, Value *AddrH, TCGMemOpIdx o
 {
     TCGMemOp opc = get_memop(oi);
     int mem_index = get_mmuidx(oi);
-    IntegerType *AccessTy;
-    PointerType *GuestPtrTy, *HostPtrTy;
     int Size, s_bits = opc & MO_SIZE;
 
     Size = 8 * 1 << s_bits; /* data size (bits) for this load */
@@ -252,74 +359,22 @@ void IRFactory::QEMUStore(Value *Data, Value *AddrL, Value *AddrH, TCGMemOpIdx o
     if (!MissFunc)
         IRError("%s: internal error.\n", __func__);
 
-    GuestPtrTy = (TARGET_LONG_BITS == 32) ? Int32PtrTy : Int64PtrTy;
-    HostPtrTy = (TCG_TARGET_REG_BITS == 32) ? Int32PtrTy : Int64PtrTy;
-
-#if defined(ENABLE_TLBVERSION_EXT)
-    GuestPtrTy = Int64PtrTy;
-#endif
-
     /* Create TLB basic blocks. */
     BasicBlock *tlb_hit = BasicBlock::Create(*Context, "tlb_hit", Func);
     BasicBlock *tlb_miss = BasicBlock::Create(*Context, "tlb_miss", Func);
     BasicBlock *tlb_exit = BasicBlock::Create(*Context, "tlb_exit", Func);
     toSink.push_back(tlb_miss);
 
-    /* Load compared value in TLB. QEMU uses only addrlo to index the TLB entry. */
-    Value *TLBEntry, *TLBValue, *CPUAddr;
-    AccessTy = (TCG_TARGET_REG_BITS == 64 && TARGET_LONG_BITS == 64) ? Int64Ty : Int32Ty;
-    size_t Offset = getTLBOffset(mem_index) + offsetof(CPUTLBEntry, addr_write);
-    TLBEntry = LSHR(AddrL, ConstantInt::get(AccessTy, TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS));
-    TLBEntry = AND(TLBEntry, ConstantInt::get(AccessTy, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS));
-    TLBEntry = ADD(TLBEntry, ConstantInt::get(AccessTy, Offset));
-
-    if (TLBEntry->getType() != IntPtrTy)
-        TLBEntry = new ZExtInst(TLBEntry, IntPtrTy, "", LastInst);
-
-    CPUAddr = new PtrToIntInst(CPU, IntPtrTy, "", LastInst);
-    TLBEntry = ADD(CPUAddr, TLBEntry);
-    TLBValue = new IntToPtrInst(TLBEntry, GuestPtrTy, "", LastInst);
-    TLBValue = new LoadInst(TLBValue, "tlb.write", false, LastInst);
-
-    /* Compare GVA and TLB value. */
-    Value *GVA, *Cond, *GuestPC = AddrL;
-    AccessTy = (TARGET_LONG_BITS == 32) ? Int32Ty : Int64Ty;
-    if (AddrH != nullptr) { /* guest is 64-bit and host is 32-bit. */
-        GuestPC = SHL(ZEXT64(AddrH), CONST64(32));
-        GuestPC = OR(GuestPC, ZEXT64(AddrL));
-    }
-#if defined(ALIGNED_ONLY)
-    GVA = AND(GuestPC, ConstantInt::get(AccessTy,
-              TARGET_PAGE_MASK | ((1 << s_bits) - 1)));
-#elif defined(ENABLE_TLBVERSION)
-    GVA = ADD(GuestPC, ConstantInt::get(AccessTy, (1 << s_bits) - 1));
-    GVA = AND(GVA, ConstantInt::get(AccessTy, TARGET_PAGE_MASK));
-    GVA = ConcatTLBVersion(GVA);
-#else
-    GVA = ADD(GuestPC, ConstantInt::get(AccessTy, (1 << s_bits) - 1));
-    GVA = AND(GVA, ConstantInt::get(AccessTy, TARGET_PAGE_MASK));
-#endif
-    Cond = ICMP(GVA, TLBValue, ICmpInst::ICMP_EQ);
-    BranchInst::Create(tlb_hit, tlb_miss, Cond, LastInst);
-    LastInst->eraseFromParent();
-
     /* TLB hit. */
-    Value *PhyAddr, *Addend, *Addr=AddrL;
-
-    LastInst = BranchInst::Create(tlb_exit, tlb_hit);
-    if (Addr->getType() != IntPtrTy)
-        Addr = new ZExtInst(Addr, IntPtrTy, "", LastInst);
-
-    Offset = offsetof(CPUTLBEntry, addend) - offsetof(CPUTLBEntry, addr_write);
-    Addend = ADD(TLBEntry, ConstantInt::get(IntPtrTy, Offset));
-    Addend = new IntToPtrInst(Addend, HostPtrTy, "", LastInst);
-    Addend = new LoadInst(Addend, "tlb.addend", false, LastInst);
-    PhyAddr = ADD(Addr, Addend);
+    Value *PhyAddr, *GuestPC;
+    PhyAddr = LookupTLB(AddrL, AddrH, mem_index, s_bits, true,
+                        tlb_hit, tlb_miss, tlb_exit, GuestPC);
     PhyAddr = ITP(PhyAddr, getPointerTy(Size));
 
     Value *HitData = ConvertEndian(Data, opc);
 
-    new StoreInst(HitData, PhyAddr, true, LastInst);
+    StoreInst *SI = new StoreInst(HitData, PhyAddr, VolatileGuestMemory, LastInst);
+    MF->setGuestMemory(SI);
 
     /* TLB miss. */
     LastInst = BranchInst::Create(tlb_exit, tlb_miss);
@@ -337,6 +392,141 @@ void IRFactory::QEMUStore(Value *Data, Value *AddrL, Value *AddrH, TCGMemOpIdx o
     LastInst = BranchInst::Create(ExitBB, CurrBB);
 }
 
+/*
+ * QEMULoadVector()
+ *  Load a 128-bit vector from the guest memory. The TLB hit path loads the
+ *  whole vector from the host address. The miss path, which also handles
+ *  an access across pages, loads the two halves with the 64-bit helper.
+ */
+Value *IRFactory::QEMULoadVector(Value *Addr, VectorType *VectorTy, TCGArg MemArg)
+{
+    int mem_index = get_vec_mmuidx(MemArg);
+    unsigned Align = get_vec_align(MemArg);
+    TCGMemOpIdx oi = make_memop_idx(MO_LEQ, mem_index);
+
+    /* The halves are copied byte-exactly, so the little-endian helper is
+     * used regardless of the guest endianness. */
+    Function *MissFunc = ResolveFunction(getMMUFName(llvm_ld_helpers[MO_LEQ]));
+    if (!MissFunc)
+        IRError("%s: internal error.\n", __func__);
+
+    BasicBlock *tlb_hit = BasicBlock::Create(*Context, "tlb_hit", Func);
+    BasicBlock *tlb_miss = BasicBlock::Create(*Context, "tlb_miss", Func);
+    BasicBlock *tlb_exit = BasicBlock::Create(*Context, "tlb_exit", Func);
+    toSink.push_back(tlb_miss);
+
+    /* TLB hit. */
+    Value *AddrL = Addr, *AddrH = nullptr, *PhyAddr, *GuestPC;
+    if (TCG_TARGET_REG_BITS == 32 && TARGET_LONG_BITS == 64) {
+        AddrL = TRUNC32(Addr);
+        AddrH = TRUNC32(LSHR(Addr, CONST64(32)));
+    }
+    PhyAddr = LookupTLB(AddrL, AddrH, mem_index, 4, false,
+                        tlb_hit, tlb_miss, tlb_exit, GuestPC);
+    PhyAddr = ITP(PhyAddr, PointerType::getUnqual(VectorTy));
+    LoadInst *HitData = new LoadInst(PhyAddr, "hit", VolatileGuestMemory, LastInst);
+    HitData->setAlignment(Align == VEC_UNALIGNED ? 4 : Align / 8);
+    MF->setGuestMemory(HitData);
+
+    /* TLB miss. */
+    LastInst = BranchInst::Create(tlb_exit, tlb_miss);
+    uint32_t restore_val = setRestorePoint(oi);
+    Type *PairTy = VectorType::get(Int64Ty, 2);
+    Value *MissData = UndefValue::get(PairTy);
+    for (unsigned i = 0; i < 2; ++i) {
+        SmallVector<Value *, 4> Params;
+        Value *PC = (i == 0) ? GuestPC :
+                    ADD(GuestPC, ConstantInt::get(GuestPC->getType(), 8));
+        Params.push_back(CPUStruct);
+        Params.push_back(PC);
+        Params.push_back(CONST32(restore_val));
+
+        Value *Half = CallInst::Create(MissFunc, Params, "", LastInst);
+        if (DL->getTypeSizeInBits(Half->getType()) != 64)
+            Half = ZEXT64(Half);
+        MissData = InsertElementInst::Create(MissData, Half, CONST32(i), "",
+                                             LastInst);
+    }
+    MissData = new BitCastInst(MissData, VectorTy, "", LastInst);
+
+    /* TLB exit. */
+    CurrBB = tlb_exit;
+    LastInst = BranchInst::Create(ExitBB, CurrBB);
+    PHINode *PH = PHINode::Create(VectorTy, 2, "", LastInst);
+    PH->addIncoming(HitData, tlb_hit);
+    PH->addIncoming(MissData, tlb_miss);
+
+    return PH;
+}
+
+/*
+ * QEMUStoreVector()
+ *  Store a 128-bit vector to the guest memory. See QEMULoadVector(). The
+ *  miss path probes the first and the last byte before storing any half,
+ *  so that a store across pages faults before the guest memory is touched
+ *  and does not leave the first half stored.
+ */
+void IRFactory::QEMUStoreVector(Value *Data, Value *Addr, TCGArg MemArg)
+{
+    int mem_index = get_vec_mmuidx(MemArg);
+    unsigned Align = get_vec_align(MemArg);
+    TCGMemOpIdx oi = make_memop_idx(MO_LEQ, mem_index);
+
+    Function *MissFunc = ResolveFunction(getMMUFName(llvm_st_helpers[MO_LEQ]));
+    Function *ProbeFunc = ResolveFunction("llvm_probe_write_mmu");
+    if (!MissFunc || !ProbeFunc)
+        IRError("%s: internal error.\n", __func__);
+
+    BasicBlock *tlb_hit = BasicBlock::Create(*Context, "tlb_hit", Func);
+    BasicBlock *tlb_miss = BasicBlock::Create(*Context, "tlb_miss", Func);
+    BasicBlock *tlb_exit = BasicBlock::Create(*Context, "tlb_exit", Func);
+    toSink.push_back(tlb_miss);
+
+    /* TLB hit. */
+    Value *AddrL = Addr, *AddrH = nullptr, *PhyAddr, *GuestPC;
+    if (TCG_TARGET_REG_BITS == 32 && TARGET_LONG_BITS == 64) {
+        AddrL = TRUNC32(Addr);
+        AddrH = TRUNC32(LSHR(Addr, CONST64(32)));
+    }
+    PhyAddr = LookupTLB(AddrL, AddrH, mem_index, 4, true,
+                        tlb_hit, tlb_miss, tlb_exit, GuestPC);
+    PhyAddr = ITP(PhyAddr, PointerType::getUnqual(Data->getType()));
+    StoreInst *SI = new StoreInst(Data, PhyAddr, VolatileGuestMemory, LastInst);
+    SI->setAlignment(Align == VEC_UNALIGNED ? 4 : Align / 8);
+    MF->setGuestMemory(SI);
+
+    /* TLB miss. */
+    LastInst = BranchInst::Create(tlb_exit, tlb_miss);
+    uint32_t restore_val = setRestorePoint(oi);
+    for (unsigned i = 0; i < 2; ++i) {
+        SmallVector<Value *, 4> Params;
+        Value *PC = (i == 0) ? GuestPC :
+                    ADD(GuestPC, ConstantInt::get(GuestPC->getType(), 15));
+        Params.push_back(CPUStruct);
+        Params.push_back(PC);
+        Params.push_back(CONST32(restore_val));
+
+        CallInst::Create(ProbeFunc, Params, "", LastInst);
+    }
+
+    Value *Pair = new BitCastInst(Data, VectorType::get(Int64Ty, 2), "", LastInst);
+    for (unsigned i = 0; i < 2; ++i) {
+        SmallVector<Value *, 4> Params;
+        Value *PC = (i == 0) ? GuestPC :
+                    ADD(GuestPC, ConstantInt::get(GuestPC->getType(), 8));
+        Value *Half = ExtractElementInst::Create(Pair, CONST32(i), "", LastInst);
+        Params.push_back(CPUStruct);
+        Params.push_back(PC);
+        Params.push_back(Half);
+        Params.push_back(CONST32(restore_val));
+
+        CallInst::Create(MissFunc, Params, "", LastInst);
+    }
+
+    /* TLB exit. */
+    CurrBB = tlb_exit;
+    LastInst = BranchInst::Create(ExitBB, CurrBB);
+}
 #endif /* CONFIG_USER_ONLY */
 
 /*
@@ -49,33 +49,17 @@ void IRFactory::op_vload_128(const TCGArg *args)
 
     TCGArg Off = args[0];
     Register &In = Reg[args[1]];
-    TCGArg Alignment = (args[2] == (TCGArg)-1) ? 4 : args[2] / 8;
     Value *Base = LoadState(In);
-    LoadInst *LI;
 
     AssertType(In.Size == 32 || In.Size == 64);
 
     VectorType *VectorTy = VectorType::get(Int8Ty, 16);
-    PointerType *PtrTy = PointerType::get(VectorTy, Segment);
-
-    if (GUEST_BASE == 0 || Segment != 0) {
-        Base = ITP(Base, PtrTy);
-        LI = new LoadInst(Base, "", true, LastInst);
-    } else {
-        Base = ITP(Base, Int8PtrTy);
-        Base = GetElementPtrInst::CreateInBounds(Base, GuestBaseReg.Base, "", LastInst);
-        if (Base->getType() != PtrTy)
-            Base = CAST(Base, PtrTy);
-        LI = new LoadInst(Base, "", true, LastInst);
-    }
-    LI->setAlignment(Alignment);
-
-    MF->setGuestMemory(LI);
+    Value *Data = QEMULoadVector(Base, VectorTy, args[2]);
 
-    PtrTy = PointerType::getUnqual(VectorTy);
+    PointerType *PtrTy = PointerType::getUnqual(VectorTy);
     Value *V = GetElementPtrInst::CreateInBounds(CPU, CONSTPtr(Off), "", LastInst);
     V = new BitCastInst(V, PtrTy, "", LastInst);
-    new StoreInst(LI, V, false, LastInst);
+    new StoreInst(Data, V, false, LastInst);
 }
 
 void IRFactory::op_vstore_128(const TCGArg *args)
@@ -84,35 +68,17 @@ void IRFactory::op_vstore_128(const TCGArg *args)
 
     TCGArg Off = args[0];
     Register &In = Reg[args[1]];
-    TCGArg Alignment = (args[2] == (TCGArg)-1) ? 4 : args[2] / 8;
     Value *Base = LoadState(In);
-    StoreInst *SI;
 
     AssertType(In.Size == 32 || In.Size == 64);
 
     VectorType *VectorTy = VectorType::get(Int8Ty, 16);
-    PointerType *PtrTy = nullptr;
-
-    PtrTy = PointerType::getUnqual(VectorTy);
+    PointerType *PtrTy = PointerType::getUnqual(VectorTy);
     Value *V = GetElementPtrInst::CreateInBounds(CPU, CONSTPtr(Off), "", LastInst);
     V = new BitCastInst(V, PtrTy, "", LastInst);
     V = new LoadInst(V, "", false, LastInst);
 
-    PtrTy = PointerType::get(VectorTy, Segment);
-    if (GUEST_BASE == 0 || Segment != 0) {
-        Base = ITP(Base, PtrTy);
-        SI = new StoreInst(V, Base, true, LastInst);
-    } else {
-        Base = ITP(Base, Int8PtrTy);
-        Base = GetElementPtrInst::CreateInBounds(Base, GuestBaseReg.Base, "", LastInst);
-        if (Base->getType() != PtrTy)
-            Base = CAST(Base, PtrTy);
-        SI = new StoreInst(V, Base, true, LastInst);
-    }
-
-    SI->setAlignment(Alignment);
-
-    MF->setGuestMemory(SI);
+    QEMUStoreVector(V, Base, args[2]);
 }
 
 #define llvm_gen_vop(_Fn,_Num,_Ty)      \
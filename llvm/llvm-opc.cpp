@@ -11,6 +11,7 @@
 #include "llvm/Analysis/InlineCost.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Vectorize.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/MC/MCInstrInfo.h"
 #include "llvm-debug.h"
@@ -20,6 +21,7 @@
 #include "llvm-state.h"
 #include "llvm-opc.h"
 #include "llvm-dna.h"
+#include "optimization.h"
 #include "metrics.h"
 #include "AOSPasses.h"
 #include <iostream>
@@ -32,10 +34,29 @@
 static cl::opt<bool> DisableStateMapping("disable-sm", cl::init(false),
     cl::cat(CategoryHQEMU), cl::desc("Disable state mapping"));
 
+static cl::opt<bool> DisableLoopVectorize("disable-loop-vec", cl::init(false),
+    cl::cat(CategoryHQEMU), cl::desc("Disable guest loop vectorization"));
+
+static cl::opt<bool> DisableLazyCC("disable-lazy-cc", cl::init(false),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Disable materializing the guest condition codes at trace exits only"));
+
 /* Options Disabled by default. */
 static cl::opt<bool> EnableSimplifyPointer("enable-simptr", cl::init(false),
     cl::cat(CategoryHQEMU), cl::desc("Enable SimplifyPointer"));
 
+static cl::opt<bool> EnableGuestMemOpt("enable-gmem-opt", cl::init(false),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Emit guest memory accesses as non-volatile loads and stores (system mode only)"));
+
+static cl::opt<bool> StateMappingAB("sm-ab", cl::init(false),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Apply state mapping to every other region for A/B comparison"));
+
+static cl::opt<unsigned> HotHelperSize("hot-helper-size", cl::init(400),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Maximum number of instructions of a hot helper to be inlined (default=400)"));
+
 
 TCGOpDef llvm_op_defs[] = {
 #define DEF(s, oargs, iargs, cargs, flags) \
@@ -121,9 +142,21 @@ void IRFactory::CreateSession(TraceBuilder *builder)
 
     runPasses = true;
 
+    /* A user-mode guest access faults in the trace code without a restore
+     * point, so it must stay in program order. Only the softmmu accesses,
+     * whose faults are raised by the TLB-miss helper, can be reordered. */
+#if defined(CONFIG_USER_ONLY)
+    VolatileGuestMemory = true;
+    if (EnableGuestMemOpt)
+        dbg() << DEBUG_LLVM << "-enable-gmem-opt is not supported in user mode.\n";
+#else
+    VolatileGuestMemory = !EnableGuestMemOpt;
+#endif
+
     /* Reset data structures. */
     StatePtr.clear();
     InlineCalls.clear();
+    ProfileCalls.clear();
     IndirectBrs.clear();
     CommonBB.clear();
     toErase.clear();
@@ -594,6 +627,14 @@ void IRFactory::PreProcess()
 {
     dbg() << DEBUG_LLVM << __func__ << " entered.\n";
 
+    /* The trace info is created only after all blocks are translated, so the
+     * helper profile calls are bound to it here. */
+    for (auto I : ProfileCalls) {
+        CallInst *CI = static_cast<CallInst *>(I);
+        CI->setArgOperand(2, ITP8(CONSTPtr((uintptr_t)Builder->getTrace())));
+    }
+    ProfileCalls.clear();
+
     ProcessErase(toErase);
 
     /* Insert terminator instruction to basic blocks that branch to ExitBB.
@@ -637,6 +678,12 @@ void IRFactory::PreProcess()
 
     TraceInfo *Trace = Builder->getTrace();
     Trace->NumLoop = BackEdges.size();
+    for (unsigned i = 0, e = BackEdges.size(); i != e; ++i) {
+        auto LoopHeader = const_cast<BasicBlock*>(BackEdges[i].second);
+        GraphNode *Node = Builder->getNode(LoopHeader);
+        if (Node)
+            Trace->LoopHeads.push_back(Node->getTB()->pc);
+    }
     dbg() << DEBUG_LLVM << __func__ << ": trace formation with pc "
           << format("0x%" PRIx, Trace->getEntryPC())
           << " length " << Trace->getNumBlock()
@@ -719,6 +766,11 @@ void IRFactory::InitializeLLVMPasses(legacy::FunctionPassManager *FPM)
 
     FPM->add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
 #endif
+
+    /* Let the alias queries separate CPU states from guest memory. */
+#if !defined(LLVM_V35) && !defined(LLVM_V38)
+    FPM->add(createGuestMemoryAAWrapperPass(this));
+#endif
 }
 
 void IRFactory::InitializeLLVMPasses(legacy::PassManager* MPM)
@@ -736,6 +788,29 @@ void IRFactory::InitializeLLVMPasses(legacy::PassManager* MPM)
 #endif
 }
 
+/*
+ * isStateMappingEnabled()
+ *  Guest states are promoted to virtual registers by StateMappingPass: they
+ *  are loaded once in the entry block, which dominates the loops of the
+ *  region, and dirty states are written back at the exits and around the
+ *  non-const helper calls. In the A/B mode, every other region is compiled
+ *  without it and is tagged so that the profile can tell them apart.
+ */
+bool IRFactory::isStateMappingEnabled()
+{
+    static unsigned NumRegion = 0;
+
+    if (DisableStateMapping)
+        return false;
+    if (!StateMappingAB)
+        return true;
+    if (Atomic<unsigned>::inc_return(&NumRegion) & 1)
+        return true;
+
+    Builder->getTrace()->Attribute |= A_NoStateMap;
+    return false;
+}
+
 void IRFactory::Optimize(std::vector<uint16_t>& optimization_set)
 {
 #define addPass(PM, P) do { PM->add(P); } while(0)
@@ -754,14 +829,36 @@ void IRFactory::Optimize(std::vector<uint16_t>& optimization_set)
         addPass(FPM, createProfileExec(this));
         addPass(FPM, createCombineGuestMemory(this));
         addPass(FPM, createCombineZExtTrunc());
+#if defined(ENABLE_TCG_VECTOR)
+        addPass(FPM, createCombineVectorOps(this));
+#endif
+        if (isStateMappingEnabled()) {
+            addPass(FPM, createStateMappingPass(this));
+            addPass(FPM, createPromoteMemoryToRegisterPass());
+            addPassOptional(FPM, createLazyConditionCode(this), DisableLazyCC);
+        }
         addPass(FPM, createCombineCasts(this));
         addPass(FPM, createRedundantStateElimination(this));
-
-        aos::populatePassManager(PM, FPM, optimization_set);
+#if !defined(LLVM_V35) && defined(CONFIG_USER_ONLY)
+        if (getTrace()->NumLoop && !DisableLoopVectorize) {
+            addPass(FPM, createLoopVectorizeHint(this));
+            addPass(FPM, createLoopVectorizePass());
+        }
+#endif
 
         FPM->run(*Func);
-        //PM->run(*Mod);
         delete FPM;
+
+        /* The selected optimization set runs as a separate group so that a
+         * cancelled request does not pay for it. */
+        if (!isCancelled()) {
+            FPM = new legacy::FunctionPassManager(Mod);
+            InitializeLLVMPasses(FPM);
+            aos::populatePassManager(PM, FPM, optimization_set);
+            FPM->run(*Func);
+            //PM->run(*Mod);
+            delete FPM;
+        }
         delete PM;
     }
 #endif
@@ -862,12 +959,32 @@ void IRFactory::FinalizeObject()
     }
 }
 
+/*
+ * isCancelled()
+ *  A member block of the request may be invalidated while it is compiled.
+ *  Abort the compilation so that no more time is spent on it.
+ */
+bool IRFactory::isCancelled()
+{
+    if (Builder->isAborted())
+        return true;
+    if (!Builder->getOpt()->isCancelled())
+        return false;
+
+    dbg() << DEBUG_LLVM << __func__ << ": request cancelled.\n";
+    Builder->Abort();
+    return true;
+}
+
 /* Start the LLVM JIT compilation. */
 void IRFactory::Compile()
 {
     target_ulong pc = Builder->getEntryNode()->getGuestPC();
     std::vector<uint16_t> optimization_set;
 
+    if (isCancelled())
+        return;
+
     std::stringstream ss(std::string(std::getenv("seq")));
 
     ss.ignore();
@@ -901,6 +1018,8 @@ void IRFactory::Compile()
     auto time_val = get_ticks();
     Optimize(optimization_set);
     time_val = get_ticks() - time_val;
+    if (isCancelled())
+        return;
     PostProcess();
 
     VerifyFunction(*Func);
@@ -1371,7 +1490,7 @@ next:
     if (Helpers.find(FName) != Helpers.end()) {
         bool MustInline = false;
         HelperInfo *Helper = Helpers[FName];
-        if (AnalyzeInlineCost(CallSite(CI)) > 0) {
+        if (AnalyzeInlineCost(CallSite(CI)) > 0 || isHotHelper(Helper, FName)) {
             MustInline = true;
             InlineCalls.push_back(CI);
         }
@@ -1379,6 +1498,10 @@ next:
         if (!MustInline) {
             Function *NoInlineF = ResolveFunction(Helper->FuncNoInline->getName());
             CI->setCalledFunction(NoInlineF);
+
+            if (LLVMEnv::ProfileHelper &&
+                Helper->Metrics.NumInsts <= HotHelperSize)
+                InsertProfileHelper(FName);
         }
     }
 
@@ -3836,12 +3959,10 @@ void IRFactory::InsertExit(uintptr_t RetVal, bool setExit)
         MF->setExit(RI);
 }
 
-void IRFactory::InsertLookupIBTC(GraphNode *CurrNode)
+BasicBlock *IRFactory::getLookupIBTCBlock()
 {
-    BasicBlock *BB = nullptr;
-
     if (CommonBB.find("ibtc") == CommonBB.end()) {
-        BB = CommonBB["ibtc"] = BasicBlock::Create(*Context, "ibtc", Func);
+        BasicBlock *BB = CommonBB["ibtc"] = BasicBlock::Create(*Context, "ibtc", Func);
         SmallVector<Value *, 4> Params;
 
         //InsertEnd();
@@ -3857,12 +3978,288 @@ void IRFactory::InsertLookupIBTC(GraphNode *CurrNode)
         IndirectBrs.push_back(IB);
         toSink.push_back(BB);
     }
+    return CommonBB["ibtc"];
+}
 
-    BB = CommonBB["ibtc"];
+void IRFactory::InsertLookupIBTC(GraphNode *CurrNode, Value *NextPC)
+{
+    BasicBlock *BB = getLookupIBTCBlock();
     InsertTimestampEnd();
+
+#if defined(CONFIG_USER_ONLY) && defined(ENABLE_IBTC)
+    if (NextPC) {
+        InsertProbeIBTC(CurrNode, NextPC, BB);
+        return;
+    }
+#endif
     BranchInst::Create(BB, LastInst);
 }
 
+/*
+ * InsertJumpToBlock()
+ *  Emit the validation of the block NextTB found by an inlined lookup at
+ *  LastInst, which must be a placeholder terminator of its own basic block.
+ *  The cs_base and flags of NextTB are compared against the current block and
+ *  the exit request is checked. If all of them and the extra condition Cond
+ *  hold, set current_tb and jump to the optimized code of NextTB; otherwise
+ *  go to MissBB. LastInst is consumed and must be reset by the caller. With
+ *  CountHit, the hit is counted in the inline IBTC hit counter of env.
+ */
+void IRFactory::InsertJumpToBlock(GraphNode *CurrNode, Value *NextTB,
+                                  Value *Cond, BasicBlock *MissBB,
+                                  bool Timestamp, bool CountHit)
+{
+    TranslationBlock *TB = CurrNode->getTB();
+    IntegerType *PCTy = IntegerType::get(*Context, TARGET_LONG_BITS);
+    BasicBlock *HitBB = BasicBlock::Create(*Context, "ibtc.hit", Func);
+
+    Value *CSBase = GetElementPtrInst::CreateInBounds(NextTB,
+            CONSTPtr(offsetof(TranslationBlock, cs_base)), "", LastInst);
+    CSBase = new LoadInst(CAST(CSBase, PCTy->getPointerTo()), "", false, LastInst);
+    Value *Flags = GetElementPtrInst::CreateInBounds(NextTB,
+            CONSTPtr(offsetof(TranslationBlock, flags)), "", LastInst);
+    Flags = new LoadInst(CASTPTR64(Flags), "", false, LastInst);
+
+    intptr_t Offset = offsetof(CPUState, tcg_exit_req) - ENV_OFFSET;
+    Value *ExitRequest = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(Offset), "", LastInst);
+    ExitRequest = new LoadInst(CASTPTR32(ExitRequest), "", true, LastInst);
+
+    Value *Valid = AND(ICMP(CSBase, ConstantInt::get(PCTy, TB->cs_base),
+                            ICmpInst::ICMP_EQ),
+                       ICMP(Flags, CONST64(TB->flags), ICmpInst::ICMP_EQ));
+    Valid = AND(Valid, ICMP(ExitRequest, CONST32(0), ICmpInst::ICMP_EQ));
+    if (Cond)
+        Valid = AND(Valid, Cond);
+    BranchInst::Create(HitBB, MissBB, Valid, LastInst);
+    LastInst->eraseFromParent();
+
+    /* Hit: set current_tb and jump to the optimized code of the block. */
+    LastInst = BranchInst::Create(MissBB, HitBB);
+    if (Timestamp)
+        InsertTimestampEnd();
+
+    if (CountHit) {
+        Value *HitPtr = GetElementPtrInst::CreateInBounds(CPU,
+                CONSTPtr(offsetof(CPUArchState, ibtc_hit)), "", LastInst);
+        HitPtr = CASTPTR64(HitPtr);
+        Value *NumHit = new LoadInst(HitPtr, "", true, LastInst);
+        new StoreInst(ADD(NumHit, CONST64(1)), HitPtr, true, LastInst);
+    }
+
+    Offset = offsetof(CPUState, current_tb) - ENV_OFFSET;
+    Value *CurrentTB = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(Offset), "", LastInst);
+    CurrentTB = CAST(CurrentTB, Int8PtrTy->getPointerTo());
+    StoreInst *SI = new StoreInst(NextTB, CurrentTB, false, LastInst);
+    MF->setExit(SI);
+
+    Value *OptPtr = GetElementPtrInst::CreateInBounds(NextTB,
+            CONSTPtr(offsetof(TranslationBlock, opt_ptr)), "", LastInst);
+    OptPtr = CAST(OptPtr, Int8PtrTy->getPointerTo());
+    Value *Target = new LoadInst(OptPtr, "", false, LastInst);
+    LastInst->eraseFromParent();
+    LastInst = nullptr;
+
+    IndirectBrInst *IB = IndirectBrInst::Create(Target, 1, HitBB);
+    IndirectBrs.push_back(IB);
+}
+
+/*
+ * InsertProbeIBTC()
+ *  Emit the common case of helper_lookup_ibtc inline: hash the next pc, then
+ *  compare the tag, cs_base and flags of the cached block against the current
+ *  block. Only a miss or a pending exit request goes to the helper, so the
+ *  hits are counted here for the IBTC statistics.
+ *  As with TraceLinkIndirectJump, this is only used for user-mode emulation
+ *  where no iTLB check is required and an indirect branch does not change the
+ *  cpu state flags.
+ */
+void IRFactory::InsertProbeIBTC(GraphNode *CurrNode, Value *NextPC,
+                                BasicBlock *MissBB)
+{
+    IntegerType *PCTy = cast<IntegerType>(NextPC->getType());
+    BasicBlock *CheckBB = BasicBlock::Create(*Context, "ibtc.check", Func);
+
+    /* Locate the MRU entry of the set with the same hash as IBTC::set().
+     * The table and its size may change when the IBTC is resized. */
+    Value *TablePtr = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(offsetof(CPUArchState, ibtc_table)), "", LastInst);
+    TablePtr = CAST(TablePtr, Int8PtrTy->getPointerTo());
+    Value *Table = new LoadInst(TablePtr, "", false, LastInst);
+    Value *MaskPtr = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(offsetof(CPUArchState, ibtc_mask)), "", LastInst);
+    MaskPtr = CAST(MaskPtr, IntPtrTy->getPointerTo());
+    Value *Mask = new LoadInst(MaskPtr, "", false, LastInst);
+
+    Value *PC = (PCTy->getBitWidth() < IntPtrTy->getBitWidth()) ?
+                ZEXT(NextPC, IntPtrTy) : NextPC;
+    Value *Idx = AND(LSHR(PC, CONSTPtr(2)), Mask);
+    Value *Entry = GetElementPtrInst::CreateInBounds(Table,
+            MUL(Idx, CONSTPtr(sizeof(IBTC::ibtc_set_t))), "", LastInst);
+
+    Value *Tag = new LoadInst(CAST(Entry, PCTy->getPointerTo()), "", false,
+                              LastInst);
+    BranchInst::Create(CheckBB, MissBB, ICMP(Tag, NextPC, ICmpInst::ICMP_EQ),
+                       LastInst);
+
+    /* Validate the cached block and the exit request. */
+    BranchInst *InsertPos = LastInst;
+    LastInst = BranchInst::Create(MissBB, CheckBB);
+
+    Value *TBPtr = GetElementPtrInst::CreateInBounds(Entry,
+            CONSTPtr(offsetof(IBTC::ibtc_t, tb)), "", LastInst);
+    TBPtr = CAST(TBPtr, Int8PtrTy->getPointerTo());
+    Value *NextTB = new LoadInst(TBPtr, "", false, LastInst);
+
+    InsertJumpToBlock(CurrNode, NextTB, nullptr, MissBB, false, true);
+
+    LastInst = InsertPos;
+}
+
+/* Get the pointers to the top entry of the shadow return stack. */
+void IRFactory::getShadowEntry(Value *Top, Value *&PCPtr, Value *&SlotPtr)
+{
+    IntegerType *PCTy = IntegerType::get(*Context, TARGET_LONG_BITS);
+    Value *Idx = ZEXT(Top, IntPtrTy);
+
+    PCPtr = GetElementPtrInst::CreateInBounds(CPU,
+            ADD(MUL(Idx, CONSTPtr(sizeof(target_ulong))),
+                CONSTPtr(offsetof(CPUArchState, shadow_pc))), "", LastInst);
+    PCPtr = CAST(PCPtr, PCTy->getPointerTo());
+    SlotPtr = GetElementPtrInst::CreateInBounds(CPU,
+            ADD(MUL(Idx, CONSTPtr(sizeof(void *))),
+                CONSTPtr(offsetof(CPUArchState, shadow_slot))), "", LastInst);
+    SlotPtr = CAST(SlotPtr, Int8PtrTy->getPointerTo());
+}
+
+/*
+ * InsertPushReturn()
+ *  Push the return pc of the guest call ending TB and its return slot to the
+ *  shadow return stack. The return slot caches the block of the return pc.
+ */
+void IRFactory::InsertPushReturn(TranslationBlock *TB)
+{
+    IntegerType *PCTy = IntegerType::get(*Context, TARGET_LONG_BITS);
+    uintptr_t *Slot = LLEnv->allocReturnSlot();
+
+    Value *TopPtr = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(offsetof(CPUArchState, shadow_top)), "", LastInst);
+    TopPtr = CASTPTR32(TopPtr);
+    Value *Top = new LoadInst(TopPtr, "", false, LastInst);
+    Top = AND(ADD(Top, CONST32(1)), CONST32(SHADOW_STACK_MASK));
+
+    Value *PCPtr, *SlotPtr;
+    getShadowEntry(Top, PCPtr, SlotPtr);
+    new StoreInst(ConstantInt::get(PCTy, TB->ret_pc), PCPtr, false, LastInst);
+    new StoreInst(ITP8(CONSTPtr((uintptr_t)Slot)), SlotPtr, false, LastInst);
+    new StoreInst(Top, TopPtr, false, LastInst);
+}
+
+/*
+ * InsertPopReturn()
+ *  Pop the top entry of the shadow return stack. The stack is always popped
+ *  at a guest return to keep it balanced, whichever path the return takes.
+ */
+void IRFactory::InsertPopReturn(Value *&RetPC, Value *&RetSlot)
+{
+    Value *TopPtr = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(offsetof(CPUArchState, shadow_top)), "", LastInst);
+    TopPtr = CASTPTR32(TopPtr);
+    Value *Top = new LoadInst(TopPtr, "", false, LastInst);
+
+    Value *PCPtr, *SlotPtr;
+    getShadowEntry(Top, PCPtr, SlotPtr);
+    RetPC = new LoadInst(PCPtr, "", false, LastInst);
+    RetSlot = new LoadInst(SlotPtr, "", false, LastInst);
+
+    Top = AND(SUB(Top, CONST32(1)), CONST32(SHADOW_STACK_MASK));
+    new StoreInst(Top, TopPtr, false, LastInst);
+}
+
+/*
+ * InsertResetReturn()
+ *  Empty the shadow return stack, as shadow_stack_reset() does. Only the
+ *  bottom entry is invalidated, since every pop from an empty stack misses
+ *  and resets it again before reaching the stale entries above it.
+ */
+void IRFactory::InsertResetReturn()
+{
+    IntegerType *PCTy = IntegerType::get(*Context, TARGET_LONG_BITS);
+    Value *TopPtr = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(offsetof(CPUArchState, shadow_top)), "", LastInst);
+    Value *PCPtr = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(offsetof(CPUArchState, shadow_pc)), "", LastInst);
+    new StoreInst(CONST32(0), CASTPTR32(TopPtr), false, LastInst);
+    new StoreInst(ConstantInt::get(PCTy, (target_ulong)-1),
+                  CAST(PCPtr, PCTy->getPointerTo()), false, LastInst);
+}
+
+/*
+ * InsertProbeReturn()
+ *  Predict a guest return with the entry popped from the shadow return stack.
+ *  If the return pc matches and the return slot holds a valid block, jump to
+ *  the block directly. If the return pc matches but the slot is not filled,
+ *  ask the IBTC helper to fill it. Otherwise, continue with the generic
+ *  indirect branch lookup.
+ *
+ *  Calls and returns executed by the block code are not tracked, so a return
+ *  pc mismatch means the stack is out of sync with the guest. The stack is
+ *  emptied on a miss, rather than letting every following return mispredict.
+ */
+void IRFactory::InsertProbeReturn(GraphNode *CurrNode, Value *NextPC,
+                                  Value *RetPC, Value *RetSlot)
+{
+    BasicBlock *CheckBB = BasicBlock::Create(*Context, "ret.check", Func);
+    BasicBlock *ValidBB = BasicBlock::Create(*Context, "ret.valid", Func);
+    BasicBlock *FillBB = BasicBlock::Create(*Context, "ret.fill", Func);
+    BasicBlock *MissBB = BasicBlock::Create(*Context, "ret.miss", Func);
+
+    BranchInst::Create(CheckBB, MissBB, ICMP(RetPC, NextPC, ICmpInst::ICMP_EQ),
+                       LastInst);
+    LastInst->eraseFromParent();
+
+    /* Load the block cached in the return slot. */
+    LastInst = BranchInst::Create(FillBB, CheckBB);
+    Value *NextTB = new LoadInst(CAST(RetSlot, Int8PtrTy->getPointerTo()), "",
+                                 false, LastInst);
+    Value *IsNull = ICMP(NextTB, ConstantPointerNull::get(Int8PtrTy),
+                         ICmpInst::ICMP_EQ);
+    BranchInst::Create(FillBB, ValidBB, IsNull, LastInst);
+    LastInst->eraseFromParent();
+
+    /* The slot may be stale, so check its pc and mode as well. */
+    LastInst = BranchInst::Create(FillBB, ValidBB);
+    Value *PC = GetElementPtrInst::CreateInBounds(NextTB,
+            CONSTPtr(offsetof(TranslationBlock, pc)), "", LastInst);
+    PC = new LoadInst(CAST(PC, NextPC->getType()->getPointerTo()), "", false,
+                      LastInst);
+    Value *Mode = GetElementPtrInst::CreateInBounds(NextTB,
+            CONSTPtr(offsetof(TranslationBlock, mode)), "", LastInst);
+    Mode = new LoadInst(CASTPTR32(Mode), "", false, LastInst);
+    Value *Cond = AND(ICMP(PC, NextPC, ICmpInst::ICMP_EQ),
+                      ICMP(Mode, CONST32(BLOCK_INVALID), ICmpInst::ICMP_NE));
+    InsertJumpToBlock(CurrNode, NextTB, Cond, FillBB, true);
+
+    /* Fill: let the IBTC helper or the dispatcher record the block. */
+    LastInst = BranchInst::Create(getLookupIBTCBlock(), FillBB);
+    Value *FillPtr = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(offsetof(CPUArchState, shadow_fill)), "", LastInst);
+    new StoreInst(RetSlot, CAST(FillPtr, Int8PtrTy->getPointerTo()), false,
+                  LastInst);
+    Value *FillPCPtr = GetElementPtrInst::CreateInBounds(CPU,
+            CONSTPtr(offsetof(CPUArchState, shadow_fill_pc)), "", LastInst);
+    new StoreInst(NextPC, CAST(FillPCPtr, NextPC->getType()->getPointerTo()),
+                  false, LastInst);
+    InsertTimestampEnd();
+    toSink.push_back(FillBB);
+
+    /* Miss: resync the stack and continue with the generic lookup. */
+    CurrBB = MissBB;
+    LastInst = BranchInst::Create(ExitBB, CurrBB);
+    InsertResetReturn();
+}
+
 void IRFactory::InsertLookupCPBL(GraphNode *CurrNode)
 {
     SmallVector<Value *, 4> Params;
@@ -3966,6 +4363,139 @@ void IRFactory::TraceLinkIndirectJump(GraphNode *NextNode, StoreInst *SI)
     LastInst = BranchInst::Create(ExitBB, CurrBB);
 }
 
+/*
+ * TraceLinkIndirectExit()
+ *  Guess the target pc of an indirect branch that is not in the trace. If the
+ *  guess is correct, leave the trace through a chain slot so that the trace is
+ *  linked to the target code directly.
+ */
+void IRFactory::TraceLinkIndirectExit(target_ulong pc, StoreInst *SI)
+{
+    dbg() << DEBUG_LLVM << "    - Found an indirect branch. Guess pc "
+          << format("0x%" PRIx, pc) << " (exit)\n";
+
+    BasicBlock *ifTrue = BasicBlock::Create(*Context, "ib.exit", Func);
+    BasicBlock *ifFalse = BasicBlock::Create(*Context, "exit_stub", Func);
+
+    Value *NextPC = SI->getValueOperand();
+    Value *GuessPC = ConstantInt::get(NextPC->getType(), pc);
+
+    Value *Cond = ICMP(NextPC, GuessPC, ICmpInst::ICMP_EQ);
+    BranchInst::Create(ifTrue, ifFalse, Cond, LastInst);
+    LastInst->eraseFromParent();
+
+    LastInst = BranchInst::Create(ExitBB, ifTrue);
+    InsertTimestampEnd();
+    InsertLinkAndExit(LastInst);
+    LastInst->eraseFromParent();
+    toSink.push_back(ifTrue);
+
+    CurrBB = ifFalse;
+    LastInst = BranchInst::Create(ExitBB, CurrBB);
+}
+
+/*
+ * TraceLinkProfiledTarget()
+ *  Speculatively inline the hot targets of the indirect branch ending the
+ *  current block from its value profile. A target in the region is linked as
+ *  an internal branch; any other target leaves the trace through a chain
+ *  slot. The IBTC lookup remains the fallback.
+ */
+void IRFactory::TraceLinkProfiledTarget(GraphNode *CurrNode, StoreInst *SI)
+{
+    TargetProfile *Profile = TargetProfile::lookup(CurrNode->getTB());
+    if (!Profile || !LLVMEnv::IBInline)
+        return;
+
+    TBVec Targets;
+    Profile->getHotTargets(Targets, LLVMEnv::IBInline, IB_INLINE_RATIO);
+    for (auto TB : Targets) {
+        if (TB->mode == BLOCK_INVALID)
+            continue;
+
+        /* The children have been linked already. */
+        bool isChild = false;
+        for (auto Child : CurrNode->getChildren()) {
+            if (Builder->getGuestPC(Child) == TB->pc) {
+                isChild = true;
+                break;
+            }
+        }
+        if (isChild)
+            continue;
+
+        GraphNode *NextNode = findNextNode(TB->pc);
+        if (NextNode)
+            TraceLinkIndirectJump(NextNode, SI);
+        else
+            TraceLinkIndirectExit(TB->pc, SI);
+    }
+}
+
+/*
+ * InsertProfileTarget()
+ *  Record the target of the indirect branch ending the current block when the
+ *  execution leaves the trace, so that a re-formed trace can inline it.
+ */
+void IRFactory::InsertProfileTarget(GraphNode *CurrNode)
+{
+    SmallVector<Value *, 4> Params;
+    Function *F = ResolveFunction("helper_profile_target");
+    Value *Env = ConvertCPUType(F, 0, LastInst);
+
+    Params.push_back(Env);
+    Params.push_back(ITP8(CONSTPtr((uintptr_t)CurrNode->getTB())));
+    CallInst *CI = CallInst::Create(F, Params, "", LastInst);
+    MF->setConst(CI);
+}
+
+/*
+ * isHotHelper()
+ *  Return true if the call to helper FName in the current block was profiled
+ *  hot by an earlier translation of the block. A hot helper is inlined beyond
+ *  the static inlining budget, up to -hot-helper-size instructions.
+ */
+bool IRFactory::isHotHelper(HelperInfo *Helper, const std::string &FName)
+{
+    if (!LLVMEnv::ProfileHelper || Helper->Metrics.NumInsts > HotHelperSize)
+        return false;
+
+    target_ulong pc = Builder->getCurrNode()->getTB()->pc;
+    HelperProfile &Profile = LLEnv->getHelperProfile();
+    return Profile.getCount(pc, FName) >= LLVMEnv::HotHelperCount;
+}
+
+/*
+ * InsertProfileHelper()
+ *  Count the executions of the helper call just emitted in the current block.
+ *  The trace is rebuilt by helper_profile_helper once the call gets hot. The
+ *  call is not profiled in a rebuilt trace, nor once it stays cold in
+ *  -cold-helper-limit traces.
+ */
+void IRFactory::InsertProfileHelper(const std::string &FName)
+{
+    SmallVector<Value *, 4> Params;
+    target_ulong pc = Builder->getCurrNode()->getTB()->pc;
+    HelperProfile &Profile = LLEnv->getHelperProfile();
+
+    if (Profile.isRebuilt(Builder->getEntryNode()->getGuestPC()))
+        return;
+    if (LLVMEnv::ColdHelperLimit &&
+        Profile.isCold(pc, FName, LLVMEnv::ColdHelperLimit))
+        return;
+
+    uint64_t *Counter = Profile.getCounter(pc, FName);
+    Function *F = ResolveFunction("helper_profile_helper");
+    Value *Env = ConvertCPUType(F, 0, LastInst);
+
+    Params.push_back(Env);
+    Params.push_back(ITP8(CONSTPtr((uintptr_t)Counter)));
+    Params.push_back(ITP8(CONSTPtr(0)));
+    CallInst *CI = CallInst::Create(F, Params, "", LastInst);
+    MF->setConst(CI);
+    ProfileCalls.push_back(CI);
+}
+
 void IRFactory::TraceLinkDirectJump(GraphNode *NextNode, StoreInst *SI)
 {
     ConstantInt *NextPC = static_cast<ConstantInt *>(SI->getValueOperand());
@@ -4029,17 +4559,32 @@ void IRFactory::TraceLink(StoreInst *SI)
 {
     GraphNode *CurrNode = Builder->getCurrNode();
     ConstantInt *CI = dyn_cast<ConstantInt>(SI->getValueOperand());
+
+#if defined(CONFIG_USER_ONLY)
+    if (CurrNode->getTB()->branch_kind == BRANCH_CALL)
+        InsertPushReturn(CurrNode->getTB());
+#endif
     if (!CI) {
         /* Indirect branch */
         SaveGlobals(COHERENCE_ALL, LastInst);
 
 #if defined(CONFIG_USER_ONLY)
+        Value *RetPC = nullptr, *RetSlot = nullptr;
+        if (CurrNode->getTB()->branch_kind == BRANCH_RET)
+            InsertPopReturn(RetPC, RetSlot);
+
         for (auto NextNode : CurrNode->getChildren()) {
             TraceLinkIndirectJump(NextNode, SI);
         }
+        TraceLinkProfiledTarget(CurrNode, SI);
+
+        if (RetPC)
+            InsertProbeReturn(CurrNode, SI->getValueOperand(), RetPC, RetSlot);
+        else if (LLVMEnv::RegionReform && LLVMEnv::IBInline)
+            InsertProfileTarget(CurrNode);
 #endif
         //InsertTimestamp(CurrNode);
-        InsertLookupIBTC(CurrNode);
+        InsertLookupIBTC(CurrNode, SI->getValueOperand());
     } else {
         /* Direct branch. */
         target_ulong pc = CI->getZExtValue();
@@ -4437,7 +4982,7 @@ void TraceBuilder::ConvertToTCGIR(CPUArchState *env)
 {
     TranslationBlock *tb = CurrNode->getTB();
 
-    if (LLEnv->isTraceMode()) {
+    if (LLEnv->isTraceMode() || LLVMEnv::AsyncBlock) {
         env->image_base = (uintptr_t)tb->image - tb->pc;
         tcg_copy_state(env, tb);
     }
@@ -4503,6 +5048,11 @@ void TraceBuilder::Finalize()
     Trace = new TraceInfo(NodeUsed, Attribute);
     IF->Compile();
     IF->DeleteSession();
+
+    if (isAborted()) {
+        delete Trace;
+        Trace = nullptr;
+    }
 }
 
 /*
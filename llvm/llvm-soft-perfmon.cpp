@@ -22,11 +22,12 @@ extern unsigned PredictThreshold;
 void SoftwarePerfmon::ParseProfileMode(std::string &ProfileLevel)
 {
     static std::string profile_str[SPM_NUM] = {
-        "none", "basic", "trace", "cache", "pass", "hpm", "exit", "hotspot", "all"
+        "none", "basic", "trace", "cache", "pass", "hpm", "exit", "hotspot",
+        "region", "all"
     };
     static uint64_t profile_enum[SPM_NUM] = {
         SPM_NONE, SPM_BASIC, SPM_TRACE, SPM_CACHE, SPM_PASS, SPM_HPM,
-        SPM_EXIT, SPM_HOTSPOT, SPM_ALL,
+        SPM_EXIT, SPM_HOTSPOT, SPM_REGION, SPM_ALL,
     };
 
     if (ProfileLevel.empty())
@@ -146,6 +147,70 @@ static void printBasic(LLVMEnv::TransCodeList &TransCode)
     OS << "\n";
 }
 
+/*
+ * printRegion()
+ *  Summarize the regions formed by the region formation strategy. The
+ *  compile volume counts all compiled regions, including the ones retired
+ *  by re-formation, and the coverage is the ratio of the executed blocks
+ *  that are included in the active regions.
+ */
+static void printRegion(LLVMEnv::TransCodeList &TransCode)
+{
+    uint32_t NumActive = 0, NumBlock = 0, GuestICount = 0, HostSize = 0;
+    uint64_t TransTime = 0;
+    uint32_t NumNoSM = 0, NoSMHostSize = 0;
+    uint64_t NoSMTransTime = 0;
+    std::set<TranslationBlock *> Covered;
+
+    for (auto TC : TransCode) {
+        TBVec &TBs = TC->Trace->TBs;
+        if (TC->Active) {
+            NumActive++;
+            Covered.insert(TBs.begin(), TBs.end());
+        }
+        for (auto TB : TBs)
+            GuestICount += TB->icount;
+        NumBlock += TBs.size();
+        HostSize += TC->Size;
+        TransTime += TC->Trace->TransTime;
+        if (TC->Trace->hasAttribute(A_NoStateMap)) {
+            NumNoSM++;
+            NoSMHostSize += TC->Size;
+            NoSMTransTime += TC->Trace->TransTime;
+        }
+    }
+
+    uint32_t NumExecuted = 0;
+    for (int i = 0, e = tcg_ctx_global.tb_ctx->nb_tbs; i != e; ++i) {
+        if (tbs[i].mode != BLOCK_NONE)
+            NumExecuted++;
+    }
+
+    auto &OS = DM.debug();
+    OS << "Region statistic:\n"
+       << "Strategy         : " << RegionName[RegionFormation] << "\n"
+       << "Num of Regions   : " << NumActive << "/" << TransCode.size()
+                                << " (active/compiled)\n"
+       << "Compile Volume   : " << NumBlock << " blocks, " << GuestICount
+                                << " insns, " << HostSize << " bytes\n"
+       << "Translation Time : " << format("%.6f", (double)TransTime * 1e-6)
+                                << " seconds\n"
+       << "Block Coverage   : " << Covered.size() << "/" << NumExecuted
+       << format(" (%.1f%%)", NumExecuted ?
+                 (double)Covered.size() * 100 / NumExecuted : 0.0) << "\n";
+
+    /* Regions compiled with and without state mapping in the A/B mode. */
+    if (NumNoSM) {
+        uint32_t NumSM = TransCode.size() - NumNoSM;
+        OS << "State Mapping A/B: on " << NumSM << " regions, "
+           << (HostSize - NoSMHostSize) << " bytes, "
+           << format("%.6f", (double)(TransTime - NoSMTransTime) * 1e-6)
+           << " seconds; off " << NumNoSM << " regions, " << NoSMHostSize
+           << " bytes, " << format("%.6f", (double)NoSMTransTime * 1e-6)
+           << " seconds\n";
+    }
+}
+
 static void printTraceExec(LLVMEnv::TransCodeList &TransCode)
 {
     unsigned NumThread = 0;
@@ -165,7 +230,7 @@ static void printTraceExec(LLVMEnv::TransCodeList &TransCode)
         OS << ">\n"
            << "Thread " << i << ":\n"
            << "                                   dynamic exec count\n"
-           << "  id      pc      #loop:#exit      loop      ibtc      exit\n";
+           << "  id      pc      #loop:#exit      loop      ibtc      exit  sm\n";
         for (unsigned j = 0; j != NumTraces; ++j) {
             TraceInfo *Trace = TransCode[j]->Trace;
             uint64_t *Counter = Trace->ExecCount[i];
@@ -178,7 +243,8 @@ static void printTraceExec(LLVMEnv::TransCodeList &TransCode)
                << format("%2d", Trace->NumExit)   << "   "
                << format("%8" PRId64, Counter[0]) << "  "
                << format("%8" PRId64, Counter[1]) << "  "
-               << format("%8" PRId64, Counter[2]) << "\n";
+               << format("%8" PRId64, Counter[2]) << "  "
+               << (Trace->hasAttribute(A_NoStateMap) ? "off" : "on") << "\n";
         }
         OS << "Trace used: " << TraceUsed << "/" << NumTraces <<"\n";
     }
@@ -313,6 +379,8 @@ void SoftwarePerfmon::printTraceProfile()
     /* Static information */
     if (Mode & SPM_BASIC)
         printBasic(LLEnv->getTransCode());
+    if (Mode & SPM_REGION)
+        printRegion(LLEnv->getTransCode());
     if (Mode & SPM_EXIT)
         OS << "Num of TraceExit : " << NumTraceExits << "\n";
     if (Mode & SPM_HPM)
@@ -337,7 +405,15 @@ void SoftwarePerfmon::printTraceProfile()
            << " size=" << LLVMEnv::TraceCacheSize
            << " code=" << format("%8d", TraceSize) << " (ratio="
            << format("%.2f", (double)TraceSize * 100 / LLVMEnv::TraceCacheSize)
-           << "%)\n\n";
+           << "%)\n";
+#if defined(CONFIG_SOFTMMU)
+        OS << "Large page: flush=" << NumLPTFlush
+           << " false=" << NumLPTFalseFlush << " (ratio="
+           << format("%.2f", NumLPTFlush ?
+                     (double)NumLPTFalseFlush * 100 / NumLPTFlush : 0.0)
+           << "%)\n";
+#endif
+        OS << "\n";
     }
 
     if (Mode & SPM_TRACE)
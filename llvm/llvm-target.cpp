@@ -7,6 +7,7 @@
 #include "llvm/Object/Binary.h"
 #include "llvm/DebugInfo/DIContext.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Host.h"
 #include "llvm-debug.h"
 #include "llvm-opc.h"
 #include "llvm-target.h"
@@ -43,6 +44,8 @@ static std::vector<TCGHelperInfo> MMUHelper = {
     { (void *)llvm_be_stw_mmu,  "llvm_be_stw_mmu", },
     { (void *)llvm_be_stl_mmu,  "llvm_be_stl_mmu", },
     { (void *)llvm_be_stq_mmu,  "llvm_be_stq_mmu", },
+
+    { (void *)llvm_probe_write_mmu, "llvm_probe_write_mmu", },
 #endif
 };
 
@@ -407,6 +410,10 @@ void AddDependentSymbols(LLVMTranslator *Translator)
 {
     Translator->AddSymbol("helper_verify_tb", (void*)helper_verify_tb);
     Translator->AddSymbol("helper_lookup_ibtc", (void*)helper_lookup_ibtc);
+    Translator->AddSymbol("helper_region_exit", (void*)helper_region_exit);
+    Translator->AddSymbol("helper_profile_target", (void*)helper_profile_target);
+    Translator->AddSymbol("helper_profile_helper", (void*)helper_profile_helper);
+    Translator->AddSymbol("helper_check_guest_range", (void*)helper_check_guest_range);
     Translator->AddSymbol("helper_timestamp_begin", (void*)helper_timestamp_begin);
     Translator->AddSymbol("helper_timestamp_end", (void*)helper_timestamp_end);
     Translator->AddSymbol("guest_base", (void*)&guest_base);
@@ -432,6 +439,10 @@ void AddDependentSymbols(LLVMTranslator *Translator)
 {
     Translator->AddSymbol("helper_verify_tb", (void*)helper_verify_tb);
     Translator->AddSymbol("helper_lookup_ibtc", (void*)helper_lookup_ibtc);
+    Translator->AddSymbol("helper_region_exit", (void*)helper_region_exit);
+    Translator->AddSymbol("helper_profile_target", (void*)helper_profile_target);
+    Translator->AddSymbol("helper_profile_helper", (void*)helper_profile_helper);
+    Translator->AddSymbol("helper_check_guest_range", (void*)helper_check_guest_range);
     Translator->AddSymbol("helper_lookup_cpbl", (void*)helper_lookup_cpbl);
     Translator->AddSymbol("helper_validate_cpbl", (void*)helper_validate_cpbl);
     Translator->AddSymbol("cpu_loop_exit", (void*)cpu_loop_exit);
@@ -625,6 +636,17 @@ void ProcessErase(IVec &toErase)
     toErase.clear();
 }
 
+/* Return true if the host CPU has the feature, e.g. "avx2". */
+bool hasHostFeature(const char *Name)
+{
+    static StringMap<bool> HostFeatures = []() {
+        StringMap<bool> Features;
+        sys::getHostCPUFeatures(Features);
+        return Features;
+    }();
+    return HostFeatures.lookup(Name);
+}
+
 
 /*
  * JIT Event Listener
@@ -728,6 +728,9 @@ void LLVMTranslator::Abort(TraceBuilder &Builder)
     target_ulong pc = Builder.getEntryNode()->getGuestPC();
     dbg() << DEBUG_LLVM << __func__
           << ": abort trace pc " << format("0x%" PRIx "", pc) << "\n";
+
+    LLVMEnv::PenalizeHead(Builder.getEntryNode()->getTB());
+    delete Builder.getOpt();
 }
 
 /* Make a jump from the head block in the block code cache to the translated
@@ -748,6 +751,8 @@ void LLVMTranslator::Commit(TraceBuilder &Builder)
     }
 
     if (Invalid || llvm_check_cache() == 1) {
+        if (Invalid)
+            LLVMEnv::PenalizeHead(Trace->getEntryTB());
         delete Trace;
         delete Opt;
         return;
@@ -760,6 +765,7 @@ void LLVMTranslator::Commit(TraceBuilder &Builder)
     TC->EntryTB = Trace->getEntryTB();
     TC->Restore = NI.Restore;
     TC->Trace = Trace;
+    TC->CommitTime = getTimestamp();
 
     /* If we go here, this is a legal trace. */
     LLVMEnv::ChainSlot &ChainPoint = LLEnv->getChainPoint();
@@ -768,7 +774,12 @@ void LLVMTranslator::Commit(TraceBuilder &Builder)
     hqemu::MutexGuard locked(llvm_global_lock);
 
     for (unsigned i = 0; i != NI.NumChainSlot; ++i)
-        ChainPoint[NI.ChainSlot[i].Key] = NI.ChainSlot[i].Addr;
+        ChainPoint.set(NI.ChainSlot[i].Key, NI.ChainSlot[i].Addr);
+
+    /* A re-formed region supersedes the trace currently attached to the
+     * entry block. Retire the old trace before the new one is published. */
+    if (EntryTB->mode == BLOCK_OPTIMIZED && EntryTB->tid != -1)
+        LLEnv->retireTransCode(EntryTB);
 
     TraceID tid = LLEnv->insertTransCode(TC);
     EntryTB->tid = tid;
@@ -778,7 +789,7 @@ void LLVMTranslator::Commit(TraceBuilder &Builder)
     /* Set the jump from the block to the trace */
     patch_jmp(tb_get_jmp_entry(EntryTB), TC->Code);
 
-    if (!SP->isEnabled()) {
+    if (!SP->isEnabled() && !LLVMEnv::KeepTraceInfo) {
         delete Trace;
         TC->Trace = nullptr;
     }
@@ -816,7 +827,13 @@ void LLVMTranslator::GenBlock(CPUArchState *env, OptimizationInfo *Opt)
         dump(env, Opt->getCFG()->getTB());
 
     Builder.ConvertToLLVMIR();
-    Builder.Finalize();
+    if (!Builder.isAborted())
+        Builder.Finalize();
+
+    if (Builder.isAborted()) {
+        Abort(Builder);
+        return;
+    }
 
     if (SP->isEnabled()) {
         gettimeofday(&end, nullptr);
@@ -845,13 +862,19 @@ void LLVMTranslator::GenTrace(CPUArchState *env, OptimizationInfo *Opt)
 
         Builder.ConvertToLLVMIR();
 
-        if (Node->getTB()->mode == BLOCK_INVALID || Builder.isAborted()) {
+        if (Node->getTB()->mode == BLOCK_INVALID || Builder.isAborted() ||
+            Opt->isCancelled()) {
             Abort(Builder);
             return;
         }
     }
     Builder.Finalize();
 
+    if (Builder.isAborted()) {
+        Abort(Builder);
+        return;
+    }
+
     if (SP->isEnabled()) {
         gettimeofday(&end, nullptr);
         Builder.getTrace()->setTransTime(&start, &end);
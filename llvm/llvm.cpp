@@ -14,6 +14,7 @@
 #include "llvm-translator.h"
 #include "llvm-state.h"
 #include "llvm-opc.h"
+#include "llvm-target.h"
 #include "llvm.h"
 #include "tracer.h"
 #include "optimization.h"
@@ -25,6 +26,16 @@
 #define ACTIVE_QUEUE_SIZE   (1 << 16)
 #define ACTIVE_QUEUE_MASK   (ACTIVE_QUEUE_SIZE - 1)
 
+/* Parameters of the adaptive NET profile threshold. */
+#define ADAPT_MIN_SHIFT     2       /* Lowest threshold is base/4 */
+#define ADAPT_MAX_SHIFT     4       /* Highest threshold is base*16 */
+#define ADAPT_MAX_PENALTY   4       /* Penalty of a head is up to 16x */
+#define ADAPT_QUEUE_HIGH    32      /* Queue length regarded as saturated */
+#define ADAPT_INTERVAL      16      /* Number of requests between updates */
+#define ADAPT_IDLE_INTERVAL 1000    /* Idle loops of a translator to update */
+#define SHORT_LIVED_TIME    100000  /* Lifetime (us) of a short-lived trace */
+#define CODE_INDEX_BATCH    32      /* Committed traces per index update */
+
 
 cl::OptionCategory CategoryHQEMU("HQEMU Options");
 
@@ -38,7 +49,7 @@ static cl::opt<std::string> ProfileLevel("profile", cl::init(""),
     cl::cat(CategoryHQEMU), cl::desc("Set profile level"));
 
 static cl::opt<unsigned> NumThreads("threads", cl::init(1),
-    cl::cat(CategoryHQEMU), cl::desc("Number of threads used in the hybridm mode"));
+    cl::cat(CategoryHQEMU), cl::desc("Number of threads used in the hybridm and async block modes"));
 
 static cl::opt<unsigned> NumTranslations("count", cl::init(-1U),
     cl::cat(CategoryHQEMU),
@@ -58,6 +69,58 @@ static cl::opt<bool> DisableNETPlus("disable-netplus", cl::init(false),
     cl::cat(CategoryHQEMU),
     cl::desc("Disable NETPlus algorithm (use NET trace formation only)"));
 
+static cl::opt<unsigned> NETPlusEdgeRatio("netplus-edge-ratio", cl::init(10),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Percentage of the hottest edge count for an edge to be followed by NETPlus (default=10, at most 100)"));
+
+static cl::opt<bool> AdaptiveNET("adaptive-net", cl::init(false),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Adapt the NET profile threshold to the translation pressure"));
+
+static cl::opt<std::string> RegionStrategy("region", cl::init("net"),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Region formation strategy: net, net-strict, lei or tracetree (default=net)"));
+
+static cl::opt<bool> EnableRegionReform("enable-reform", cl::init(false),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Re-form traces whose side exits dominate the execution"));
+
+static cl::opt<unsigned> ReformExitRatio("reform-ratio", cl::init(50),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Percentage of side exits to trigger region re-formation (default=50)"));
+
+static cl::opt<unsigned> ReformExitCount("reform-count", cl::init(10000),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Number of side exits between two re-formation checks (default=10000)"));
+
+static cl::opt<unsigned> ReformMaxBlocks("reform-max-blocks", cl::init(256),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Maximum number of basic blocks in a re-formed region (default=256)"));
+
+static cl::opt<unsigned> IBInlineTargets("ib-inline", cl::init(3),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Number of profiled indirect branch targets inlined at a trace exit (default=3, 0 to disable)"));
+
+static cl::opt<bool> EnableAsyncBlock("async-block", cl::init(false),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Compile blocks with the translator threads in the block mode"));
+
+static cl::opt<bool> EnableProfileHelper("profile-helper", cl::init(false),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Profile helper calls in traces and rebuild traces to inline the hot helpers"));
+
+static cl::opt<unsigned> HotHelperThreshold("hot-helper-count", cl::init(10000),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Number of executions for a helper call to be inlined as hot (default=10000)"));
+
+static cl::opt<unsigned> ColdHelperRounds("cold-helper-limit", cl::init(4),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Number of traces a helper call is profiled in before it is left cold (default=4, 0 for no limit)"));
+
+static cl::opt<std::string> AnnotateDump("annotate-dump", cl::init(""),
+    cl::cat(CategoryHQEMU),
+    cl::desc("Write the profiled trace loops to an annotation file at exit (user mode only)"));
+
 
 /* static members */
 bool LLVMEnv::InitOnce = false;
@@ -65,6 +128,14 @@ int LLVMEnv::TransMode = TRANS_MODE_NONE;
 uint8_t *LLVMEnv::TraceCache = nullptr;
 size_t LLVMEnv::TraceCacheSize = 0;
 bool LLVMEnv::RunWithVTune = false;
+bool LLVMEnv::RegionReform = false;
+bool LLVMEnv::KeepTraceInfo = false;
+bool LLVMEnv::ProfileLoop = false;
+bool LLVMEnv::ProfileHelper = false;
+uint64_t LLVMEnv::HotHelperCount = 0;
+unsigned LLVMEnv::ColdHelperLimit = 0;
+unsigned LLVMEnv::IBInline = 0;
+bool LLVMEnv::AsyncBlock = false;
 
 LLVMDebug DM;
 LLVMEnv *LLEnv;
@@ -92,7 +163,9 @@ extern unsigned PredictThreshold;
  *  instance must be initialized before using the underlying transaltion
  *  service and should be initialized only ONCE.
  */
-LLVMEnv::LLVMEnv() : NumTranslator(1), UseThreading(false), NumFlush(0)
+LLVMEnv::LLVMEnv()
+    : NumTranslator(1), SortedIndex(new CodeIndex), NumIndexPending(0),
+      UseThreading(false), NumFlush(0)
 {
     /* Set LLVMEnv pointer first so other classes can access it. */
     LLEnv = this;
@@ -160,6 +233,70 @@ LLVMEnv::LLVMEnv() : NumTranslator(1), UseThreading(false), NumFlush(0)
                     TraceCache, TraceCacheSize);
 }
 
+/* Loop profile of a guest loop header, accumulated across code cache flushes
+ * for the annotation dump. */
+struct LoopProfile {
+    uint32_t Length;    /* Guest code size of the trace */
+    uint64_t NumIter;   /* Number of loopback iterations */
+    uint64_t NumEntry;  /* Number of trace exits, i.e., loop entries */
+    int Stride;         /* Access stride of the vectorized loop */
+    LoopProfile() : Length(0), NumIter(0), NumEntry(0), Stride(-1) {}
+};
+static std::map<target_ulong, LoopProfile> LoopProfiles;
+
+/* Accumulate the loop counters of the traces in TransCode. A trace with more
+ * than one loop attributes its counters to each of its loop headers. */
+static void CollectLoopProfile(LLVMEnv::TransCodeList &TransCode)
+{
+    for (auto TC : TransCode) {
+        TraceInfo *Trace = TC->Trace;
+        if (!Trace || !Trace->ExecCount || Trace->LoopHeads.empty())
+            continue;
+
+        uint64_t NumIter = 0, NumExit = 0;
+        for (int i = 0; i < MAX_SPM_THREADS; ++i) {
+            uint64_t *Counter = Trace->ExecCount[i];
+            NumIter += Counter[TraceInfo::IDX_LOOP];
+            NumExit += Counter[TraceInfo::IDX_EXIT] +
+                       Counter[TraceInfo::IDX_INBR];
+        }
+        if (NumIter == 0)
+            continue;
+
+        uint32_t Length = 0;
+        for (auto TB : Trace->TBs)
+            Length += TB->size;
+
+        for (auto PC : Trace->LoopHeads) {
+            LoopProfile &Profile = LoopProfiles[PC];
+            Profile.Length = std::max(Profile.Length, Length);
+            Profile.NumIter += NumIter;
+            Profile.NumEntry += NumExit;
+            if (Trace->LoopStride != -1)
+                Profile.Stride = Trace->LoopStride;
+        }
+    }
+}
+
+/* Turn the loop profiles into loop annotations and write them, together with
+ * the annotations loaded at startup, to the file given by -annotate-dump. The
+ * trip count is the average number of iterations per loop entry. */
+static void DumpLoopAnnotation()
+{
+    for (auto &P : LoopProfiles) {
+        LoopProfile &Profile = P.second;
+        LoopMetadata *LoopMD = new LoopMetadata();
+        LoopMD->Address = P.first;
+        LoopMD->Length = Profile.Length;
+        LoopMD->Stride = Profile.Stride;
+        LoopMD->TripCount = Profile.NumEntry ?
+            (Profile.NumIter + Profile.NumEntry) / Profile.NumEntry :
+            Profile.NumIter;
+        AF->addLoopAnnotation(LoopMD);
+    }
+    AF->WriteXML(AnnotateDump.c_str());
+}
+
 LLVMEnv::~LLVMEnv()
 {
     if (TransMode == TRANS_MODE_BLOCK) {
@@ -186,10 +323,17 @@ LLVMEnv::~LLVMEnv()
 
     DeleteTranslator();
 
+    /* The side data of blocks are allocated from TBArena and released in
+     * bulk. Only the chaining info owns memory of its own. */
     for (int i = 0, e = tcg_ctx_global.tb_ctx->nb_tbs; i != e; ++i) {
-        if (tbs[i].image) delete_image(&tbs[i]);
-        if (tbs[i].state) delete_state(&tbs[i]);
         if (tbs[i].chain) ChainInfo::free(&tbs[i]);
+        tbs[i].image = tbs[i].state = tbs[i].target = nullptr;
+    }
+    TBArena.reset();
+
+    if (ProfileLoop) {
+        CollectLoopProfile(TransCode);
+        DumpLoopAnnotation();
     }
 
     SP->printProfile();
@@ -203,6 +347,7 @@ LLVMEnv::~LLVMEnv()
     /* Delete all translated code. */
     for (unsigned i = 0, e = TransCode.size(); i != e; ++i)
         delete TransCode[i];
+    delete SortedIndex;
 
     dbg() << DEBUG_LLVM << "LLVM environment finalized.\n";
 
@@ -339,13 +484,64 @@ void LLVMEnv::ParseCommandLineOptions()
     ProfileThreshold = NETProfileThreshold;
     PredictThreshold = NETPredictThreshold;
 
+    /* An edge can be at most as hot as the hottest edge. */
+    if (NETPlusEdgeRatio > 100)
+        NETPlusEdgeRatio = 100;
+
+    /* Select the region formation strategy. */
+    RegionFormation = REGION_NUM;
+    for (int i = 0; i < REGION_NUM; ++i) {
+        if (RegionStrategy == RegionName[i]) {
+            RegionFormation = i;
+            break;
+        }
+    }
+    if (RegionFormation == REGION_NUM)
+        hqemu_error("invalid region formation strategy %s.\n",
+                    RegionStrategy.c_str());
+
+    /* Region re-formation only applies to the trace modes. */
+    RegionReform = EnableRegionReform && isTraceMode() && ReformExitCount;
+
+    /* Trace trees and region re-formation rebuild a region from the blocks
+     * of the committed traces, so the trace information must be kept. */
+    KeepTraceInfo = RegionReform || RegionFormation == REGION_TRACETREE;
+
+    /* The loop profile for the annotation dump is read from the execution
+     * counters of the committed traces. The annotations are only read back
+     * in user mode, where the guest addresses of the loops are stable. */
+#if defined(CONFIG_USER_ONLY)
+    ProfileLoop = !AnnotateDump.empty() && isTraceMode();
+#else
+    ProfileLoop = false;
+    if (!AnnotateDump.empty())
+        dbg() << DEBUG_LLVM << "-annotate-dump is not supported in system mode.\n";
+#endif
+    KeepTraceInfo |= ProfileLoop;
+
+    /* Hot helper calls are inlined by rebuilding the trace from its blocks. */
+    ProfileHelper = EnableProfileHelper && isTraceMode() && HotHelperThreshold;
+    HotHelperCount = HotHelperThreshold;
+    ColdHelperLimit = ColdHelperRounds;
+    KeepTraceInfo |= ProfileHelper;
+
+    /* Indirect branch targets are inlined with the trace linking, which is
+     * only done for user-mode emulation. */
+#if defined(CONFIG_USER_ONLY)
+    IBInline = isTraceMode() ? (unsigned)IBInlineTargets : 0;
+#endif
+
     /*
      * After this point, command-line options are all set.
      * We need to update functions that are controlled by the options.
      */
 
-    /* Update threading number if hybridm is enabled. */
-    UseThreading = (TransMode == TRANS_MODE_HYBRIDM);
+    /* In the async block mode, the block code runs while the block is
+     * compiled by the translator threads. */
+    AsyncBlock = EnableAsyncBlock && TransMode == TRANS_MODE_BLOCK;
+
+    /* Update threading number if hybridm or async block is enabled. */
+    UseThreading = (TransMode == TRANS_MODE_HYBRIDM) || AsyncBlock;
     if (!UseThreading)
         return;
 
@@ -381,6 +577,7 @@ void *WorkerFunc(void *argv)
 
     Atomic<unsigned>::inc_return(&NumPendingThread);
 
+    unsigned IdleCount = 0;
     for (;;) {
         /* Exit the loop if a request is received. */
         if (unlikely(ThreadExit))
@@ -403,8 +600,17 @@ void *WorkerFunc(void *argv)
 
         /* Everything is fine. Process an optimization request. */
         OptimizationInfo *Opt = (OptimizationInfo *)QM->Dequeue();
-        if (Opt)
-            Translator->GenTrace(env, Opt);
+        if (Opt) {
+            if (Opt->isTrace())
+                Translator->GenTrace(env, Opt);
+            else
+                Translator->GenBlock(env, Opt);
+            IdleCount = 0;
+        } else if (++IdleCount == ADAPT_IDLE_INTERVAL) {
+            /* The translator has been idle for a while. */
+            LLVMEnv::AdaptThreshold();
+            IdleCount = 0;
+        }
 
         usleep(TIMEOUT_INTERVAL);
     }
@@ -549,19 +755,85 @@ TraceID LLVMEnv::insertTransCode(TranslatedCode *TC)
         ChainInfo &Chain = *ChainInfo::get(TB);
         Chain.insertDepTrace(TC->EntryTB->id);
     }
+
+    /* The index is rebuilt once per batch of traces. A lookup that misses
+     * the newest traces publishes the pending ones itself. */
+    if (++NumIndexPending >= CODE_INDEX_BATCH)
+        publishCodeIndex();
     return tid;
 }
 
+static void FreeCodeIndex(struct rcu_head *head)
+{
+    delete (CodeIndex *)head;
+}
+
+/* The traces removed by a code cache flush. They are freed after a grace
+ * period, since a lookup may still hold them from the old index. */
+struct RetiredCode {
+    struct rcu_head rcu;  /* Must be the first member */
+    LLVMEnv::TransCodeList TransCode;
+};
+
+static void FreeRetiredCode(struct rcu_head *head)
+{
+    RetiredCode *Retired = (RetiredCode *)head;
+    for (auto TC : Retired->TransCode)
+        delete TC;
+    delete Retired;
+}
+
+void LLVMEnv::publishCodeIndex()
+{
+    CodeIndex *Index = new CodeIndex;
+    Index->Entries.assign(SortedCode.begin(), SortedCode.end());
+
+    CodeIndex *Old = SortedIndex;
+    atomic_rcu_set(&SortedIndex, Index);
+    NumIndexPending = 0;
+    call_rcu1(&Old->rcu, FreeCodeIndex);
+}
+
+TranslatedCode *LLVMEnv::lookupCode(uintptr_t pc)
+{
+    TranslatedCode *TC = nullptr;
+
+    CodeIndex *Index = atomic_rcu_read(&SortedIndex);
+    auto &Entries = Index->Entries;
+    auto I = std::upper_bound(Entries.begin(), Entries.end(), pc,
+                 [](uintptr_t Addr, const std::pair<uintptr_t, TranslatedCode *> &E) {
+                     return Addr < E.first;
+                 });
+    if (I != Entries.begin()) {
+        TranslatedCode *Curr = (--I)->second;
+        if (pc < (uintptr_t)Curr->Code + Curr->Size)
+            TC = Curr;
+    }
+
+    /* TranslatedCode is freed a grace period after the code cache flush,
+     * so TC remains valid until the caller leaves the read-side critical
+     * section. */
+    return TC;
+}
+
 LLVMEnv::SlotInfo LLVMEnv::getChainSlot()
 {
     hqemu::MutexGuard locked(llvm_global_lock);
 
-    size_t Key = ChainPoint.size();
+    size_t Key = ChainPoint.allocate();
     uintptr_t RetVal = (Key << 2) | TB_EXIT_LLVM;
-    ChainPoint.push_back(0);
     return SlotInfo(Key, RetVal);
 }
 
+/* Allocate a return slot for the shadow return stack. Return slots are
+ * cleared but never freed at code cache flush, so a stale reference from the
+ * shadow stack only results in a misprediction. */
+uintptr_t *LLVMEnv::allocReturnSlot()
+{
+    hqemu::MutexGuard locked(llvm_global_lock);
+    return ReturnSlot.getAddr(ReturnSlot.allocate());
+}
+
 static bool OptimizeOrSkip()
 {
     static unsigned curr = 0;
@@ -580,6 +852,13 @@ int LLVMEnv::OptimizeBlock(CPUArchState *env, OptRequest Request)
     if (OptimizeOrSkip() == true)
         return 0;
 
+    /* Put the request into the request queue and continue with the block
+     * code. The block is patched to the optimized code when it is ready. */
+    if (AsyncBlock) {
+        QM->Enqueue(Request.release());
+        return 1;
+    }
+
     env->build_mode = BUILD_LLVM | BUILD_TCG;
     LLVMTranslator *Translator = LLEnv->AcquireSingleTranslator();
     Translator->GenBlock(env, Request.release());
@@ -598,8 +877,13 @@ int LLVMEnv::OptimizeTrace(CPUArchState *env, OptRequest Request)
     if (OptimizeOrSkip() == true)
         return 0;
 
+    static unsigned NumRequest = 0;
+    if (Atomic<unsigned>::inc_return(&NumRequest) % ADAPT_INTERVAL == 0)
+        AdaptThreshold();
+
     OptimizationInfo *Opt = Request.release();
-    Opt->ComposeCFG();
+    if (!Opt->getCFG())
+        Opt->ComposeCFG();
 
     if (TransMode == TRANS_MODE_HYBRIDS) {
         if (!TraceCacheFull) {
@@ -622,8 +906,88 @@ int LLVMEnv::OptimizeTrace(CPUArchState *env, OptRequest Request)
     return 1;
 }
 
+/*
+ * getProfileThreshold()
+ *  Return the profile threshold of a trace head. The threshold of a head
+ *  that produced aborted or short-lived traces is raised exponentially.
+ */
+unsigned LLVMEnv::getProfileThreshold(TranslationBlock *tb)
+{
+    unsigned Penalty = MIN(tb->penalty, ADAPT_MAX_PENALTY);
+    return atomic_read(&ProfileThreshold) << Penalty;
+}
+
+/*
+ * AdaptThreshold()
+ *  Adjust the NET profile threshold to the current workload phase. The
+ *  threshold rises when the request queue is saturated or the trace cache
+ *  is under pressure, and drops when the translators are idle. It is called
+ *  by both the vCPU and the translator threads, so the new threshold is only
+ *  published if no other thread has changed it in the meantime.
+ */
+void LLVMEnv::AdaptThreshold()
+{
+    if (!AdaptiveNET)
+        return;
+
+    unsigned Base = NETProfileThreshold;
+    unsigned MinThreshold = MAX(1U, Base >> ADAPT_MIN_SHIFT);
+    unsigned MaxThreshold = Base << ADAPT_MAX_SHIFT;
+    unsigned OldThreshold = atomic_read(&ProfileThreshold);
+    unsigned Threshold = OldThreshold;
+
+    size_t CodeSize = LLEnv->getMemoryManager()->getCodeSize();
+    bool CachePressure = CodeSize * 4 > TraceCacheSize * 3;
+    unsigned NumPending = QM->getNumPending();
+
+    if (CachePressure || NumPending >= ADAPT_QUEUE_HIGH)
+        Threshold = MIN(Threshold * 2, MaxThreshold);
+    else if (LLEnv->isThreading() && NumPending == 0)
+        Threshold = MAX(Threshold / 2, MinThreshold);
+    else if (Threshold > Base)
+        Threshold = MAX(Threshold / 2, Base);
+
+    if (Threshold == OldThreshold)
+        return;
+    if (!Atomic<unsigned>::testandset(&ProfileThreshold, OldThreshold, Threshold))
+        return;
+
+    dbg() << DEBUG_LLVM << __func__ << ": profile threshold " << OldThreshold
+          << " -> " << Threshold << " (pending=" << NumPending
+          << format(" cache=%.1f%%)\n", (double)CodeSize * 100 / TraceCacheSize);
+}
+
+/*
+ * ProfileEdge()
+ *  Count an edge between two blocks observed during trace prediction. Direct
+ *  branches are recorded in GlobalCFG, and the targets of a block without
+ *  direct successors in the value profile of its indirect branch.
+ */
+void LLVMEnv::ProfileEdge(TranslationBlock *Pred, TranslationBlock *Succ)
+{
+    if (Pred->jmp_pc[0] == Succ->pc || Pred->jmp_pc[1] == Succ->pc) {
+        if (!DisableNETPlus)
+            GlobalCFG.insertLink(Pred, Succ);
+        return;
+    }
+    if (IBInline && Pred->jmp_pc[0] == (target_ulong)-1)
+        TargetProfile::get(Pred)->insert(Succ);
+}
+
+/*
+ * PenalizeHead()
+ *  Record that the trace head produced an aborted or short-lived trace.
+ */
+void LLVMEnv::PenalizeHead(TranslationBlock *tb)
+{
+    if (!AdaptiveNET)
+        return;
+    if (tb->penalty < ADAPT_MAX_PENALTY)
+        Atomic<uint32_t>::inc_return(&tb->penalty);
+}
+
 #if defined(CONFIG_USER_ONLY)
-QueueManager::QueueManager()
+QueueManager::QueueManager() : NumPending(0)
 {
     CurrentQueue = new Queue;
 }
@@ -635,12 +999,22 @@ QueueManager::~QueueManager()
 
 void QueueManager::Enqueue(OptimizationInfo *Opt)
 {
+    Track(Opt);
     CurrentQueue->enqueue(Opt);
+    Atomic<unsigned>::inc_return(&NumPending);
 }
 
 void *QueueManager::Dequeue()
 {
-    return CurrentQueue->dequeue();
+    for (;;) {
+        OptimizationInfo *Opt = (OptimizationInfo *)CurrentQueue->dequeue();
+        if (!Opt)
+            return nullptr;
+        Atomic<unsigned>::dec_return(&NumPending);
+        if (!Opt->isCancelled())
+            return Opt;
+        delete Opt;
+    }
 }
 
 void QueueManager::Flush()
@@ -651,10 +1025,11 @@ void QueueManager::Flush()
             break;
         delete Opt;
     }
+    NumPending = 0;
 }
 
 #else
-QueueManager::QueueManager()
+QueueManager::QueueManager() : NumPending(0)
 {
     ActiveQueue.resize(ACTIVE_QUEUE_SIZE);
     for (unsigned i = 0, e = ActiveQueue.size(); i != e; ++i)
@@ -674,7 +1049,9 @@ void QueueManager::Enqueue(OptimizationInfo *Opt)
     Queue *CurrentQueue = ActiveQueue[pcid & ACTIVE_QUEUE_MASK];
     if (unlikely(!CurrentQueue))
         CurrentQueue = ActiveQueue[pcid & ACTIVE_QUEUE_MASK] = new Queue;
+    Track(Opt);
     CurrentQueue->enqueue(Opt);
+    Atomic<unsigned>::inc_return(&NumPending);
 }
 
 void *QueueManager::Dequeue()
@@ -682,7 +1059,15 @@ void *QueueManager::Dequeue()
     Queue *CurrentQueue = ActiveQueue[pcid & ACTIVE_QUEUE_MASK];
     if (unlikely(!CurrentQueue))
         return nullptr;
-    return CurrentQueue->dequeue();
+    for (;;) {
+        OptimizationInfo *Opt = (OptimizationInfo *)CurrentQueue->dequeue();
+        if (!Opt)
+            return nullptr;
+        Atomic<unsigned>::dec_return(&NumPending);
+        if (!Opt->isCancelled())
+            return Opt;
+        delete Opt;
+    }
 }
 
 void QueueManager::Flush()
@@ -698,16 +1083,67 @@ void QueueManager::Flush()
             delete Opt;
         }
     }
+    NumPending = 0;
 }
 #endif
 
+/* Index the request by its member blocks. */
+void QueueManager::Track(OptimizationInfo *Opt)
+{
+    hqemu::MutexGuard locked(Lock);
+    Opt->setTracked();
+    for (auto TB : Opt->getMembers())
+        Inflight[TB].push_back(Opt);
+}
+
+/* Stop tracking a request. Called when the request is destroyed. */
+void QueueManager::Retire(OptimizationInfo *Opt)
+{
+    hqemu::MutexGuard locked(Lock);
+    for (auto TB : Opt->getMembers()) {
+        auto I = Inflight.find(TB);
+        if (I == Inflight.end())
+            continue;
+        std::vector<OptimizationInfo *> &Requests = I->second;
+        auto J = std::find(Requests.begin(), Requests.end(), Opt);
+        if (J != Requests.end()) {
+            *J = Requests.back();
+            Requests.pop_back();
+        }
+        if (Requests.empty())
+            Inflight.erase(I);
+    }
+}
+
+/*
+ * Cancel()
+ *  Mark the queued and in-flight requests containing the invalidated `tb'.
+ *  Queued requests are dropped at dequeue and the translators poll the mark
+ *  between the compilation stages.
+ */
+void QueueManager::Cancel(TranslationBlock *tb)
+{
+    hqemu::MutexGuard locked(Lock);
+    auto I = Inflight.find(tb);
+    if (I == Inflight.end())
+        return;
+    for (auto Opt : I->second) {
+        if (!Opt->isCancelled()) {
+            dbg() << DEBUG_LLVM << __func__ << ": cancel request of block "
+                  << format("0x%" PRIx, tb->pc) << "\n";
+            Opt->Cancel();
+        }
+    }
+}
+
 
 /*
  * OptimizationInfo
  */
 
 OptimizationInfo::OptimizationInfo(TranslationBlock *HeadTB, TraceEdge &Edges)
-    : isUserTrace(true), isBlock(false), CFG(nullptr)
+    : isUserTrace(true), isBlock(false), CFG(nullptr),
+      Pool(OPT_ARENA_CHUNK_SIZE), Cancelled(false), Tracked(false)
 {
     for (auto &E : Edges)
         Trace.push_back(E.first);
@@ -717,25 +1153,79 @@ OptimizationInfo::OptimizationInfo(TranslationBlock *HeadTB, TraceEdge &Edges)
         ExpandTrace(HeadTB, Edges);
 #endif
 
-    /* Build CFG from the edges. */
-    std::map<TranslationBlock *, GraphNode *> NodeMap;
+    BuildCFG(HeadTB, Edges);
+}
 
-    NodeMap[HeadTB] = new GraphNode(HeadTB);
-    for (auto &E : Edges) {
-        TranslationBlock *Parent = E.first;
-        if (NodeMap.find(Parent) == NodeMap.end())
-            NodeMap[Parent] = new GraphNode(Parent);
+OptimizationInfo::~OptimizationInfo()
+{
+    if (Tracked)
+        QM->Retire(this);
+}
 
-        GraphNode *ParentNode = NodeMap[Parent];
-        for (auto Child : E.second) {
-            if (NodeMap.find(Child) == NodeMap.end())
-                NodeMap[Child] = new GraphNode(Child);
+/*
+ * BuildCFG()
+ *  Build the CFG of the request from the edges. The nodes and the arrays of
+ *  their children are allocated from the arena of the request.
+ */
+void OptimizationInfo::BuildCFG(TranslationBlock *HeadTB, TraceEdge &Edges)
+{
+    FlatMap<TranslationBlock *, GraphNode *> NodeMap;
+    auto getNode = [&](TranslationBlock *TB) {
+        GraphNode *&Node = NodeMap[TB];
+        if (!Node)
+            Node = Pool.create<GraphNode>(TB);
+        return Node;
+    };
 
-            ParentNode->insertChild(NodeMap[Child]);
+    CFG = getNode(HeadTB);
+    Members.insert(HeadTB);
+    for (auto &E : Edges) {
+        GraphNode *Parent = getNode(E.first);
+        Members.insert(E.first);
+        GraphNode **Children = (GraphNode **)Pool.allocate(
+                sizeof(GraphNode *) * E.second.size(), alignof(GraphNode *));
+        unsigned NumChildren = 0;
+        for (auto Child : E.second) {
+            Children[NumChildren++] = getNode(Child);
+            Members.insert(Child);
         }
+        Parent->setChildren(Children, NumChildren);
     }
+}
+
+/*
+ * getHotSuccessor()
+ *  Get the successors of tb from GlobalCFG whose edge count is not less than
+ *  NETPlusEdgeRatio percent of the hottest edge, the hottest one first.
+ */
+static void getHotSuccessor(TranslationBlock *tb,
+                            ControlFlowGraph::EdgeVec &Succs)
+{
+    GlobalCFG.getSuccessor(tb, Succs);
+    if (Succs.empty())
+        return;
 
-    CFG = NodeMap[HeadTB];
+    uint64_t Cutoff = (uint64_t)Succs[0].Count * NETPlusEdgeRatio;
+    while (!Succs.empty() && (uint64_t)Succs.back().Count * 100 < Cutoff)
+        Succs.pop_back();
+}
+
+/*
+ * getHotTarget()
+ *  Get the hot targets of the indirect branch ending tb from its value
+ *  profile, the hottest one first.
+ */
+static void getHotTarget(TranslationBlock *tb, TBVec &Targets)
+{
+    TargetProfile *Profile = TargetProfile::lookup(tb);
+    if (!Profile || !LLVMEnv::IBInline)
+        return;
+
+    Profile->getHotTargets(Targets, LLVMEnv::IBInline, IB_INLINE_RATIO);
+    Targets.erase(std::remove_if(Targets.begin(), Targets.end(),
+                                 [](TranslationBlock *TB) {
+                                     return TB->mode == BLOCK_INVALID;
+                                 }), Targets.end());
 }
 
 void OptimizationInfo::SearchCycle(TraceNode &SearchNodes, TraceNode &Nodes,
@@ -763,9 +1253,12 @@ void OptimizationInfo::SearchCycle(TraceNode &SearchNodes, TraceNode &Nodes,
     if (Depth == MAX_SEARCH_DEPTH)
         return;
 
-    /* Still cannot find a cyclic path? Keep looking for the successors. */
-    for (auto Succ : GlobalCFG.getSuccessor(Curr)) {
-        Visited.push_back(Succ);
+    /* Still cannot find a cyclic path? Keep looking for the successors,
+     * following the hot edges only. */
+    ControlFlowGraph::EdgeVec Succs;
+    getHotSuccessor(Curr, Succs);
+    for (auto &Succ : Succs) {
+        Visited.push_back(Succ.TB);
         SearchCycle(SearchNodes, Nodes, Edges, Visited, Depth + 1);
         Visited.pop_back();
     }
@@ -787,23 +1280,26 @@ void OptimizationInfo::ExpandTrace(TranslationBlock *HeadTB, TraceEdge &Edges)
     TraceNode Nodes;
     TraceNode MainTraceNodes;
     std::map<target_ulong, TranslationBlock*> NodeMap;
+    bool TreeOnly = (RegionFormation == REGION_TRACETREE);
 #ifdef USE_TRACETREE_ONLY
-    MainTraceNodes.insert(HeadTB);
-    NodeMap[HeadTB->pc] = HeadTB;
-#else
-    for (auto &E : Edges) {
-        TranslationBlock *TB = E.first;
-        MainTraceNodes.insert(TB);
-        NodeMap[TB->pc] = TB;
-    }
+    TreeOnly = true;
 #endif
 
+    /* Trace trees only complete the cycles back to the anchor. */
+    if (TreeOnly) {
+        MainTraceNodes.insert(HeadTB);
+        NodeMap[HeadTB->pc] = HeadTB;
+    } else {
+        for (auto &E : Edges) {
+            TranslationBlock *TB = E.first;
+            MainTraceNodes.insert(TB);
+            NodeMap[TB->pc] = TB;
+        }
+    }
+
     for (auto &E : Edges)
         Nodes.insert(E.first);
 
-    /* Put critical section when traversing GlobalCFG. */
-    hqemu::MutexGuard locked(GlobalCFG.getLock());
-
     for (auto TB : Trace) {
         TBVec Visited;
         Visited.push_back(TB);
@@ -813,8 +1309,10 @@ void OptimizationInfo::ExpandTrace(TranslationBlock *HeadTB, TraceEdge &Edges)
             NodeMap.find(TB->jmp_pc[1]) != NodeMap.end())
             Edges[TB].insert(NodeMap[TB->jmp_pc[1]]);
 
-        for (auto Succ : GlobalCFG.getSuccessor(TB)) {
-            Visited.push_back(Succ);
+        ControlFlowGraph::EdgeVec Succs;
+        getHotSuccessor(TB, Succs);
+        for (auto &Succ : Succs) {
+            Visited.push_back(Succ.TB);
             SearchCycle(MainTraceNodes, Nodes, Edges, Visited, 0);
             Visited.pop_back();
         }
@@ -880,26 +1378,239 @@ void OptimizationInfo::ComposeCFG()
         ExpandTrace(HeadTB, Edges);
 #endif
 
-    /* Build CFG from the edges. */
-    std::map<TranslationBlock *, GraphNode *> NodeMap;
+    BuildCFG(HeadTB, Edges);
+    isUserTrace = isUser;
+}
 
-    NodeMap[HeadTB] = new GraphNode(HeadTB);
-    for (auto &E : Edges) {
-        TranslationBlock *Parent = E.first;
-        if (NodeMap.find(Parent) == NodeMap.end())
-            NodeMap[Parent] = new GraphNode(Parent);
+/*
+ * LinkRegion()
+ *  Link the blocks of a region with their direct successors and the hot
+ *  targets of their indirect branches in the region.
+ */
+static void LinkRegion(std::map<target_ulong, TranslationBlock *> &NodeMap,
+                       OptimizationInfo::TraceEdge &Edges)
+{
+    for (auto &N : NodeMap) {
+        TranslationBlock *TB = N.second;
+        Edges[TB];
+        for (int i = 0; i < 2; ++i) {
+            target_ulong pc = TB->jmp_pc[i];
+            if (pc != (target_ulong)-1 && NodeMap.find(pc) != NodeMap.end())
+                Edges[TB].insert(NodeMap[pc]);
+        }
 
-        GraphNode *ParentNode = NodeMap[Parent];
-        for (auto Child : E.second) {
-            if (NodeMap.find(Child) == NodeMap.end())
-                NodeMap[Child] = new GraphNode(Child);
+        TBVec Targets;
+        getHotTarget(TB, Targets);
+        for (auto Target : Targets) {
+            auto I = NodeMap.find(Target->pc);
+            if (I != NodeMap.end() && I->second == Target)
+                Edges[TB].insert(Target);
+        }
+    }
+}
 
-            ParentNode->insertChild(NodeMap[Child]);
+/*
+ * ExtendTrace()
+ *  Attach a list of blocks to the region that is headed by HeadTB and
+ *  submit the extended region for optimization. Return 0 if the region
+ *  cannot be extended.
+ */
+int LLVMEnv::ExtendTrace(CPUArchState *env, TranslationBlock *HeadTB,
+                         TBVec &TBs)
+{
+    std::map<target_ulong, TranslationBlock *> NodeMap;
+
+    {
+        hqemu::MutexGuard locked(llvm_global_lock);
+        if (HeadTB->mode != BLOCK_OPTIMIZED || HeadTB->tid == -1)
+            return 0;
+
+        TranslatedCode *TC = LLEnv->getTransCode()[HeadTB->tid];
+        if (!TC->Active || !TC->Trace)
+            return 0;
+        if (TC->Trace->getNumBlock() + TBs.size() > ReformMaxBlocks)
+            return 0;
+
+        for (auto TB : TC->Trace->TBs)
+            NodeMap[TB->pc] = TB;
+    }
+
+    for (auto TB : TBs) {
+        if (TB->mode == BLOCK_INVALID)
+            return 0;
+#if defined(CONFIG_SOFTMMU)
+        if (TB->cs_base != HeadTB->cs_base || isUserTB(TB) != isUserTB(HeadTB))
+            return 0;
+#endif
+        NodeMap[TB->pc] = TB;
+    }
+
+    OptimizationInfo::TraceEdge Edges;
+    LinkRegion(NodeMap, Edges);
+
+    auto Request = OptimizationInfo::CreateRequest(HeadTB, Edges);
+    return OptimizeTrace(env, std::move(Request));
+}
+
+/* Link the blocks of a region headed by HeadTB and submit it for
+ * optimization. */
+static void SubmitRegion(CPUArchState *env, TranslationBlock *HeadTB,
+                         std::map<target_ulong, TranslationBlock *> &NodeMap)
+{
+    OptimizationInfo::TraceEdge Edges;
+    LinkRegion(NodeMap, Edges);
+
+    auto Request = OptimizationInfo::CreateRequest(HeadTB, Edges);
+    LLVMEnv::OptimizeTrace(env, std::move(Request));
+}
+
+/*
+ * ReformTrace()
+ *  Combine a trace with its successor traces found in the global CFG and
+ *  submit the larger region for optimization. The blocks of the region are
+ *  linked with their recorded direct successors and the region is further
+ *  expanded with NETPlus. The old trace is retired when the new region is
+ *  committed.
+ */
+static void ReformTrace(CPUArchState *env, TraceInfo *Trace)
+{
+    TranslationBlock *HeadTB = Trace->getEntryTB();
+    std::map<target_ulong, TranslationBlock *> NodeMap;
+    TBVec Succs;
+
+    if (HeadTB->mode != BLOCK_OPTIMIZED)
+        return;
+
+    for (auto TB : Trace->TBs) {
+        if (TB->mode == BLOCK_INVALID)
+            return;
+        NodeMap[TB->pc] = TB;
+    }
+
+    /* Find the trace heads that are reached by leaving this trace, through
+     * either a direct branch or a hot target of an indirect branch. */
+    for (auto TB : Trace->TBs) {
+        ControlFlowGraph::EdgeVec Edges;
+        getHotSuccessor(TB, Edges);
+        for (auto &E : Edges) {
+            if (NodeMap.find(E.TB->pc) == NodeMap.end() &&
+                E.TB->mode == BLOCK_OPTIMIZED)
+                Succs.push_back(E.TB);
+        }
+
+        TBVec Targets;
+        getHotTarget(TB, Targets);
+        for (auto Target : Targets) {
+            if (NodeMap.find(Target->pc) == NodeMap.end() &&
+                Target->mode == BLOCK_OPTIMIZED)
+                Succs.push_back(Target);
         }
     }
 
-    CFG = NodeMap[HeadTB];
-    isUserTrace = isUser;
+    /* Merge the blocks of the successor traces. */
+    {
+        LLVMEnv::TransCodeList &TransCode = LLEnv->getTransCode();
+        hqemu::MutexGuard locked(llvm_global_lock);
+
+        for (auto Succ : Succs) {
+            if (Succ->tid == -1 || NodeMap.find(Succ->pc) != NodeMap.end())
+                continue;
+
+            TranslatedCode *TC = TransCode[Succ->tid];
+            if (!TC->Active || !TC->Trace)
+                continue;
+            TBVec &TBs = TC->Trace->TBs;
+            if (NodeMap.size() + TBs.size() > ReformMaxBlocks)
+                continue;
+
+#if defined(CONFIG_SOFTMMU)
+            /* Keep the same constraints as ComposeCFG. */
+            if (Succ->cs_base != HeadTB->cs_base ||
+                isUserTB(Succ) != isUserTB(HeadTB))
+                continue;
+#endif
+            bool Valid = true;
+            for (auto TB : TBs) {
+                if (TB->mode == BLOCK_INVALID) {
+                    Valid = false;
+                    break;
+                }
+            }
+            if (!Valid)
+                continue;
+
+            for (auto TB : TBs)
+                NodeMap[TB->pc] = TB;
+        }
+    }
+
+    if (NodeMap.size() == Trace->TBs.size())
+        return;
+
+    dbg() << DEBUG_LLVM << __func__ << ": re-form trace "
+          << format("0x%" PRIx, HeadTB->pc) << " from "
+          << Trace->TBs.size() << " to " << NodeMap.size() << " blocks.\n";
+
+    SubmitRegion(env, HeadTB, NodeMap);
+}
+
+/*
+ * RebuildTrace()
+ *  Submit a trace for optimization again from its own blocks, so that the
+ *  profile collected since its translation is applied.
+ */
+static void RebuildTrace(CPUArchState *env, TraceInfo *Trace)
+{
+    TranslationBlock *HeadTB = Trace->getEntryTB();
+    std::map<target_ulong, TranslationBlock *> NodeMap;
+
+    if (HeadTB->mode != BLOCK_OPTIMIZED)
+        return;
+
+    for (auto TB : Trace->TBs) {
+        if (TB->mode == BLOCK_INVALID)
+            return;
+        NodeMap[TB->pc] = TB;
+    }
+
+    dbg() << DEBUG_LLVM << __func__ << ": rebuild trace "
+          << format("0x%" PRIx, HeadTB->pc) << "\n";
+
+    /* The rebuilt trace does not profile its helper calls again. */
+    LLEnv->getHelperProfile().setRebuilt(HeadTB->pc);
+    SubmitRegion(env, HeadTB, NodeMap);
+}
+
+/* Kinds of the trace requests raised in the code cache. */
+enum {
+    REQUEST_REFORM = 0,
+    REQUEST_REBUILD,
+};
+
+/*
+ * DeferRequest()
+ *  Record a request on a trace raised by a helper called from the code cache.
+ *  In the hybrids mode, the vCPU compiles the region itself, which must not
+ *  run under its caller in the code cache: the running trace may be replaced
+ *  or flushed, and the vCPU would stall in the middle of the trace. The
+ *  request is handled by llvm_handle_request instead, once the vCPU leaves
+ *  the code cache at the next exit request check. In the hybridm mode, the
+ *  region is only queued to the translator threads, so it is done at once.
+ */
+static void DeferRequest(CPUArchState *env, TraceInfo *Trace, int Kind)
+{
+    if (LLVMEnv::TransMode != TRANS_MODE_HYBRIDS) {
+        if (Kind == REQUEST_REFORM)
+            ReformTrace(env, Trace);
+        else if (Kind == REQUEST_REBUILD)
+            RebuildTrace(env, Trace);
+        return;
+    }
+
+    CPUState *cpu = ENV_GET_CPU(env);
+    TraceRequest Request = { Trace, Kind, LLEnv->getNumFlush() };
+    cpu_get_tracer(env)->Requests.push_back(Request);
+    cpu->tcg_exit_req = 1;
 }
 
 
@@ -977,26 +1688,34 @@ int llvm_tb_flush(void)
 
     LLEnv->DeleteTranslator();
 
+    /* The side data of blocks are allocated from TBArena and released in
+     * bulk. Only the chaining info owns memory of its own. */
     for (int i = 0, e = tcg_ctx_global.tb_ctx->nb_tbs; i != e; ++i) {
-        if (tbs[i].image) delete_image(&tbs[i]);
-        if (tbs[i].state) delete_state(&tbs[i]);
         if (tbs[i].chain) ChainInfo::free(&tbs[i]);
-
-        tbs[i].image = tbs[i].state = tbs[i].chain = nullptr;
+        tbs[i].image = tbs[i].state = tbs[i].target = nullptr;
     }
+    TBArena.reset();
 
-    /* Remove all translated code. */
+    /* Remove all translated code. The empty index is published first, and
+     * the traces are freed after the readers of the old index are done. */
     LLVMEnv::TransCodeList &TransCode = LLEnv->getTransCode();
-    for (unsigned i = 0, e = TransCode.size(); i != e; ++i)
-        delete TransCode[i];
+    if (LLVMEnv::ProfileLoop)
+        CollectLoopProfile(TransCode);
 
-    TransCode.clear();
+    RetiredCode *Retired = new RetiredCode;
+    Retired->TransCode.swap(TransCode);
     LLEnv->getSortedCode().clear();
+    LLEnv->publishCodeIndex();
+    call_rcu1(&Retired->rcu, FreeRetiredCode);
     LLEnv->getChainPoint().clear();
+    LLEnv->getReturnSlot().clear();
 
     /* Clear global cfg. */
     GlobalCFG.reset();
 
+    /* The trace tree anchors refer to the flushed blocks. */
+    TraceTreeTracer::ResetAnchors();
+
     LLEnv->RestartTranslator();
     LLEnv->incNumFlush();
 
@@ -1024,6 +1743,25 @@ static void llvm_suppress_chaining(TranslationBlock *tb)
     Chains.clear();
 }
 
+/*
+ * retireTransCode()
+ *  Deactivate the trace attached to the entry block before a re-formed region
+ *  takes its place. The code of the old trace is kept in the code cache
+ *  until the next flush since other threads may still be running it.
+ */
+void LLVMEnv::retireTransCode(TranslationBlock *EntryTB)
+{
+    TranslatedCode *TC = TransCode[EntryTB->tid];
+    TC->Active = false;
+
+    /* Traces that directly jump to the old trace are relinked through the
+     * dispatcher. */
+#if defined(CONFIG_USER_ONLY)
+    llvm_suppress_chaining(EntryTB);
+#endif
+    EntryTB->tid = -1;
+}
+
 /*
  * llvm_tb_remove()
  *  Remove the traces containing the `tb' that is invalidated by QEMU.
@@ -1032,6 +1770,10 @@ int llvm_tb_remove(TranslationBlock *tb)
 {
     if (LLVMEnv::TransMode == TRANS_MODE_NONE)
         return 1;
+
+    /* Stop compiling the requests that contain this tb. */
+    QM->Cancel(tb);
+
     if (!tb->chain)
         return 1;
 
@@ -1045,7 +1787,6 @@ int llvm_tb_remove(TranslationBlock *tb)
     }
 
     LLVMEnv::TransCodeList &TransCode = LLEnv->getTransCode();
-    LLVMEnv::TransCodeMap &SortedCode = LLEnv->getSortedCode();
     std::vector<BlockID> &DepTraces = ChainInfo::get(tb)->DepTraces;
 
     hqemu::MutexGuard locked(llvm_global_lock);
@@ -1068,10 +1809,15 @@ int llvm_tb_remove(TranslationBlock *tb)
         if (!TC->Active)
             hqemu_error("fatal error.\n");
 
+        /* The trace stays in SortedCode until the next flush, since other
+         * vCPUs may still be running it and fault in it. */
         TC->Active = false;
-        SortedCode.erase((uintptr_t)TC->Code);
         patch_jmp(tb_get_jmp_entry(EntryTB), tb_get_jmp_next(EntryTB));
 
+        /* Penalize the head if its trace is invalidated soon. */
+        if (getTimestamp() - TC->CommitTime < SHORT_LIVED_TIME)
+            LLVMEnv::PenalizeHead(EntryTB);
+
         /* For system-mode emulation, since the source traces do not directly
          * jump to the trace code, we do not need to suppress the traces
          * chaining to the trace head block. Unlinking the jump from the
@@ -1103,11 +1849,11 @@ static uintptr_t llvm_resolve_address(uintptr_t addr)
     if (LLVMEnv::InitOnce == false)
         return 0;
 
-    hqemu::MutexGuard locked(llvm_global_lock);
-
+    /* The slot is published before the trace is linked, so it can be
+     * read without locking. */
     LLVMEnv::ChainSlot &ChainPoint = LLEnv->getChainPoint();
     size_t Key = addr >> 2;
-    return ChainPoint[Key];
+    return ChainPoint.get(Key);
 }
 
 #if defined(CONFIG_USER_ONLY)
@@ -1157,10 +1903,22 @@ TranslationBlock *llvm_find_pc(CPUState *cpu, uintptr_t searched_pc)
     if (!llvm_locate_trace(searched_pc))
         return nullptr;
 
-    hqemu::MutexGuard locked(llvm_global_lock);
-
-    LLVMEnv::TransCodeMap::iterator I = SortedCode.upper_bound(searched_pc);
-    TranslatedCode *TC = (--I)->second;
+    /* Fast path: search the published index without locking. The read-side
+     * critical section keeps TC alive against a concurrent flush. */
+    rcu_read_lock();
+    TranslatedCode *TC = LLEnv->lookupCode(searched_pc);
+    if (!TC) {
+        /* The trace is not published yet. Search the map under the lock,
+         * and publish the pending traces for the following lookups. */
+        hqemu::MutexGuard locked(llvm_global_lock);
+
+        if (LLEnv->getNumIndexPending())
+            LLEnv->publishCodeIndex();
+        LLVMEnv::TransCodeMap::iterator I = SortedCode.upper_bound(searched_pc);
+        if (I == SortedCode.begin())
+            hqemu_error("cannot find trace at 0x%zx\n", searched_pc);
+        TC = (--I)->second;
+    }
 
     if (env->restore_val >= TC->Restore.size()) {
         auto HostDisAsm = LLEnv->getTranslator(0)->getHostDisAsm();
@@ -1172,6 +1930,8 @@ TranslationBlock *llvm_find_pc(CPUState *cpu, uintptr_t searched_pc)
     /* Since restore_val is no longer used, we set it to the
      * the opc index so the later restore can quickly get it. */
     std::pair<BlockID, uint16_t> RestoreInfo = TC->Restore[env->restore_val];
+    rcu_read_unlock();
+
     env->restore_val = RestoreInfo.second - 1;
     return &tbs[RestoreInfo.first];
 }
@@ -1242,6 +2002,132 @@ void llvm_fork_end(int child)
     }
 }
 
+/*
+ * helper_region_exit()
+ *  Called when the execution leaves a trace through one of its exits. If the
+ *  side exits of the trace dominate its loop iterations, the trace is
+ *  re-formed with its successor traces.
+ */
+void helper_region_exit(CPUArchState *env, void *trace_p)
+{
+    TraceInfo *Trace = (TraceInfo *)trace_p;
+    int Idx = ENV_GET_CPU(env)->cpu_index;
+
+    if (!Trace || Trace->Reform || Idx < 0 || Idx >= MAX_SPM_THREADS)
+        return;
+
+    uint64_t *Counter = Trace->ExecCount[Idx];
+    uint64_t NumExit = Counter[TraceInfo::IDX_EXIT] +
+                       Counter[TraceInfo::IDX_INBR];
+    if (NumExit % ReformExitCount)
+        return;
+
+    uint64_t NumExec = NumExit + Counter[TraceInfo::IDX_LOOP];
+    if (NumExit * 100 < NumExec * ReformExitRatio)
+        return;
+
+    if (!Atomic<int>::testandset(&Trace->Reform, 0, 1))
+        return;
+
+    DeferRequest(env, Trace, REQUEST_REFORM);
+}
+
+/*
+ * llvm_handle_request()
+ *  Called by the dispatcher before it enters the code cache. Handle the trace
+ *  requests raised by this vCPU in the code cache. A request raised before the
+ *  last code cache flush is dropped since its trace has been deleted.
+ */
+void llvm_handle_request(CPUArchState *env)
+{
+    std::vector<TraceRequest> &Requests = cpu_get_tracer(env)->Requests;
+    if (likely(Requests.empty()))
+        return;
+
+    std::vector<TraceRequest> Pending;
+    Pending.swap(Requests);
+    for (auto &R : Pending) {
+        if (R.Epoch != LLEnv->getNumFlush())
+            continue;
+        if (R.Kind == REQUEST_REFORM)
+            ReformTrace(env, R.Trace);
+        else if (R.Kind == REQUEST_REBUILD)
+            RebuildTrace(env, R.Trace);
+    }
+}
+
+/*
+ * helper_profile_helper()
+ *  Called after a helper call of a trace that is not inlined. Once the call
+ *  gets hot, the trace is rebuilt so that the helper is inlined. Like the
+ *  re-formation, the rebuilding is deferred out of the code cache.
+ */
+void helper_profile_helper(CPUArchState *env, void *counter_p, void *trace_p)
+{
+    uint64_t *Counter = (uint64_t *)counter_p;
+    TraceInfo *Trace = (TraceInfo *)trace_p;
+
+    if (!Trace || ++*Counter < LLVMEnv::HotHelperCount || Trace->Rebuild)
+        return;
+
+    if (!Atomic<int>::testandset(&Trace->Rebuild, 0, 1))
+        return;
+
+    DeferRequest(env, Trace, REQUEST_REBUILD);
+}
+
+/*
+ * helper_check_guest_range()
+ *  Called before a chunk of a vectorized guest loop runs. The chunk accesses
+ *  the guest memory without volatile, so a fault would not be raised at the
+ *  precise guest instruction and a concurrent access of another vCPU would
+ *  not be seen. Return 1 if all pages of [addr, addr + len) can be accessed
+ *  and no other vCPU runs; the chunk runs the original loop otherwise.
+ */
+uint32_t helper_check_guest_range(CPUArchState *env, uint64_t addr,
+                                  uint64_t len, uint32_t is_write)
+{
+#if defined(CONFIG_USER_ONLY)
+    uint64_t end = addr + len - 1;
+    int flags = PAGE_VALID | PAGE_READ | (is_write ? PAGE_WRITE : 0);
+
+    if (CPU_NEXT(first_cpu) || len == 0 || end < addr ||
+        end > (uint64_t)(target_ulong)-1)
+        return 0;
+
+    for (uint64_t page = addr & TARGET_PAGE_MASK; page <= end;
+         page += TARGET_PAGE_SIZE) {
+        if ((page_get_flags(page) & flags) != flags)
+            return 0;
+        if (page + TARGET_PAGE_SIZE < page)
+            break;
+    }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * helper_profile_target()
+ *  Called when the execution leaves a trace through an indirect branch whose
+ *  target is not inlined. The target block is recorded in the value profile of
+ *  the block tb_p ending with the indirect branch. Targets that are not cached
+ *  in the IBTC yet are skipped; they are cached by the following lookup.
+ */
+void helper_profile_target(CPUArchState *env, void *tb_p)
+{
+#if defined(ENABLE_IBTC)
+    TranslationBlock *tb = (TranslationBlock *)tb_p;
+    if (!tb)
+        return;
+
+    TranslationBlock *next_tb = cpu_get_ibtc(env).get(cpu_get_pc(env));
+    if (next_tb)
+        TargetProfile::get(tb)->insert(next_tb);
+#endif
+}
+
 int llvm_has_annotation(target_ulong addr, int annotation)
 {
     if (annotation == ANNOTATION_LOOP)
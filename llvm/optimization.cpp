@@ -50,11 +50,23 @@ int itlb_lookup(CPUArchState *env, target_ulong pc, uint64_t paddr)
  */
 #if defined(ENABLE_IBTC)
 
+/* Record tb in the return slot requested by a shadow return stack probe. */
+static inline void shadow_fill_slot(CPUArchState *env, TranslationBlock *tb)
+{
+    if (env->shadow_fill) {
+        if (env->shadow_fill_pc == tb->pc)
+            *(TranslationBlock **)env->shadow_fill = tb;
+        env->shadow_fill = nullptr;
+    }
+}
+
 /* Update IBTC hash table.
  * Note: we do not cache TBs that cross page boundary. */
 void ibtc_update_entry(CPUArchState *env, TranslationBlock *tb)
 {
     IBTC &ibtc = cpu_get_ibtc(env);
+
+    shadow_fill_slot(env, tb);
     if (!ibtc.needUpdate())
         return;
 
@@ -86,19 +98,20 @@ void *helper_lookup_ibtc(CPUArchState *env)
     IBTC &ibtc = cpu_get_ibtc(env);
     TranslationBlock *next_tb = ibtc.get(pc);
 
-    PROFILE( ibtc.incTotal() );
+    ibtc.incTotal();
 
     if (likely(next_tb)) {
 #if defined(CONFIG_SOFTMMU)
         if (likely(itlb_lookup(env, pc, next_tb->page_addr[0])))
 #endif
         if (likely(cpu_check_state(env, next_tb->cs_base, next_tb->flags))) {
+            shadow_fill_slot(env, next_tb);
             cpu->current_tb = next_tb;
             return next_tb->opt_ptr;
         }
     }
 
-    PROFILE( ibtc.incMiss() );
+    ibtc.incMiss();
 
     ibtc.setUpdate();
     return ibtc_ret_addr;
@@ -196,12 +209,26 @@ int lpt_flush_page(CPUArchState *env, target_ulong addr, target_ulong *addrp,
                    target_ulong *sizep)
 {
     LargePageTable &lpt = cpu_get_lpt(env);
-    PROFILE( lpt.incTotal() );
+    lpt.incTotal();
     if (lpt.search(addr, LargePageTable::FLUSH, addrp, sizep))
         return 1;
-    PROFILE( lpt.incMiss() );
+    lpt.incMiss();
     return 0;
 }
+
+/* Get the number of flush checks, the number of false alerts among them and
+ * the number of tracked large pages. */
+int lpt_get_stats(CPUArchState *env, uint64_t *total, uint64_t *miss,
+                  unsigned *num_pages)
+{
+    if (env->opt_link == nullptr)
+        return 0;
+    LargePageTable &lpt = cpu_get_lpt(env);
+    *total = lpt.getTotal();
+    *miss = lpt.getMiss();
+    *num_pages = lpt.getNumPage();
+    return 1;
+}
 #else
 int lpt_reset(CPUArchState *env) { return 0; }
 int lpt_add_page(CPUArchState *env, target_ulong addr, target_ulong size) { return 0; }
@@ -209,6 +236,8 @@ int lpt_search_page(CPUArchState *env, target_ulong addr,
                     target_ulong *addrp, target_ulong *sizep) { return 0; }
 int lpt_flush_page(CPUArchState *env, target_ulong addr,
                    target_ulong *addrp, target_ulong *sizep) { return 0; }
+int lpt_get_stats(CPUArchState *env, uint64_t *total, uint64_t *miss,
+                  unsigned *num_pages) { return 0; }
 #endif
 
 /* Initialize the optimization schemes. */
@@ -237,6 +266,8 @@ int optimization_init(CPUArchState *env)
 
     /* Make an uplink to the optimizaiton facility object. */
     env->opt_link = Opt;
+    Opt->ibtc.bind(env);
+    shadow_stack_reset(env);
     return 1;
 }
 
@@ -268,7 +299,8 @@ int optimization_reset(CPUArchState *env, int force_flush)
 
     itlb.reset();
     if (force_flush)
-        ibtc.reset();
+        ibtc.flush();
+    shadow_stack_reset(env);
 
     tracer_reset(env);
     return 1;
@@ -300,12 +332,17 @@ int optimization_init_tb(TranslationBlock *tb, int id)
     tb->mode = BLOCK_NONE;
     tb->opt_ptr = nullptr;
     tb->exec_count = 0;
+    tb->hot_threshold = 0;
+    tb->penalty = 0;
     tb->patch_jmp = 0;
     tb->patch_next = 0;
     tb->jmp_pc[0] = tb->jmp_pc[1] = (target_ulong)-1;
+    tb->ret_pc = (target_ulong)-1;
+    tb->branch_kind = BRANCH_NONE;
     tb->image = nullptr;
     tb->state = nullptr;
     tb->chain = nullptr;
+    tb->target = nullptr;
     return 1;
 }
 
@@ -0,0 +1,191 @@
+/*
+ *  (C) 2016 by Computer System Laboratory, IIS, Academia Sinica, Taiwan.
+ *      See COPYRIGHT in top-level directory.
+ */
+
+#include "llvm-debug.h"
+#include "llvm-opc.h"
+#include "llvm-target.h"
+#include "llvm-pass.h"
+#include "utils.h"
+
+#define PASS_NAME "CombineVectorOps"
+
+/*
+ * CombineVectorOps Pass
+ *  The vector TCG ops are 128-bit wide. A guest SIMD instruction which works
+ *  on a pair of adjacent 128-bit registers is translated to two identical
+ *  ops whose CPU state operands are 16 bytes apart, e.g.
+ *      %a0 = load <4 x float> CPU+A       %a1 = load <4 x float> CPU+A+16
+ *      %b0 = load <4 x float> CPU+B       %b1 = load <4 x float> CPU+B+16
+ *      %c0 = fadd %a0, %b0                %c1 = fadd %a1, %b1
+ *      store %c0, CPU+C                   store %c1, CPU+C+16
+ *  On an AVX2 host, this pass combines the pair into one 256-bit operation.
+ */
+class CombineVectorOps : public FunctionPass {
+    struct VectorOp {
+        BinaryOperator *BO;
+        LoadInst *LI[2];
+        StoreInst *SI;
+        intptr_t Off[3];    /* Offsets of LI[0], LI[1] and SI */
+    };
+
+    IRFactory *IF;
+    const DataLayout *DL;
+    Value *CPU;
+
+    bool getVectorOp(StoreInst *SI, VectorOp &Op);
+    bool isCombinable(VectorOp &Op1, VectorOp &Op2);
+    void Combine(VectorOp &Op1, VectorOp &Op2, IVec &toErase);
+
+public:
+    static char ID;
+    explicit CombineVectorOps() : FunctionPass(ID) {}
+    explicit CombineVectorOps(IRFactory *IF)
+        : FunctionPass(ID), IF(IF), DL(IF->getDL()) {}
+    bool runOnFunction(Function &F);
+};
+
+char CombineVectorOps::ID = 0;
+INITIALIZE_PASS(CombineVectorOps, "combinevec",
+        "Combine adjacent 128-bit vector ops to 256-bit ops", false, false)
+
+FunctionPass *llvm::createCombineVectorOps(IRFactory *IF)
+{
+    return new CombineVectorOps(IF);
+}
+
+/* Match a 128-bit vector binary op whose operands are loaded from and result
+ * is stored to the CPU state at constant offsets. */
+bool CombineVectorOps::getVectorOp(StoreInst *SI, VectorOp &Op)
+{
+    Type *Ty = SI->getValueOperand()->getType();
+    if (SI->isVolatile() || !Ty->isVectorTy() ||
+        DL->getTypeSizeInBits(Ty) != 128)
+        return false;
+
+    BinaryOperator *BO = dyn_cast<BinaryOperator>(SI->getValueOperand());
+    if (!BO || !BO->hasOneUse() || BO->getParent() != SI->getParent())
+        return false;
+
+    Op.BO = BO;
+    Op.SI = SI;
+    for (unsigned i = 0; i < 2; ++i) {
+        LoadInst *LI = dyn_cast<LoadInst>(BO->getOperand(i));
+        if (!LI || LI->isVolatile() || !LI->hasOneUse() ||
+            LI->getParent() != SI->getParent())
+            return false;
+        if (getBaseWithConstantOffset(DL, LI->getPointerOperand(), Op.Off[i]) != CPU)
+            return false;
+        Op.LI[i] = LI;
+    }
+    return getBaseWithConstantOffset(DL, SI->getPointerOperand(), Op.Off[2]) == CPU;
+}
+
+/* Return true if Op2 is the upper half of Op1, and no other memory access or
+ * call is in between. The store of Op1 must not feed the loads of Op2. */
+bool CombineVectorOps::isCombinable(VectorOp &Op1, VectorOp &Op2)
+{
+    if (Op1.BO->getOpcode() != Op2.BO->getOpcode() ||
+        Op1.BO->getType() != Op2.BO->getType())
+        return false;
+    for (unsigned i = 0; i < 3; ++i) {
+        if (Op2.Off[i] != Op1.Off[i] + 16)
+            return false;
+    }
+    for (unsigned i = 0; i < 2; ++i) {
+        if (Op1.Off[2] < Op2.Off[i] + 16 && Op2.Off[i] < Op1.Off[2] + 16)
+            return false;
+    }
+
+    /* Walk from the first load of both ops to the store of Op2. */
+    std::set<Instruction *> Members = { Op1.LI[0], Op1.LI[1], Op1.SI,
+                                        Op2.LI[0], Op2.LI[1] };
+    bool Started = false;
+    for (auto &I : *Op2.SI->getParent()) {
+        if (&I == Op2.SI)
+            return Started;
+        if (isa<LoadInst>(&I) && Members.count(&I))
+            Started = true;
+        if (!Started || Members.count(&I))
+            continue;
+        if (I.mayReadOrWriteMemory() || isa<CallInst>(&I))
+            return false;
+    }
+    return false;
+}
+
+void CombineVectorOps::Combine(VectorOp &Op1, VectorOp &Op2, IVec &toErase)
+{
+    VectorType *Ty = cast<VectorType>(Op1.BO->getType());
+    VectorType *WideTy = VectorType::get(Ty->getElementType(),
+                                         Ty->getNumElements() * 2);
+    PointerType *PtrTy = PointerType::getUnqual(WideTy);
+    Instruction *InsertPos = Op2.SI;
+
+    Value *In[2];
+    for (unsigned i = 0; i < 2; ++i) {
+        Value *Ptr = new BitCastInst(Op1.LI[i]->getPointerOperand(), PtrTy,
+                                     "", InsertPos);
+        LoadInst *LI = new LoadInst(Ptr, "", false, InsertPos);
+        LI->setAlignment(16);
+        In[i] = LI;
+    }
+    Value *V = BinaryOperator::Create(Op1.BO->getOpcode(), In[0], In[1], "",
+                                      InsertPos);
+    cast<BinaryOperator>(V)->copyIRFlags(Op1.BO);
+
+    Value *Ptr = new BitCastInst(Op1.SI->getPointerOperand(), PtrTy, "",
+                                 InsertPos);
+    StoreInst *SI = new StoreInst(V, Ptr, false, InsertPos);
+    SI->setAlignment(16);
+
+    toErase.push_back(Op1.SI);
+    toErase.push_back(Op2.SI);
+}
+
+bool CombineVectorOps::runOnFunction(Function &F)
+{
+    if (!hasHostFeature("avx2"))
+        return false;
+
+    CPU = IF->getDefaultCPU(F);
+    if (!CPU)
+        return false;
+
+    bool Changed = false;
+    IVec toErase;
+
+    for (auto &BB : F) {
+        VectorOp Prev;
+        bool HasPrev = false;
+        for (auto &I : BB) {
+            StoreInst *SI = dyn_cast<StoreInst>(&I);
+            if (!SI)
+                continue;
+
+            VectorOp Curr;
+            if (!getVectorOp(SI, Curr)) {
+                HasPrev = false;
+                continue;
+            }
+            if (HasPrev && isCombinable(Prev, Curr)) {
+                Combine(Prev, Curr, toErase);
+                HasPrev = false;
+                Changed = true;
+                continue;
+            }
+            Prev = Curr;
+            HasPrev = true;
+        }
+    }
+
+    if (toErase.size())
+        ProcessErase(toErase);
+
+    return Changed;
+}
+
+/*
+ * vim: ts=8 sts=4 sw=4 expandtab
+ */
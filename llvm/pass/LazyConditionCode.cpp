@@ -0,0 +1,188 @@
+/*
+ *  (C) 2016 by Computer System Laboratory, IIS, Academia Sinica, Taiwan.
+ *      See COPYRIGHT in top-level directory.
+ */
+
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm-debug.h"
+#include "llvm-opc.h"
+#include "llvm-target.h"
+#include "llvm-pass.h"
+#include "utils.h"
+
+#define PASS_NAME "LazyConditionCode"
+
+/*
+ * LazyConditionCode Pass
+ *  The guest condition codes (eflags of x86 and NZCV of ARM) are computed by
+ *  nearly every guest instruction, but are rarely read. After the state
+ *  mapping, the flags live in SSA values across the whole trace and are only
+ *  stored to the CPU state at the exits, before the helper calls and at the
+ *  restore points. A flag computation that is overwritten before any of them
+ *  is dead, and one that is only stored at the exits of the trace still runs
+ *  on the hot path.
+ *
+ *  This pass removes the dead computations and sinks the computations that
+ *  are only used by the flag stores of the exit blocks into those blocks, so
+ *  that the flags are materialized only when the execution leaves the trace.
+ *  Uses by the helper calls and the restore points are kept in place.
+ */
+class LazyConditionCode : public FunctionPass {
+    typedef std::map<BasicBlock *, Instruction *> CopyMap;
+
+    IRFactory *IF;
+    const DataLayout *DL;
+    Instruction *CPU;
+    std::set<Instruction *> Sunk;  /* Instructions sunk to the exit blocks */
+
+    bool isExitBlock(BasicBlock *BB) {
+        return succ_begin(BB) == succ_end(BB);
+    }
+    bool isFlagStore(Instruction *I, Value *V);
+    bool isSinkable(Instruction *I);
+    void Sink(Instruction *I);
+
+public:
+    static char ID;
+    explicit LazyConditionCode() : FunctionPass(ID) {}
+    explicit LazyConditionCode(IRFactory *IF)
+        : FunctionPass(ID), IF(IF), DL(IF->getDL()), CPU(nullptr) {}
+    bool runOnFunction(Function &F);
+};
+
+char LazyConditionCode::ID = 0;
+INITIALIZE_PASS(LazyConditionCode, "lazycc",
+        "Materialize the guest condition codes at the trace exits", false, false)
+
+FunctionPass *llvm::createLazyConditionCode(IRFactory *IF)
+{
+    return new LazyConditionCode(IF);
+}
+
+/* Determine if the offset is to access the guest condition codes. */
+static inline bool isStateOfFlag(intptr_t Off)
+{
+#if defined(TARGET_I386)
+    return (Off >= (intptr_t)offsetof(CPUArchState, cc_dst) &&
+            Off < (intptr_t)(offsetof(CPUArchState, cc_op) + sizeof(uint32_t)));
+#elif defined(TARGET_ARM) || defined(TARGET_AARCH64)
+    return (Off >= (intptr_t)offsetof(CPUArchState, CF) &&
+            Off < (intptr_t)(offsetof(CPUArchState, ZF) + sizeof(uint32_t)));
+#else
+    return false;
+#endif
+}
+
+/* Return true if I stores V to the condition codes. A value tagged by the
+ * A_SetCC annotation is a condition code whatever state it is stored to. */
+bool LazyConditionCode::isFlagStore(Instruction *I, Value *V)
+{
+    StoreInst *SI = dyn_cast<StoreInst>(I);
+    if (!SI || SI->isVolatile() || SI->getValueOperand() != V)
+        return false;
+
+    if (isa<Instruction>(V) && MDFactory::isCondition(cast<Instruction>(V)))
+        return true;
+
+    intptr_t Off = 0;
+    Value *Base = getBaseWithConstantOffset(DL, SI->getPointerOperand(), Off);
+    return Base == CPU && isStateOfFlag(Off);
+}
+
+/* An instruction is sinkable if it has no side effect and is only used by the
+ * flag stores, or the sunk instructions, of exit blocks other than its own. */
+bool LazyConditionCode::isSinkable(Instruction *I)
+{
+    if (isa<PHINode>(I) || isa<TerminatorInst>(I) || isa<AllocaInst>(I) ||
+        isa<CallInst>(I) || I->mayHaveSideEffects() || I->mayReadFromMemory())
+        return false;
+    if (I->use_empty())
+        return false;
+
+    BasicBlock *BB = I->getParent();
+    for (auto U : I->users()) {
+        Instruction *UI = cast<Instruction>(U);
+        BasicBlock *UseBB = UI->getParent();
+        if (UseBB == BB || !isExitBlock(UseBB))
+            return false;
+        if (!Sunk.count(UI) && !isFlagStore(UI, I))
+            return false;
+    }
+    return true;
+}
+
+/* Move I to the exit blocks using it, with a copy for each of them. The users
+ * are dominated by I, so are the operands of I at the start of the blocks. */
+void LazyConditionCode::Sink(Instruction *I)
+{
+    CopyMap Copies;
+    SmallVector<Use *, 8> Uses;
+    for (auto &U : I->uses())
+        Uses.push_back(&U);
+
+    for (auto U : Uses) {
+        BasicBlock *UseBB = cast<Instruction>(U->getUser())->getParent();
+        Instruction *&Copy = Copies[UseBB];
+        if (!Copy) {
+            Copy = Copies.size() == 1 ? I : I->clone();
+            if (Copy == I)
+                I->moveBefore(&*UseBB->getFirstInsertionPt());
+            else
+                Copy->insertBefore(&*UseBB->getFirstInsertionPt());
+            Sunk.insert(Copy);
+        }
+        if (Copy != I)
+            U->set(Copy);
+    }
+}
+
+bool LazyConditionCode::runOnFunction(Function &F)
+{
+    CPU = IF->getDefaultCPU(F);
+    if (!CPU)
+        return false;
+
+    bool Changed = false;
+    unsigned NumDead = 0, NumSunk = 0;
+
+    /* Sink the flag computations bottom-up, so that the operands of a sunk
+     * instruction can follow it. Iterate until no instruction moves, since a
+     * computation may span guest blocks. */
+    for (bool Moved = true; Moved; ) {
+        Moved = false;
+        for (auto &BB : F) {
+            if (isExitBlock(&BB))
+                continue;
+
+            IVec Insts;
+            for (auto &I : BB)
+                Insts.push_back(&I);
+            for (auto II = Insts.rbegin(), IE = Insts.rend(); II != IE; ++II) {
+                Instruction *I = *II;
+                if (I == CPU)
+                    continue;
+                if (isInstructionTriviallyDead(I)) {
+                    I->eraseFromParent();
+                    NumDead++;
+                    Moved = true;
+                } else if (isSinkable(I)) {
+                    Sink(I);
+                    NumSunk++;
+                    Moved = true;
+                }
+            }
+        }
+        Changed |= Moved;
+    }
+
+    if (Changed)
+        dbg() << DEBUG_PASS << PASS_NAME << ": removed " << NumDead
+              << " and sunk " << NumSunk << " instructions.\n";
+
+    Sunk.clear();
+    return Changed;
+}
+
+/*
+ * vim: ts=8 sts=4 sw=4 expandtab
+ */
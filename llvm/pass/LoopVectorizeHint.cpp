@@ -0,0 +1,683 @@
+/*
+ *  (C) 2016 by Computer System Laboratory, IIS, Academia Sinica, Taiwan.
+ *      See COPYRIGHT in top-level directory.
+ */
+
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm-debug.h"
+#include "llvm-opc.h"
+#include "llvm-target.h"
+#include "llvm-pass.h"
+#include "llvm-annotate.h"
+#include "InnerLoopAnalysis.h"
+#include "utils.h"
+
+#define PASS_NAME "LoopVectorizeHint"
+
+#if !defined(LLVM_V35)
+/*
+ * LoopVectorizeHint Pass
+ *  Derive the vectorization metadata (VS/VF/Distance/Stride) of the innermost
+ *  guest loops from InnerLoopAnalysis and SCEV, instead of reading it from an
+ *  annotation file. A loop is vectorizable if all its memory accesses are
+ *  guest memory accesses with a unit stride (or loop-invariant loads), it has
+ *  no call, and the dependence distances between the accesses are constant.
+ *
+ *  The guest memory accesses are volatile in user mode, so that a fault is
+ *  raised at the precise guest instruction. LoopVectorize needs the guest exit
+ *  to be the only exit of the loop, but the exit request must still be served
+ *  while a long loop runs. The loop is strip-mined: the inner loop runs at
+ *  most VECTOR_CHUNK iterations, exiting on the guest condition or at the end
+ *  of the chunk, and the exit-request check of the latch tail is moved between
+ *  two chunks. The inner loop is then versioned: before each chunk, the guest
+ *  pages touched by the chunk are checked at runtime, and the chunk runs a
+ *  copy of the inner loop with non-volatile accesses and the llvm.loop hints
+ *  if they are all mapped and no other vCPU runs. Otherwise, the original
+ *  loop runs the chunk.
+ */
+#define VECTOR_CHUNK  1024  /* Iterations between two exit-request checks */
+
+class LoopVectorizeHint : public FunctionPass {
+    struct Access {
+        Instruction *I;
+        const SCEV *Addr;     /* SCEV of the guest address */
+        const SCEV *First;    /* Guest address of the first iteration */
+        Value *Start;         /* `First' expanded in the preheader */
+        int64_t Step;         /* Address step per iteration, 0 if invariant */
+        unsigned Size;        /* Access size in bytes */
+        bool isWrite;
+    };
+    typedef std::vector<Access> AccessList;
+
+    struct Candidate {
+        InnerLoop *L;
+        AccessList Accesses;
+        LoopMetadata LoopMD;
+        Value *Index;         /* Guest base added to the guest addresses */
+        Value *TripCount;     /* Trip count expanded in the preheader */
+    };
+
+    IRFactory *IF;
+    const DataLayout *DL;
+    ScalarEvolution *SE;
+    DominatorTree *DT;
+    IntegerType *IntPtrTy;
+
+    IntToPtrInst *getGuestAddr(Value *Ptr, Value *&Index);
+    bool analyzeExit(InnerLoop &L);
+    bool analyzeAccesses(InnerLoop &L, AccessList &Accesses, unsigned &Size,
+                         Value *&Index);
+    bool analyzeStride(AccessList &Accesses, int &Stride);
+    bool analyzeDistance(AccessList &Accesses, int &Distance);
+    bool expandRange(Candidate &C);
+    void stripMineLoop(InnerLoop &L, BasicBlock *&Chunk, BasicBlock *&Split,
+                       PHINode *&Iter);
+    Value *checkRange(Candidate &C, Function &F, PHINode *Iter,
+                      Instruction *InsertPos);
+    Value *getOpaqueBase(Value *Index, Instruction *InsertPos);
+    void versionLoop(Candidate &C, Function &F);
+
+public:
+    static char ID;
+    explicit LoopVectorizeHint() : FunctionPass(ID) {}
+    explicit LoopVectorizeHint(IRFactory *IF)
+        : FunctionPass(ID), IF(IF), DL(IF->getDL()) {}
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        AU.addRequired<InnerLoopAnalysisWrapperPass>();
+        AU.addRequired<ScalarEvolutionWrapperPass>();
+        AU.addRequired<DominatorTreeWrapperPass>();
+    }
+    bool runOnFunction(Function &F) override;
+};
+
+char LoopVectorizeHint::ID = 0;
+INITIALIZE_PASS_BEGIN(LoopVectorizeHint, "loopvechint",
+        "Derive vectorization hints of guest loops", false, false)
+INITIALIZE_PASS_DEPENDENCY(InnerLoopAnalysisWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(ScalarEvolutionWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_END(LoopVectorizeHint, "loopvechint",
+        "Derive vectorization hints of guest loops", false, false)
+
+FunctionPass *llvm::createLoopVectorizeHint(IRFactory *IF)
+{
+    return new LoopVectorizeHint(IF);
+}
+
+/* Return the inttoptr which converts the guest address of the access pointer.
+ * `Index' is set to the guest base if it is added to the address. */
+IntToPtrInst *LoopVectorizeHint::getGuestAddr(Value *Ptr, Value *&Index)
+{
+    Index = nullptr;
+    Ptr = Ptr->stripPointerCasts();
+    if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(Ptr)) {
+        if (GEP->getNumIndices() != 1)
+            return nullptr;
+        Index = GEP->getOperand(1);
+        Ptr = GEP->getPointerOperand()->stripPointerCasts();
+    }
+    return dyn_cast<IntToPtrInst>(Ptr);
+}
+
+/* The loop must have a single guest exit at the latch head, and the latch
+ * tail must only check the exit request before branching back to the header.
+ * The header must be entered from a single preheader. */
+bool LoopVectorizeHint::analyzeExit(InnerLoop &L)
+{
+    if (L.hasUnknownPhi() || L.getNumLoopLatches() != 1 ||
+        L.getNumSplitLatches() != 1)
+        return false;
+
+    BasicBlock *Head = L.getSingleLatchHead();
+    BasicBlock *Tail = L.getSingleLatchTail();
+    if (L.getExitingBlock() != Head ||
+        isa<SCEVCouldNotCompute>(SE->getExitCount(&L.getLoop(), Head)))
+        return false;
+
+    BranchInst *BI = dyn_cast<BranchInst>(Tail->getTerminator());
+    if (!BI || !BI->isConditional() || !L.getLoopPreheader())
+        return false;
+    if (BI->getSuccessor(0) != L.getHeader() &&
+        BI->getSuccessor(1) != L.getHeader())
+        return false;
+    BranchInst *HeadBI = dyn_cast<BranchInst>(Head->getTerminator());
+    if (!HeadBI || !HeadBI->isConditional())
+        return false;
+    for (auto &I : *Tail) {
+        if (&I == BI)
+            continue;
+        if (isa<FenceInst>(&I) || isa<CallInst>(&I) || I.mayWriteToMemory())
+            return false;
+        if (!I.hasOneUse() || I.user_back()->getParent() != Tail)
+            return false;
+    }
+    return true;
+}
+
+/* Collect the guest memory accesses of the loop. `Size' is set to the size
+ * of the widest access and `Index' to the guest base shared by them. The
+ * accesses may be volatile; they are made non-volatile in the versioned loop
+ * only. Accesses through a segment are not handled. */
+bool LoopVectorizeHint::analyzeAccesses(InnerLoop &L, AccessList &Accesses,
+                                        unsigned &Size, Value *&Index)
+{
+    Loop *TheLoop = &L.getLoop();
+    BasicBlock *Tail = L.getSingleLatchTail();
+    bool hasIndex = false;
+
+    Size = 0;
+    Index = nullptr;
+    for (auto BB : L.blocks()) {
+        if (BB == Tail)
+            continue;
+        for (auto &I : *BB) {
+            if (isa<CallInst>(&I) && !isa<DbgInfoIntrinsic>(&I))
+                return false;
+            if (isa<FenceInst>(&I))
+                return false;
+            if (!I.mayReadOrWriteMemory())
+                continue;
+
+            LoadInst *LI = dyn_cast<LoadInst>(&I);
+            StoreInst *SI = dyn_cast<StoreInst>(&I);
+            if ((!LI || LI->isAtomic()) && (!SI || SI->isAtomic()))
+                return false;
+            if (!MDFactory::isGuestMemory(&I))
+                return false;
+
+            Value *Ptr = getPointerOperand(&I);
+            if (Ptr->getType()->getPointerAddressSpace() != 0)
+                return false;
+
+            Value *AccessIndex;
+            IntToPtrInst *ITP = getGuestAddr(Ptr, AccessIndex);
+            if (!ITP)
+                return false;
+            if (hasIndex && AccessIndex != Index)
+                return false;
+            Index = AccessIndex;
+            hasIndex = true;
+
+            Value *GuestAddr = ITP->getOperand(0);
+            if (DL->getTypeSizeInBits(GuestAddr->getType()) >
+                IntPtrTy->getBitWidth())
+                return false;
+            const SCEV *Addr = SE->getSCEV(GuestAddr);
+            Addr = SE->getNoopOrZeroExtend(Addr, IntPtrTy);
+
+            Type *Ty = LI ? LI->getType() : SI->getValueOperand()->getType();
+            unsigned AccessSize = DL->getTypeStoreSize(Ty);
+            Access A = { &I, Addr, Addr, nullptr, 0, AccessSize,
+                         SI != nullptr };
+
+            if (!SE->isLoopInvariant(Addr, TheLoop)) {
+                const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(Addr);
+                if (!AR || AR->getLoop() != TheLoop || !AR->isAffine())
+                    return false;
+                const SCEVConstant *Step =
+                    dyn_cast<SCEVConstant>(AR->getStepRecurrence(*SE));
+                if (!Step || Step->getValue()->isZero())
+                    return false;
+                A.Step = Step->getValue()->getSExtValue();
+                A.First = AR->getStart();
+            } else if (SI)
+                return false;
+
+            Size = std::max(Size, AccessSize);
+            Accesses.push_back(A);
+        }
+    }
+    return Size != 0;
+}
+
+/* Compute the stride (in elements) shared by the accesses moving with the
+ * loop. Only a unit stride is vectorized: a larger or a varying stride would
+ * need gathers and scatters. */
+bool LoopVectorizeHint::analyzeStride(AccessList &Accesses, int &Stride)
+{
+    Stride = 0;
+    for (auto &A : Accesses) {
+        if (A.Step == 0)
+            continue;
+        if (A.Step % (int64_t)A.Size)
+            return false;
+        int64_t S = A.Step / (int64_t)A.Size;
+        if (Stride && S != Stride)
+            return false;
+        Stride = (int)S;
+    }
+    return Stride == 1;
+}
+
+/* Compute the minimum dependence distance (in iterations) that constrains
+ * the vectorization factor. INT_MAX means no loop-carried dependence. */
+bool LoopVectorizeHint::analyzeDistance(AccessList &Accesses, int &Distance)
+{
+    Distance = INT_MAX;
+    for (auto &W : Accesses) {
+        if (!W.isWrite)
+            continue;
+        for (auto &A : Accesses) {
+            if (&A == &W)
+                continue;
+            if (A.Step != W.Step)
+                return false;
+
+            const SCEVConstant *Diff =
+                dyn_cast<SCEVConstant>(SE->getMinusSCEV(A.Addr, W.Addr));
+            if (!Diff)
+                return false;
+            int64_t C = Diff->getValue()->getSExtValue();
+            if (C % W.Step)
+                return false;
+
+            /* A at iteration j accesses the location written at iteration
+             * j + d. The vectorized loop runs the accesses of VF iterations
+             * in the order of the loop body, so the dependence constrains
+             * the VF unless A is a read which reads the location before it
+             * is written (d > 0) and comes first in the body. */
+            int64_t d = C / W.Step;
+            if (d == 0)
+                continue;
+            if (!A.isWrite && d > 0 && DT->dominates(A.I, W.I))
+                continue;
+            Distance = (int)std::min<int64_t>(Distance, d < 0 ? -d : d);
+        }
+    }
+    return true;
+}
+
+/* Expand the guest address of the first iteration of each access and the
+ * trip count of the loop in the preheader. They bound the guest pages
+ * touched by a chunk. */
+bool LoopVectorizeHint::expandRange(Candidate &C)
+{
+    Loop *TheLoop = &C.L->getLoop();
+    const SCEV *BTC = SE->getExitCount(TheLoop, C.L->getSingleLatchHead());
+    if (SE->getTypeSizeInBits(BTC->getType()) > IntPtrTy->getBitWidth())
+        return false;
+    BTC = SE->getNoopOrZeroExtend(BTC, IntPtrTy);
+    const SCEV *Trip = SE->getAddExpr(BTC, SE->getConstant(IntPtrTy, 1));
+
+    if (!isSafeToExpand(Trip, *SE))
+        return false;
+    for (auto &A : C.Accesses) {
+        if (!isSafeToExpand(A.First, *SE))
+            return false;
+    }
+
+    Instruction *InsertPos = C.L->getLoopPreheader()->getTerminator();
+    SCEVExpander Expander(*SE, *DL, "");
+    C.TripCount = Expander.expandCodeFor(Trip, IntPtrTy, InsertPos);
+    for (auto &A : C.Accesses)
+        A.Start = Expander.expandCodeFor(A.First, IntPtrTy, InsertPos);
+    return true;
+}
+
+/*
+ * stripMineLoop()
+ *  Split the loop into chunks of VECTOR_CHUNK iterations. A new block `Chunk'
+ *  becomes the preheader of the inner loop, which now runs from the header to
+ *  the latch head and branches back from the latch head directly. The latch
+ *  head leaves the inner loop on the guest exit or at the end of the chunk;
+ *  in the latter case, the latch tail checks the exit request and starts the
+ *  next chunk. `Iter' is the number of iterations run before the chunk.
+ */
+void LoopVectorizeHint::stripMineLoop(InnerLoop &L, BasicBlock *&Chunk,
+                                      BasicBlock *&Split, PHINode *&Iter)
+{
+    LLVMContext &Context = L.getHeader()->getContext();
+    Function *F = L.getHeader()->getParent();
+    BasicBlock *Header = L.getHeader();
+    BasicBlock *Head = L.getSingleLatchHead();
+    BasicBlock *Tail = L.getSingleLatchTail();
+    BasicBlock *Preheader = L.getLoopPreheader();
+    IntegerType *Int32Ty = Type::getInt32Ty(Context);
+
+    /* Enter the header from the start of each chunk. The values of the
+     * header PHIs come from the preheader or from the previous chunk. */
+    Chunk = BasicBlock::Create(Context, "chunk", F, Header);
+    BranchInst::Create(Header, Chunk);
+    Preheader->getTerminator()->replaceUsesOfWith(Header, Chunk);
+    Tail->getTerminator()->replaceUsesOfWith(Header, Chunk);
+    for (auto &I : *Header) {
+        PHINode *PN = dyn_cast<PHINode>(&I);
+        if (!PN)
+            break;
+        int PreIdx = PN->getBasicBlockIndex(Preheader);
+        int TailIdx = PN->getBasicBlockIndex(Tail);
+        PHINode *NewPN = PHINode::Create(PN->getType(), 2, "",
+                                         &*Chunk->begin());
+        NewPN->addIncoming(PN->getIncomingValue(PreIdx), Preheader);
+        NewPN->addIncoming(PN->getIncomingValue(TailIdx), Tail);
+        PN->setIncomingValue(PreIdx, NewPN);
+        PN->setIncomingBlock(PreIdx, Chunk);
+        PN->setIncomingBlock(TailIdx, Head);
+    }
+
+    Iter = PHINode::Create(IntPtrTy, 2, "chunk.base", &*Chunk->begin());
+    Value *NextIter = BinaryOperator::CreateAdd(Iter,
+                            ConstantInt::get(IntPtrTy, VECTOR_CHUNK), "",
+                            Chunk->getTerminator());
+    Iter->addIncoming(ConstantInt::get(IntPtrTy, 0), Preheader);
+    Iter->addIncoming(NextIter, Tail);
+
+    /* Count the iterations of the chunk. */
+    PHINode *Count = PHINode::Create(Int32Ty, 2, "chunk.iv",
+                                     &*Header->begin());
+    Value *Next = BinaryOperator::CreateAdd(Count, ConstantInt::get(Int32Ty, 1),
+                                            "", Head->getTerminator());
+    Value *Done = new ICmpInst(Head->getTerminator(), ICmpInst::ICMP_EQ, Next,
+                               ConstantInt::get(Int32Ty, VECTOR_CHUNK), "");
+    Count->addIncoming(ConstantInt::get(Int32Ty, 0), Chunk);
+    Count->addIncoming(Next, Head);
+
+    /* Leave the inner loop on the guest exit or at the end of the chunk, and
+     * tell them apart in `Split'. Both exits are folded into the condition of
+     * the latch head, so that it remains the only exiting block. */
+    BranchInst *BI = cast<BranchInst>(Head->getTerminator());
+    unsigned Cont = BI->getSuccessor(0) == Tail ? 0 : 1;
+    BasicBlock *Exit = BI->getSuccessor(1 - Cont);
+    Split = BasicBlock::Create(Context, "chunk.split", F, Tail);
+    Value *Cond = BI->getCondition();
+
+    BranchInst::Create(Cont == 0 ? Tail : Exit, Cont == 0 ? Exit : Tail,
+                       Cond, Split);
+    if (Cont == 0)
+        Cond = BinaryOperator::CreateAnd(Cond, BinaryOperator::CreateNot(Done,
+                                         "", BI), "", BI);
+    else
+        Cond = BinaryOperator::CreateOr(Cond, Done, "", BI);
+    BI->setCondition(Cond);
+    BI->setSuccessor(Cont, Header);
+    BI->setSuccessor(1 - Cont, Split);
+
+    for (auto &I : *Exit) {
+        PHINode *PN = dyn_cast<PHINode>(&I);
+        if (!PN)
+            break;
+        int Idx = PN->getBasicBlockIndex(Head);
+        if (Idx != -1)
+            PN->setIncomingBlock(Idx, Split);
+    }
+    for (auto &I : *Tail) {
+        PHINode *PN = dyn_cast<PHINode>(&I);
+        if (!PN)
+            break;
+        int Idx = PN->getBasicBlockIndex(Head);
+        if (Idx != -1)
+            PN->setIncomingBlock(Idx, Split);
+    }
+}
+
+/* Emit the runtime check of the guest pages touched by the chunk starting at
+ * iteration `Iter'. The chunk runs min(VECTOR_CHUNK, TripCount - Iter)
+ * iterations. The returned value is true if all the pages can be accessed. */
+Value *LoopVectorizeHint::checkRange(Candidate &C, Function &F, PHINode *Iter,
+                                     Instruction *InsertPos)
+{
+    LLVMContext &Context = F.getContext();
+    IntegerType *Int32Ty = Type::getInt32Ty(Context);
+    IntegerType *Int64Ty = Type::getInt64Ty(Context);
+    Function *Helper = IF->ResolveFunction("helper_check_guest_range");
+    Type *ParamTy = Helper->getFunctionType()->getParamType(0);
+    Value *Env = new BitCastInst(IF->getDefaultCPU(F), ParamTy, "", InsertPos);
+
+    Value *ChunkSize = ConstantInt::get(IntPtrTy, VECTOR_CHUNK);
+    Value *Remain = BinaryOperator::CreateSub(C.TripCount, Iter, "", InsertPos);
+    Value *isLast = new ICmpInst(InsertPos, ICmpInst::ICMP_ULT, Remain,
+                                 ChunkSize, "");
+    Value *Num = SelectInst::Create(isLast, Remain, ChunkSize, "", InsertPos);
+    Value *Last = BinaryOperator::CreateSub(Num, ConstantInt::get(IntPtrTy, 1),
+                                            "", InsertPos);
+
+    Value *Cond = nullptr;
+    for (auto &A : C.Accesses) {
+        Value *Lo = A.Start;
+        Value *Len = ConstantInt::get(IntPtrTy, A.Size);
+        if (A.Step) {
+            uint64_t Step = A.Step < 0 ? -A.Step : A.Step;
+            Value *Offset = BinaryOperator::CreateMul(Iter,
+                                ConstantInt::get(IntPtrTy, A.Step), "",
+                                InsertPos);
+            Value *Span = BinaryOperator::CreateMul(Last,
+                                ConstantInt::get(IntPtrTy, Step), "",
+                                InsertPos);
+            Lo = BinaryOperator::CreateAdd(Lo, Offset, "", InsertPos);
+            if (A.Step < 0)
+                Lo = BinaryOperator::CreateSub(Lo, Span, "", InsertPos);
+            Len = BinaryOperator::CreateAdd(Span, Len, "", InsertPos);
+        }
+        if (IntPtrTy != Int64Ty) {
+            Lo = new ZExtInst(Lo, Int64Ty, "", InsertPos);
+            Len = new ZExtInst(Len, Int64Ty, "", InsertPos);
+        }
+
+        SmallVector<Value *, 4> Params;
+        Params.push_back(Env);
+        Params.push_back(Lo);
+        Params.push_back(Len);
+        Params.push_back(ConstantInt::get(Int32Ty, A.isWrite));
+        CallInst *CI = CallInst::Create(Helper, Params, "", InsertPos);
+        IF->getMDFactory()->setConst(CI);
+
+        Value *OK = new ICmpInst(InsertPos, ICmpInst::ICMP_NE, CI,
+                                 ConstantInt::get(Int32Ty, 0), "");
+        Cond = Cond ? BinaryOperator::CreateAnd(Cond, OK, "", InsertPos) : OK;
+    }
+    return Cond;
+}
+
+/* Return a pointer to the guest base that cannot be folded to a constant.
+ * The rewritten guest addresses are based on it, so that alias analysis
+ * cannot identify their underlying object and take two guest accesses as
+ * disjoint. */
+Value *LoopVectorizeHint::getOpaqueBase(Value *Index, Instruction *InsertPos)
+{
+    LLVMContext &Context = InsertPos->getContext();
+    if (!Index)
+        Index = ConstantInt::get(IntPtrTy, 0);
+
+    Type *ArgTy[] = { IntPtrTy };
+    auto IA = InlineAsm::get(FunctionType::get(IntPtrTy, ArgTy, false), "",
+                             "=r,0", false);
+    CallInst *CI = CallInst::Create(IA, Index, "guest.base", InsertPos);
+    CI->setDoesNotAccessMemory();
+    return new IntToPtrInst(CI, Type::getInt8PtrTy(Context), "", InsertPos);
+}
+
+/*
+ * versionLoop()
+ *  Strip-mine the loop and clone its inner loop. The clone runs the chunk if
+ *  the runtime check passes. Its guest memory accesses are non-volatile and
+ *  their addresses are rewritten into a form SCEV can see through, and the
+ *  llvm.loop hints are attached to it for LoopVectorize.
+ */
+void LoopVectorizeHint::versionLoop(Candidate &C, Function &F)
+{
+    LLVMContext &Context = F.getContext();
+    InnerLoop &L = *C.L;
+    BasicBlock *Head = L.getSingleLatchHead();
+    BasicBlock *Tail = L.getSingleLatchTail();
+    BasicBlock *Header = L.getHeader();
+    Value *Base = getOpaqueBase(C.Index,
+                                L.getLoopPreheader()->getTerminator());
+    SmallVector<BasicBlock *, 8> Body;
+    SmallPtrSet<BasicBlock *, 8> BodySet;
+    BasicBlock *Chunk, *Split;
+    PHINode *Iter;
+
+    for (auto BB : L.blocks()) {
+        if (BB == Tail)
+            continue;
+        Body.push_back(BB);
+        BodySet.insert(BB);
+    }
+
+    stripMineLoop(L, Chunk, Split, Iter);
+    IF->getMDFactory()->setLoop(Head->getTerminator());
+
+    /* Clone the inner loop. */
+    ValueToValueMapTy VMap;
+    SmallPtrSet<BasicBlock *, 8> CloneSet;
+    for (auto BB : Body) {
+        BasicBlock *NewBB = CloneBasicBlock(BB, VMap, ".vec", &F);
+        VMap[BB] = NewBB;
+        CloneSet.insert(NewBB);
+    }
+    for (auto BB : CloneSet) {
+        for (auto &I : *BB) {
+            for (unsigned i = 0, e = I.getNumOperands(); i != e; ++i) {
+                if (Value *V = VMap.lookup(I.getOperand(i)))
+                    I.setOperand(i, V);
+            }
+            PHINode *PN = dyn_cast<PHINode>(&I);
+            if (!PN)
+                continue;
+            for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; ++i) {
+                if (Value *V = VMap.lookup(PN->getIncomingBlock(i)))
+                    PN->setIncomingBlock(i, cast<BasicBlock>(V));
+            }
+        }
+    }
+
+    /* Merge the values of the two inner loops which are used after them. */
+    BasicBlock *CloneHead = cast<BasicBlock>(VMap[Head]);
+    for (auto BB : Body) {
+        for (auto &I : *BB) {
+            SmallVector<Use *, 8> Uses;
+            for (auto &U : I.uses()) {
+                BasicBlock *UseBB = cast<Instruction>(U.getUser())->getParent();
+                if (!BodySet.count(UseBB) && !CloneSet.count(UseBB))
+                    Uses.push_back(&U);
+            }
+            if (Uses.empty())
+                continue;
+
+            PHINode *PN = PHINode::Create(I.getType(), 2, "", &*Split->begin());
+            PN->addIncoming(&I, Head);
+            PN->addIncoming(VMap[&I], CloneHead);
+            for (auto U : Uses)
+                U->set(PN);
+        }
+    }
+
+    /* Select the inner loop at the start of each chunk. */
+    TerminatorInst *TI = Chunk->getTerminator();
+    Value *Cond = checkRange(C, F, Iter, TI);
+    BranchInst::Create(cast<BasicBlock>(VMap[Header]), Header, Cond, TI);
+    TI->eraseFromParent();
+
+    /* Make the guest addresses of the clone visible to SCEV. */
+    IntegerType *Int8Ty = Type::getInt8Ty(Context);
+    SmallVector<Instruction *, 16> Accesses;
+    for (auto &A : C.Accesses) {
+        Instruction *I = cast<Instruction>(VMap[A.I]);
+        Value *Ptr = getPointerOperand(I);
+        Value *Index;
+        IntToPtrInst *ITP = getGuestAddr(Ptr, Index);
+
+        Value *Addr = ITP->getOperand(0);
+        if (Addr->getType() != IntPtrTy)
+            Addr = new ZExtInst(Addr, IntPtrTy, "", I);
+        Value *V = GetElementPtrInst::Create(Int8Ty, Base, Addr, "", I);
+        if (V->getType() != Ptr->getType())
+            V = new BitCastInst(V, Ptr->getType(), "", I);
+        I->replaceUsesOfWith(Ptr, V);
+
+        if (LoadInst *LI = dyn_cast<LoadInst>(I))
+            LI->setVolatile(false);
+        else
+            cast<StoreInst>(I)->setVolatile(false);
+        Accesses.push_back(I);
+    }
+
+    /* Attach the hints. */
+    SmallVector<Metadata *, 4> MDs;
+    MDs.push_back(nullptr);
+    Metadata *Enable[] = {
+        MDString::get(Context, "llvm.loop.vectorize.enable"),
+        ConstantAsMetadata::get(ConstantInt::get(Type::getInt1Ty(Context), 1))
+    };
+    Metadata *Width[] = {
+        MDString::get(Context, "llvm.loop.vectorize.width"),
+        ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(Context),
+                                                 C.LoopMD.VF))
+    };
+    MDs.push_back(MDNode::get(Context, Enable));
+    MDs.push_back(MDNode::get(Context, Width));
+    MDNode *LoopID = MDNode::get(Context, MDs);
+    LoopID->replaceOperandWith(0, LoopID);
+    TI = CloneHead->getTerminator();
+    TI->setMetadata(LLVMContext::MD_loop, LoopID);
+
+    /* Without a loop-carried dependence, the iterations can be run in any
+     * order and LoopVectorize does not need the runtime checks. */
+    if (C.LoopMD.Distance == INT_MAX) {
+        for (auto I : Accesses)
+            I->setMetadata("llvm.mem.parallel_loop_access", LoopID);
+    }
+}
+
+bool LoopVectorizeHint::runOnFunction(Function &F)
+{
+    InnerLoopAnalysis &LA =
+        getAnalysis<InnerLoopAnalysisWrapperPass>().getLoopAnalysis();
+    SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+    DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    IntPtrTy = DL->getIntPtrType(F.getContext());
+
+    if (!IF->getDefaultCPU(F))
+        return false;
+
+    /* The vector size (VS) of the host in bytes. */
+    unsigned VS = hasHostFeature("avx2") ? 32 : 16;
+    std::vector<Candidate> Candidates;
+    bool Changed = false;
+
+    /* Analyze all loops before any of them is transformed, while SCEV and
+     * the dominator tree are still valid. */
+    for (auto L : LA) {
+        Candidate C;
+        unsigned Size;
+
+        C.L = L;
+        if (!analyzeExit(*L) ||
+            !analyzeAccesses(*L, C.Accesses, Size, C.Index) ||
+            !analyzeStride(C.Accesses, C.LoopMD.Stride) ||
+            !analyzeDistance(C.Accesses, C.LoopMD.Distance))
+            continue;
+
+        C.LoopMD.VS = VS;
+        C.LoopMD.VF = VS / Size;
+        if ((int)C.LoopMD.VF > C.LoopMD.Distance)
+            C.LoopMD.VF = C.LoopMD.Distance;
+        C.LoopMD.VF = C.LoopMD.VF ? 1U << Log2_32(C.LoopMD.VF) : 0;
+        if (C.LoopMD.VF < 2 || !expandRange(C))
+            continue;
+
+        Changed = true;
+        Candidates.push_back(C);
+    }
+
+    for (auto &C : Candidates) {
+        dbg() << DEBUG_LLVM << PASS_NAME << ": vectorize loop "
+              << C.L->getHeader()->getName() << " VF=" << C.LoopMD.VF
+              << " distance=" << C.LoopMD.Distance << "\n";
+
+        versionLoop(C, F);
+        IF->getTrace()->LoopStride = C.LoopMD.Stride;
+    }
+    return Changed;
+}
+#endif
+
+/*
+ * vim: ts=8 sts=4 sw=4 expandtab
+ */
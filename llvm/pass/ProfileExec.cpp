@@ -20,9 +20,9 @@ extern LLVMEnv *LLEnv;
  */
 class ProfileExec : public FunctionPass {
     enum {
-        IDX_LOOP = 0,
-        IDX_EXIT,
-        IDX_INBR,
+        IDX_LOOP = TraceInfo::IDX_LOOP,
+        IDX_EXIT = TraceInfo::IDX_EXIT,
+        IDX_INBR = TraceInfo::IDX_INBR,
     };
 
     IRFactory *IF;
@@ -72,7 +72,7 @@ bool ProfileExec::runOnFunction(Function &F)
 {
     if (!LLEnv->isTraceMode())
         return false;
-    if (!SP->isEnabled())
+    if (!SP->isEnabled() && !LLVMEnv::RegionReform && !LLVMEnv::ProfileLoop)
         return false;
 
     Instruction *CPU = IF->getDefaultCPU(F);
@@ -107,11 +107,18 @@ bool ProfileExec::runOnFunction(Function &F)
         new StoreInst(NumExits, NumExitPtr, true, InsertPos);
     }
 
-    if (!(SP->Mode & SPM_TRACE))
+    /* The execution counters are also required by the region re-formation
+     * which uses them to detect traces with dominating side exits, and by
+     * the annotation dump which derives the loop trip counts from them. */
+    if (!(SP->Mode & SPM_TRACE) && !LLVMEnv::RegionReform &&
+        !LLVMEnv::ProfileLoop)
         return false;
 
     SmallVector<CallInst*, 16> InlineCalls;
     Function *Helper = IF->ResolveFunction("helper_profile_exec");
+    Function *ExitHelper = nullptr;
+    if (LLVMEnv::RegionReform)
+        ExitHelper = IF->ResolveFunction("helper_region_exit");
 
     /* Prepare counter structures. */
     if (!Trace->ExecCount) {
@@ -158,6 +165,17 @@ bool ProfileExec::runOnFunction(Function &F)
         CallInst *CI = CallInst::Create(Helper, Params, "", InsertPos);
         MF->setConst(CI);
         InlineCalls.push_back(CI);
+
+        /* Check if the trace should be re-formed when leaving the trace. */
+        if (ExitHelper && ProfilePoint[i].second != IDX_LOOP) {
+            Value *TracePtr = ConstantExpr::getIntToPtr(
+                                CONSTPtr((uintptr_t)Trace),
+                                PointerType::getUnqual(Int8Ty));
+            Params.clear();
+            Params.push_back(Env);
+            Params.push_back(TracePtr);
+            CallInst::Create(ExitHelper, Params, "", InsertPos);
+        }
     }
 
     while (!InlineCalls.empty())
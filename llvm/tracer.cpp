@@ -10,11 +10,14 @@
 #include "tracer.h"
 #include "llvm-state.h"
 
-#define USE_RELAXED_NET
-
 
 unsigned ProfileThreshold = NET_PROFILE_THRESHOLD;
 unsigned PredictThreshold = NET_PREDICT_THRESHOLD;
+int RegionFormation = REGION_NET;
+
+const char *RegionName[REGION_NUM] = {
+    "net", "net-strict", "lei", "tracetree",
+};
 
 static inline void start_trace_profiling(TranslationBlock *tb)
 {
@@ -29,12 +32,29 @@ static inline void start_trace_profiling(TranslationBlock *tb)
 #endif
 }
 
+/* Copy the guest code of tb, one page at a time. The code TLB entry is
+ * normally still valid after the block was translated, so the code can be
+ * copied from the host memory directly. Otherwise, it is loaded byte by
+ * byte through the softmmu. */
 static inline void copy_image(CPUArchState *env, TranslationBlock *tb)
 {
 #if defined(CONFIG_LLVM) && defined(CONFIG_SOFTMMU)
-    char *p = new char[tb->size];
-    for (int i = 0, e = tb->size; i != e; ++i)
-        p[i] = cpu_ldub_code(env, tb->pc + i);
+    char *p = (char *)TBArena.allocate(tb->size, 1);
+    int mmu_idx = cpu_mmu_index(env, true);
+    target_ulong pc = tb->pc;
+    int i = 0, e = tb->size;
+    while (i != e) {
+        int len = std::min<int>(e - i, TARGET_PAGE_SIZE -
+                                       ((pc + i) & ~TARGET_PAGE_MASK));
+        void *host = tlb_vaddr_to_host(env, pc + i, 2, mmu_idx);
+        if (host)
+            memcpy(p + i, host, len);
+        else {
+            for (int j = i; j != i + len; ++j)
+                p[j] = cpu_ldub_code(env, pc + j);
+        }
+        i += len;
+    }
     tb->image = (void *)p;
 #endif
 }
@@ -61,6 +81,11 @@ static inline void tracer_handle_chaining(uintptr_t next_tb, TranslationBlock *t
 #include "llvm-hard-perfmon.h"
 static inline void OptimizeBlock(CPUArchState *env, TranslationBlock *TB)
 {
+    /* The translator threads rebuild the block from the saved states. */
+    if (LLVMEnv::AsyncBlock) {
+        tcg_save_state(env, TB);
+        copy_image(env, TB);
+    }
     auto Request = OptimizationInfo::CreateRequest(TB);
     LLVMEnv::OptimizeBlock(env, std::move(Request));
 }
@@ -70,6 +95,19 @@ static inline void OptimizeTrace(CPUArchState *env, NETTracer::TBVec &TBs,
     auto Request = OptimizationInfo::CreateRequest(TBs, LoopHeadIdx);
     LLVMEnv::OptimizeTrace(env, std::move(Request));
 }
+static inline int ExtendTrace(CPUArchState *env, TranslationBlock *Anchor,
+                              NETTracer::TBVec &TBs)
+{
+    return LLVMEnv::ExtendTrace(env, Anchor, TBs);
+}
+static inline unsigned HotThreshold(TranslationBlock *TB)
+{
+    return LLVMEnv::getProfileThreshold(TB);
+}
+static inline void ProfileEdge(TranslationBlock *Pred, TranslationBlock *Succ)
+{
+    LLVMEnv::ProfileEdge(Pred, Succ);
+}
 static inline void RegisterThread(CPUArchState *env, BaseTracer *tracer)
 {
     if (ENV_GET_CPU(env)->cpu_index < 0)
@@ -82,6 +120,13 @@ static inline void UnregisterThread(CPUArchState *env, BaseTracer *tracer)
         return;
     HP->UnregisterThread(tracer);
     SP->NumTraceExits += env->num_trace_exits;
+
+    uint64_t Total, Miss;
+    unsigned NumPage;
+    if (lpt_get_stats(env, &Total, &Miss, &NumPage)) {
+        SP->NumLPTFlush += Total;
+        SP->NumLPTFalseFlush += Miss;
+    }
 }
 static inline void NotifyCacheEnter(CPUArchState *env)
 {
@@ -98,6 +143,13 @@ static inline void NotifyCacheLeave(CPUArchState *env)
 #else
 static inline void OptimizeBlock(CPUArchState *, TranslationBlock *) {}
 static inline void OptimizeTrace(CPUArchState *, NETTracer::TBVec &, int) {}
+static inline int ExtendTrace(CPUArchState *, TranslationBlock *,
+                              NETTracer::TBVec &) { return 0; }
+static inline unsigned HotThreshold(TranslationBlock *)
+{
+    return atomic_read(&ProfileThreshold);
+}
+static inline void ProfileEdge(TranslationBlock *, TranslationBlock *) {}
 static inline void RegisterThread(CPUArchState *, BaseTracer *) {}
 static inline void UnregisterThread(CPUArchState *, BaseTracer *) {}
 static inline void NotifyCacheEnter(CPUArchState *) {}
@@ -117,9 +169,8 @@ BaseTracer *BaseTracer::CreateTracer(CPUArchState *env)
         case TRANS_MODE_BLOCK:
             return new SingleBlockTracer(env);
         case TRANS_MODE_HYBRIDS:
-            return new NETTracer(env, TRANS_MODE_HYBRIDS);
         case TRANS_MODE_HYBRIDM:
-            return new NETTracer(env, TRANS_MODE_HYBRIDM);
+            return CreateRegionTracer(env, LLVMEnv::TransMode);
         default:
             break;
     }
@@ -127,6 +178,22 @@ BaseTracer *BaseTracer::CreateTracer(CPUArchState *env)
     return new BaseTracer(env);
 }
 
+/* Create the trace-mode tracer of the selected region formation strategy. */
+BaseTracer *BaseTracer::CreateRegionTracer(CPUArchState *env, int Mode)
+{
+    switch (RegionFormation) {
+        case REGION_NET_STRICT:
+            return new NETTracer(env, Mode, false);
+        case REGION_LEI:
+            return new LEITracer(env, Mode);
+        case REGION_TRACETREE:
+            return new TraceTreeTracer(env, Mode);
+        case REGION_NET:
+        default:
+            return new NETTracer(env, Mode);
+    }
+}
+
 void BaseTracer::DeleteTracer(CPUArchState *env)
 {
     auto Tracer = cpu_get_tracer(env);
@@ -158,7 +225,8 @@ void SingleBlockTracer::Record(uintptr_t next_tb, TranslationBlock *tb)
 /*
  * NETTracer
  */
-NETTracer::NETTracer(CPUArchState *env, int Mode) : BaseTracer(env)
+NETTracer::NETTracer(CPUArchState *env, int Mode, bool relaxed)
+    : BaseTracer(env), Relaxed(relaxed)
 {
     if (tracer_mode == TRANS_MODE_NONE)
         tracer_mode = Mode;
@@ -187,8 +255,11 @@ void NETTracer::Record(uintptr_t next_tb, TranslationBlock *tb)
     }
 
     if (isTraceHead(next_tb, tb, NewTB)) {
-        if (update_tb_mode(tb, BLOCK_ACTIVE, BLOCK_TRACEHEAD))
+        if (update_tb_mode(tb, BLOCK_ACTIVE, BLOCK_TRACEHEAD)) {
+            /* Fix the threshold of this head for the current phase. */
+            tb->hot_threshold = HotThreshold(tb);
             start_trace_profiling(tb);
+        }
     }
 
     Env->fallthrough = 0;
@@ -212,24 +283,24 @@ bool NETTracer::isTraceHead(uintptr_t next_tb, TranslationBlock *tb, bool NewTB)
     if (next_tb == 0 && Env->fallthrough == 0)
         return true;
 
-#ifdef USE_RELAXED_NET
-    /* Rule 3: a block in a cyclic path (i.e., seen more than once). */
-    if (!NewTB)
-        return true;
-#else
-    /* Rule 3: a target of a backward branch. */
-    if (next_tb != 0) {
-        TranslationBlock *pred = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
-        if (tb->pc <= pred->pc)
+    if (Relaxed) {
+        /* Rule 3: a block in a cyclic path (i.e., seen more than once). */
+        if (!NewTB)
             return true;
+    } else {
+        /* Rule 3: a target of a backward branch. */
+        if (next_tb != 0) {
+            TranslationBlock *pred = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+            if (tb->pc <= pred->pc)
+                return true;
+        }
     }
-#endif
     return false;
 }
 
 void NETTracer::Profile(TranslationBlock *tb)
 {
-    if (Atomic<uint32_t>::inc_return(&tb->exec_count) != ProfileThreshold)
+    if (Atomic<uint32_t>::inc_return(&tb->exec_count) != tb->hot_threshold)
         return;
 
 #if 0
@@ -255,6 +326,10 @@ void NETTracer::Predict(TranslationBlock *tb)
      * head or middle of the buffer.) */
     int LoopHeadIdx = -1;
 
+    /* Weight the edge in the global CFG for NETPlus expansion. */
+    if (!TBs.empty())
+        ProfileEdge(TBs.back(), tb);
+
 #if defined(CONFIG_LLVM)
     /* Skip this trace if the next block is an annotated loop head and
      * is going to be included in the middle of a trace. */
@@ -271,16 +346,16 @@ void NETTracer::Predict(TranslationBlock *tb)
         LoopHeadIdx = 0;
         goto trace_building;
     }
-#elif defined(USE_RELAXED_NET)
-    /* Find any cyclic path in recently recorded blocks. */
-    for (int i = 0, e = TBs.size(); i != e; ++i) {
-        if (tb == TBs[i]) {
-            LoopHeadIdx = i;
-            goto trace_building;
-        }
-    }
 #else
-    if (!TBs.empty()) {
+    if (Relaxed) {
+        /* Find any cyclic path in recently recorded blocks. */
+        for (int i = 0, e = TBs.size(); i != e; ++i) {
+            if (tb == TBs[i]) {
+                LoopHeadIdx = i;
+                goto trace_building;
+            }
+        }
+    } else if (!TBs.empty()) {
         if (tb == TBs[0]) {
             /* Cyclic path. */
             LoopHeadIdx = 0;
@@ -302,6 +377,12 @@ void NETTracer::Predict(TranslationBlock *tb)
     return;
 
 trace_building:
+    BuildTrace(LoopHeadIdx);
+    Reset();
+}
+
+void NETTracer::BuildTrace(int LoopHeadIdx)
+{
     /* If the trace is a loop with a branch to the middle of the loop body,
      * we forms two sub-traces: (1) the loop starting from the loopback to
      * the end of the trace and (2) the original trace. */
@@ -314,8 +395,159 @@ trace_building:
         OptimizeTrace(Env, Loop, 0);
     }
     OptimizeTrace(Env, TBs, LoopHeadIdx);
+}
 
-    Reset();
+
+/*
+ * LEITracer
+ */
+LEITracer::LEITracer(CPUArchState *env, int Mode) : NETTracer(env, Mode) {}
+
+void LEITracer::Reset()
+{
+    History.clear();
+    Env->start_trace_prediction = 1;
+}
+
+void LEITracer::Record(uintptr_t next_tb, TranslationBlock *tb)
+{
+    /* LEI does not profile trace heads. Only promote new blocks. */
+    if (update_tb_mode(tb, BLOCK_NONE, BLOCK_ACTIVE)) {
+        tcg_save_state(Env, tb);
+        copy_image(Env, tb);
+    }
+
+    /* The prediction stub of every block feeds the history buffer. */
+    Env->start_trace_prediction = 1;
+    Env->fallthrough = 0;
+}
+
+void LEITracer::Predict(TranslationBlock *tb)
+{
+    /* Search the previous occurrence of tb, starting from the most recent
+     * one. A hit means the blocks after it form the last iteration of a
+     * cycle. */
+    int LoopHeadIdx = -1;
+    for (int i = History.size() - 1; i >= 0; --i) {
+        if (History[i] == tb) {
+            LoopHeadIdx = i;
+            break;
+        }
+    }
+
+    if (LoopHeadIdx != -1 && tb->mode == BLOCK_ACTIVE &&
+        Atomic<uint32_t>::inc_return(&tb->exec_count) >= HotThreshold(tb) &&
+        update_tb_mode(tb, BLOCK_ACTIVE, BLOCK_TRACEHEAD)) {
+        TBs.assign(History.begin() + LoopHeadIdx, History.end());
+        OptimizeTrace(Env, TBs, 0);
+        TBs.clear();
+        History.clear();
+        return;
+    }
+
+    History.push_back(tb);
+    if (History.size() > PredictThreshold)
+        History.pop_front();
+}
+
+
+/*
+ * TraceTreeTracer
+ */
+static hqemu::Mutex AnchorLock;
+static std::map<target_ulong, TranslationBlock *> Anchors;
+
+TraceTreeTracer::TraceTreeTracer(CPUArchState *env, int Mode)
+    : NETTracer(env, Mode, false) {}
+
+/* A tree is anchored at (1) a target of a backward branch (i.e., a loop
+ * header), or a branch trace starts from (2) a target of an existing trace
+ * exit. */
+bool TraceTreeTracer::isTraceHead(uintptr_t next_tb, TranslationBlock *tb,
+                                  bool NewTB)
+{
+    if ((next_tb & TB_EXIT_MASK) == TB_EXIT_LLVM)
+        return true;
+    if (next_tb != 0) {
+        TranslationBlock *pred = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+        if (tb->pc <= pred->pc)
+            return true;
+    }
+    return false;
+}
+
+void TraceTreeTracer::ResetAnchors()
+{
+    hqemu::MutexGuard locked(AnchorLock);
+    Anchors.clear();
+}
+
+TranslationBlock *TraceTreeTracer::findAnchor(TranslationBlock *tb)
+{
+    hqemu::MutexGuard locked(AnchorLock);
+    for (int i = 0; i < 2; ++i) {
+        target_ulong pc = tb->jmp_pc[i];
+        if (pc == (target_ulong)-1)
+            continue;
+        auto I = Anchors.find(pc);
+        if (I == Anchors.end())
+            continue;
+
+        TranslationBlock *Anchor = I->second;
+        if (Anchor->pc == pc && Anchor->mode == BLOCK_OPTIMIZED)
+            return Anchor;
+
+        /* Drop the stale anchor whose tree has been removed. The anchor of
+         * a tree still being compiled is kept. */
+        if (Anchor->pc != pc || Anchor->mode != BLOCK_TRACEHEAD)
+            Anchors.erase(I);
+    }
+    return nullptr;
+}
+
+void TraceTreeTracer::Predict(TranslationBlock *tb)
+{
+    if (!TBs.empty()) {
+        ProfileEdge(TBs.back(), tb);
+        if (tb == TBs[0]) {
+            /* The path returns to the anchor. Form a new tree. */
+            {
+                hqemu::MutexGuard locked(AnchorLock);
+                Anchors[tb->pc] = tb;
+            }
+            OptimizeTrace(Env, TBs, 0);
+            Reset();
+            return;
+        }
+
+        for (auto TB : TBs) {
+            if (TB == tb) {
+                /* An inner loop not passing the anchor. The inner loop
+                 * forms its own tree, so we stop at its header. */
+                OptimizeTrace(Env, TBs, -1);
+                Reset();
+                return;
+            }
+        }
+    }
+
+    TBs.push_back(tb);
+
+    /* A path from a side exit that returns to an existing tree is attached
+     * to that tree. */
+    TranslationBlock *Anchor = findAnchor(tb);
+    if (Anchor && Anchor != TBs[0]) {
+        if (!ExtendTrace(Env, Anchor, TBs))
+            OptimizeTrace(Env, TBs, -1);
+        Reset();
+        return;
+    }
+
+    /* The path does not return within the maximum length. */
+    if (TBs.size() == PredictThreshold) {
+        OptimizeTrace(Env, TBs, -1);
+        Reset();
+    }
 }
 
 
@@ -338,6 +570,10 @@ void tracer_exec_tb(CPUArchState *env, uintptr_t next_tb, TranslationBlock *tb)
     auto Tracer = cpu_get_tracer(env);
     Tracer->Record(next_tb, tb);
 
+    /* The block code does not push or pop the shadow return stack. */
+    if (tb->mode != BLOCK_OPTIMIZED)
+        shadow_stack_reset(env);
+
     tracer_handle_chaining(next_tb, tb);
 }
 
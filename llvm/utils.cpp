@@ -8,26 +8,26 @@
 #include "utils.h"
 
 
-/* Remove a CFG starting from Root. */
-void GraphNode::DeleteCFG(GraphNode *Root)
-{
-    NodeVec VisitStack;
-    NodeSet Visited;
-    VisitStack.push_back(Root);
-    do {
-        GraphNode *Parent = VisitStack.back();
-        VisitStack.pop_back();
-        if (Visited.find(Parent) == Visited.end()) {
-            Visited.insert(Parent);
-            for (auto Child : Parent->getChildren())
-                VisitStack.push_back(Child);
-        }
-    } while(!VisitStack.empty());
+ArenaPool TBArena;
+
+/* The arena of the current thread. TBArena is the only pool, so one cached
+ * arena per thread is enough. */
+static __thread ArenaPool *LocalPool;
+static __thread Arena *LocalArena;
 
-    for (auto I = Visited.begin(), E = Visited.end(); I != E; ++I)
-        delete *I;
+Arena *ArenaPool::getLocalArena()
+{
+    if (likely(LocalPool == this))
+        return LocalArena;
+
+    hqemu::MutexGuard locked(Lock);
+    Arenas.push_back(new Arena);
+    LocalPool = this;
+    LocalArena = Arenas.back();
+    return LocalArena;
 }
 
+
 #ifdef LOCK_FREE
 /*  Lock-free FIFO queue algorithm of Michael and Scott (MS-queue).
  *  The code is based on the paper published in PODC'96:
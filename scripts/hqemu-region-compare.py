@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+#
+# Compare the region formation strategies of HQEMU on a workload.
+#
+# The workload is run once per strategy with the region profile enabled and
+# the coverage, number of regions, compile volume and run time are reported
+# side by side.
+#
+# Usage:
+#   hqemu-region-compare.py [-m MODE] [-s net,lei,...] [-c 'LLVM_CMD opts'] \
+#       -- qemu-x86_64 ./workload args...
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+from __future__ import print_function
+
+import optparse
+import os
+import re
+import subprocess
+import sys
+import time
+
+STRATEGIES = ['net', 'net-strict', 'lei', 'tracetree']
+
+PATTERNS = [
+    ('regions', re.compile(r'Num of Regions\s*:\s*(\d+)/(\d+)')),
+    ('volume', re.compile(r'Compile Volume\s*:\s*(\d+) blocks, (\d+) insns, (\d+) bytes')),
+    ('trans', re.compile(r'Translation Time\s*:\s*([\d.]+) seconds')),
+    ('coverage', re.compile(r'Block Coverage\s*:\s*(\d+)/(\d+) \(([\d.]+)%\)')),
+]
+
+
+def run(strategy, mode, cmd_opts, workload):
+    env = dict(os.environ)
+    env['LLVM_MODE'] = mode
+    env['LLVM_CMD'] = ' '.join(['-region=' + strategy, '-profile=region'] +
+                               cmd_opts.split())
+
+    start = time.time()
+    proc = subprocess.Popen(workload, env=env, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE, universal_newlines=True)
+    _, err = proc.communicate()
+    elapsed = time.time() - start
+
+    stat = {'time': elapsed, 'status': proc.returncode}
+    in_region = False
+    for line in err.splitlines():
+        if line.startswith('Region statistic'):
+            in_region = True
+            continue
+        if not in_region:
+            continue
+        for key, pattern in PATTERNS:
+            m = pattern.search(line)
+            if m:
+                stat[key] = m.groups()
+    return stat
+
+
+def main():
+    parser = optparse.OptionParser(
+        usage='%prog [options] -- QEMU [QEMU options] PROGRAM [ARGS]')
+    parser.add_option('-m', '--mode', default='hybridm',
+                      help='LLVM_MODE used for all runs (default: hybridm)')
+    parser.add_option('-s', '--strategies', default=','.join(STRATEGIES),
+                      help='comma separated strategies to compare')
+    parser.add_option('-c', '--cmd', default='',
+                      help='additional LLVM_CMD options for all runs')
+    opts, workload = parser.parse_args()
+    if not workload:
+        parser.error('no workload given')
+
+    fmt = '%-11s %9s %9s %9s %10s %10s %9s %9s'
+    print(fmt % ('strategy', 'regions', 'compiled', 'blocks', 'insns',
+                 'host(B)', 'cover(%)', 'time(s)'))
+    for strategy in opts.strategies.split(','):
+        stat = run(strategy, opts.mode, opts.cmd, workload)
+        if 'regions' not in stat:
+            print('%-11s no region statistic (exit status %d)' %
+                  (strategy, stat['status']))
+            continue
+        volume = stat.get('volume', ('-', '-', '-'))
+        coverage = stat.get('coverage', ('-', '-', '-'))
+        print(fmt % (strategy, stat['regions'][0], stat['regions'][1],
+                     volume[0], volume[1], volume[2],
+                     coverage[2], '%.2f' % stat['time']))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
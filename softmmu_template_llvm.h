@@ -31,7 +31,7 @@
 WORD_TYPE llvm_le_ld_name(CPUArchState *env, target_ulong addr, TCGMemOpIdx oi)
 {
     unsigned mmu_idx = get_mmuidx((uint16_t)oi);
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     tlbaddr_t tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     uintptr_t haddr;
     DATA_TYPE res;
@@ -53,6 +53,7 @@ WORD_TYPE llvm_le_ld_name(CPUArchState *env, target_ulong addr, TCGMemOpIdx oi)
             tlb_fill(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
                      mmu_idx, retaddr);
         }
+        index = tlb_index(env, mmu_idx, addr);
         tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     }
 
@@ -116,7 +117,7 @@ WORD_TYPE llvm_le_ld_name(CPUArchState *env, target_ulong addr, TCGMemOpIdx oi)
 WORD_TYPE llvm_be_ld_name(CPUArchState *env, target_ulong addr, TCGMemOpIdx oi)
 {
     unsigned mmu_idx = get_mmuidx((uint16_t)oi);
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     tlbaddr_t tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     uintptr_t haddr;
     DATA_TYPE res;
@@ -138,6 +139,7 @@ WORD_TYPE llvm_be_ld_name(CPUArchState *env, target_ulong addr, TCGMemOpIdx oi)
             tlb_fill(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
                      mmu_idx, retaddr);
         }
+        index = tlb_index(env, mmu_idx, addr);
         tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     }
 
@@ -216,7 +218,7 @@ void llvm_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
                      TCGMemOpIdx oi)
 {
     unsigned mmu_idx = get_mmuidx((uint16_t)oi);
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     tlbaddr_t tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     uintptr_t haddr;
     uintptr_t retaddr;
@@ -236,6 +238,7 @@ void llvm_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         if (!VICTIM_TLB_HIT(addr_write)) {
             tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
         }
+        index = tlb_index(env, mmu_idx, addr);
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     }
 
@@ -298,7 +301,7 @@ void llvm_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
                      TCGMemOpIdx oi)
 {
     unsigned mmu_idx = get_mmuidx((uint16_t)oi);
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     tlbaddr_t tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     uintptr_t haddr;
     uintptr_t retaddr;
@@ -318,6 +321,7 @@ void llvm_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         if (!VICTIM_TLB_HIT(addr_write)) {
             tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
         }
+        index = tlb_index(env, mmu_idx, addr);
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     }
 
@@ -372,6 +376,17 @@ void llvm_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
 }
 #endif /* DATA_SIZE > 1 */
 
+#if DATA_SIZE == 1
+/* Probe for whether the guest write access is permitted. See probe_write().
+ * The restore point of the trace is encoded in oi as in the store helpers. */
+void glue(llvm_probe_write, MMUSUFFIX)(CPUArchState *env, target_ulong addr,
+                                       TCGMemOpIdx oi)
+{
+    env->restore_val = oi >> 16;
+    probe_write(env, addr, get_mmuidx((uint16_t)oi), GETPC());
+}
+#endif
+
 #endif /* !defined(SOFTMMU_CODE_ACCESS) */
 
 #undef llvm_le_ld_name
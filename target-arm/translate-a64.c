@@ -857,7 +857,7 @@ static int disas_neon_ls_vector(DisasContext *s, int reg, int is_load,
     gen_vector_op3(vop,
                    offsetof(CPUARMState, vfp.regs[reg]),
                    GET_TCGV_I64(tcg_addr),
-                   alignment);
+                   make_vec_memarg(alignment, get_mem_index(s)));
     return 1;
 }
 #endif
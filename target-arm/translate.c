@@ -4493,7 +4493,7 @@ static int disas_neon_ls_vector(DisasContext *s, uint32_t insn, TCGv_i32 addr)
         gen_vector_op3(vop,
                        offsetof(CPUARMState, vfp.regs[rd]),
                        GET_TCGV_I32(addr),
-                       alignment);
+                       make_vec_memarg(alignment, get_mem_index(s)));
         rd += spacing * 2;
         tcg_gen_addi_i32(addr, addr, 16);
     }
@@ -3142,7 +3142,7 @@ static int gen_vload(DisasContext *s, int op, int mod, int modrm, int reg)
         gen_vector_op3(INDEX_op_vload_128,
                        offsetof(CPUX86State, xmm_regs[reg]),
                        (TCGArg)cpu_A0,
-                       alignment);
+                       make_vec_memarg(alignment, s->mem_index));
     } else {
         rm = (modrm & 7) | REX_B(s);
         gen_vector_op3(INDEX_op_vmov_128,
@@ -3178,7 +3178,7 @@ static int gen_vstore(DisasContext *s, int op, int mod, int modrm, int reg)
         gen_vector_op3(INDEX_op_vstore_128,
                        offsetof(CPUX86State, xmm_regs[reg]),
                        (TCGArg)cpu_A0,
-                       alignment);
+                       make_vec_memarg(alignment, s->mem_index));
     } else {
         rm = (modrm & 7) | REX_B(s);
         gen_vector_op3(INDEX_op_vmov_128,
@@ -3231,7 +3231,7 @@ static int gen_tcg_vector(DisasContext *s, int op, int b1, int mod, int modrm, i
         gen_vector_op3(INDEX_op_vload_128,
                        offsetof(CPUX86State, xmm_t0),
                        (TCGArg)cpu_A0,
-                       alignment);
+                       make_vec_memarg(alignment, s->mem_index));
         rm = -1;
     } else {
         rm = (modrm & 7) | REX_B(s);
@@ -5320,6 +5320,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tcg_gen_movi_tl(cpu_T[1], next_eip);
             gen_push_v(s, cpu_T[1]);
             gen_op_jmp_v(cpu_T[0]);
+            s->tb->branch_kind = BRANCH_CALL;
+            s->tb->ret_pc = s->pc;
             s->gen_ibtc = 1;
             gen_eob(s);
             break;
@@ -6845,6 +6847,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         gen_stack_update(s, val + (1 << ot));
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T[0]);
+        s->tb->branch_kind = BRANCH_RET;
         s->gen_ibtc = 1;
         gen_eob(s);
         break;
@@ -6853,6 +6856,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         gen_pop_update(s, ot);
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T[0]);
+        s->tb->branch_kind = BRANCH_RET;
         s->gen_ibtc = 1;
         gen_eob(s);
         break;
@@ -6922,6 +6926,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             }
             tcg_gen_movi_tl(cpu_T[0], next_eip);
             gen_push_v(s, cpu_T[0]);
+            s->tb->branch_kind = BRANCH_CALL;
+            s->tb->ret_pc = s->pc;
             gen_jmp(s, tval);
         }
         break;
@@ -8418,6 +8424,8 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
 
     dc->fallthrough = 0;
     dc->gen_ibtc = 0;
+    tb->branch_kind = BRANCH_NONE;
+    tb->ret_pc = (target_ulong)-1;
     dc->gen_cpbl = 0;
     dc->env = env;
     dc->pe = (flags >> HF_PE_SHIFT) & 1;
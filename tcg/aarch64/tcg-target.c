@@ -1063,6 +1063,19 @@ static void tcg_out_tlb_read(TCGContext *s, TCGReg addr_reg, TCGMemOp opc,
     TCGReg base = TCG_AREG0, x3;
     uint64_t tlb_mask;
 
+#if defined(ENABLE_TLBVERSION)
+    /* The low bits of the tlb comparator hold the tlb version, so the
+       alignment bits cannot be checked.  We check that we don't cross pages
+       using the address of the last byte of the access.  */
+    if (s_mask == 0) {
+        x3 = addr_reg;
+    } else {
+        tcg_out_insn(s, 3401, ADDI, TARGET_LONG_BITS == 64,
+                     TCG_REG_X3, addr_reg, s_mask);
+        x3 = TCG_REG_X3;
+    }
+    tlb_mask = TARGET_PAGE_MASK;
+#else
     /* For aligned accesses, we check the first byte and include the alignment
        bits within the address.  For unaligned access, we check that we don't
        cross pages using the address of the last byte of the access.  */
@@ -1075,17 +1088,40 @@ static void tcg_out_tlb_read(TCGContext *s, TCGReg addr_reg, TCGMemOp opc,
         tlb_mask = TARGET_PAGE_MASK;
         x3 = TCG_REG_X3;
     }
+#endif
 
+#if defined(ENABLE_TLB_RESIZE)
+    /* Extract the TLB entry offset from the address into X0, using the
+       current size of the TLB.
+       X0 = (addr_reg >> (TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS))
+            & env->tlb_mask[mem_index] */
+    tcg_out_shr(s, TARGET_LONG_BITS == 64, TCG_REG_X0, addr_reg,
+                TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS);
+    tcg_out_ldst(s, I3312_LDRX, TCG_REG_TMP, TCG_AREG0,
+                 offsetof(CPUArchState, tlb_mask[mem_index]));
+    tcg_out_insn(s, 3510, AND, TCG_TYPE_I64,
+                 TCG_REG_X0, TCG_REG_X0, TCG_REG_TMP);
+#else
     /* Extract the TLB index from the address into X0.
        X0<CPU_TLB_BITS:0> =
        addr_reg<TARGET_PAGE_BITS+CPU_TLB_BITS:TARGET_PAGE_BITS> */
     tcg_out_ubfm(s, TARGET_LONG_BITS == 64, TCG_REG_X0, addr_reg,
                  TARGET_PAGE_BITS, TARGET_PAGE_BITS + CPU_TLB_BITS);
+#endif
 
     /* Store the page mask part of the address into X3.  */
     tcg_out_logicali(s, I3404_ANDI, TARGET_LONG_BITS == 64,
                      TCG_REG_X3, x3, tlb_mask);
 
+#if defined(ENABLE_TLBVERSION)
+    /* Merge the current tlb version into X3, so that a tlb flush only has to
+       bump the version.  X3 = X3 | env->tlb_version */
+    tcg_out_ldst(s, TARGET_LONG_BITS == 32 ? I3312_LDRW : I3312_LDRX,
+                 TCG_REG_TMP, TCG_AREG0, offsetof(CPUArchState, tlb_version));
+    tcg_out_insn(s, 3510, ORR, TARGET_LONG_BITS == 64,
+                 TCG_REG_X3, TCG_REG_X3, TCG_REG_TMP);
+#endif
+
     /* Add any "high bits" from the tlb offset to the env address into X2,
        to take advantage of the LSL12 form of the ADDI instruction.
        X2 = env + (tlb_offset & 0xfff000) */
@@ -1095,10 +1131,16 @@ static void tcg_out_tlb_read(TCGContext *s, TCGReg addr_reg, TCGMemOp opc,
         base = TCG_REG_X2;
     }
 
+#if defined(ENABLE_TLB_RESIZE)
+    /* Merge the tlb entry offset into X2.
+       X2 = X2 + X0 */
+    tcg_out_insn(s, 3502, ADD, TCG_TYPE_I64, TCG_REG_X2, base, TCG_REG_X0);
+#else
     /* Merge the tlb index contribution into X2.
        X2 = X2 + (X0 << CPU_TLB_ENTRY_BITS) */
     tcg_out_insn(s, 3502S, ADD_LSL, TCG_TYPE_I64, TCG_REG_X2, base,
                  TCG_REG_X0, CPU_TLB_ENTRY_BITS);
+#endif
 
     /* Merge "low bits" from tlb offset, load the tlb comparator into X0.
        X0 = load [X2 + (tlb_offset & 0x000fff)] */
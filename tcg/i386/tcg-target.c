@@ -1265,8 +1265,14 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
 
     tcg_out_compute_gva(s, addrlo, opc, trexw, tv_hrexw);
 
+#if defined(ENABLE_TLB_RESIZE)
+    /* and env->tlb_mask[mem_index], r0 */
+    tcg_out_modrm_offset(s, (OPC_ARITH_GvEv | (ARITH_AND << 3)) + hrexw, r0,
+                         TCG_AREG0, offsetof(CPUArchState, tlb_mask[mem_index]));
+#else
     tgen_arithi(s, ARITH_AND + tlbrexw, r0,
                 (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
+#endif
 
     tcg_out_modrm_sib_offset(s, OPC_LEA + hrexw, r0, TCG_AREG0, r0, 0,
                              offsetof(CPUArchState, tlb_table[mem_index][0])
@@ -912,6 +912,29 @@ static inline unsigned get_mmuidx(TCGMemOpIdx oi)
     return oi & 15;
 }
 
+/**
+ * make_vec_memarg
+ * @align: alignment in bits, or -1 for an unaligned access
+ * @idx: mmu index
+ *
+ * Encode the last parameter of the vload/vstore vector ops.
+ */
+#define VEC_UNALIGNED   0xffff
+static inline TCGArg make_vec_memarg(TCGArg align, unsigned idx)
+{
+    return ((TCGArg)idx << 16) | (align & 0xffff);
+}
+
+static inline unsigned get_vec_align(TCGArg arg)
+{
+    return arg & 0xffff;
+}
+
+static inline unsigned get_vec_mmuidx(TCGArg arg)
+{
+    return (arg >> 16) & 15;
+}
+
 /**
  * tcg_qemu_tb_exec:
  * @env: CPUArchState * for the CPU
@@ -1059,6 +1082,8 @@ void llvm_be_stw_mmu(CPUArchState *env, target_ulong addr, uint16_t val, TCGMemO
 void llvm_be_stl_mmu(CPUArchState *env, target_ulong addr, uint32_t val, TCGMemOpIdx oi);
 void llvm_be_stq_mmu(CPUArchState *env, target_ulong addr, uint64_t val, TCGMemOpIdx oi);
 
+void llvm_probe_write_mmu(CPUArchState *env, target_ulong addr, TCGMemOpIdx oi);
+
 /* Temporary aliases until backends are converted.  */
 #ifdef TARGET_WORDS_BIGENDIAN
 # define helper_ret_ldsw_mmu  helper_be_ldsw_mmu